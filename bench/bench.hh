@@ -0,0 +1,91 @@
+#ifndef BENCH_HH
+#define BENCH_HH
+
+// A minimal microbenchmark harness. Every benchmark is run in growing batches until a batch takes
+// long enough to time reliably, and the suite is printed as JSON so results can be compared
+// between runs.
+
+#include <chrono>
+#include <cstdlib>
+#include <iostream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+#include "../common/types.hh"
+
+using namespace std;
+
+// Keeps the compiler from optimizing away a value that a benchmark computes.
+template <class T>
+inline void keep(const T& value) {
+  asm volatile("" : : "r,m"(value) : "memory");
+}
+
+struct BenchResult {
+  string name;
+  u64 iterations;
+  double ns_per_op;
+  double bytes_per_op;
+};
+
+class BenchSuite {
+  string suite;
+  double min_seconds;
+  string filter;
+  vector<BenchResult> results;
+
+ public:
+  // Accepts "-t seconds" (minimum time per benchmark) and "-f substring" (runs matching
+  // benchmarks only).
+  BenchSuite(const string& suite, int argc, char** argv)
+      : suite(suite), min_seconds(0.2), filter("") {
+    if (argc % 2 != 1) throw runtime_error("wrong number of parameters");
+    for (int i = 1; i < argc; i += 2) {
+      string flag(argv[i]);
+      string value(argv[i + 1]);
+      if (flag == "-t") {
+        min_seconds = stod(value);
+      } else if (flag == "-f") {
+        filter = value;
+      } else {
+        throw runtime_error("unexpected flag: " + flag);
+      }
+    }
+  }
+
+  // Runs `op`, which performs one operation, and records its cost. `bytes_per_op` is the amount
+  // of data one operation processes, if that is meaningful, and is used to report throughput.
+  template <class F>
+  void run(const string& name, F op, double bytes_per_op = 0) {
+    if (filter != "" && name.find(filter) == string::npos) return;
+    u64 iterations = 1;
+    double elapsed = 0;
+    while (true) {
+      auto start = chrono::steady_clock::now();
+      for (u64 i = 0; i < iterations; i++) op();
+      elapsed = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+      if (elapsed >= min_seconds || iterations >= (1ULL << 40)) break;
+      // aim a bit past the minimum so that the next batch is usually the last one
+      double scale = elapsed > 0 ? 1.4 * min_seconds / elapsed : 100;
+      iterations = max<u64>(iterations + 1, iterations * min(scale, 100.0));
+    }
+    results.push_back({name, iterations, elapsed * 1e9 / iterations, bytes_per_op});
+    cerr << name << ": " << results.back().ns_per_op << " ns/op" << endl;
+  }
+
+  void print_json(ostream& out) {
+    out << "{\n  \"suite\": \"" << suite << "\",\n  \"min_seconds\": " << min_seconds
+        << ",\n  \"results\": [";
+    for (size_t i = 0; i < results.size(); i++) {
+      auto& r = results[i];
+      out << (i == 0 ? "" : ",") << "\n    {\"name\": \"" << r.name
+          << "\", \"iterations\": " << r.iterations << ", \"ns_per_op\": " << r.ns_per_op
+          << ", \"ops_per_s\": " << 1e9 / r.ns_per_op;
+      if (r.bytes_per_op > 0) out << ", \"mb_per_s\": " << r.bytes_per_op * 1e3 / r.ns_per_op;
+      out << "}";
+    }
+    out << "\n  ]\n}\n";
+  }
+};
+
+#endif
@@ -0,0 +1,444 @@
+// Microbenchmarks for the client's hot paths: decoding messages from proxies, dispatching events
+// in the model and rendering the menu. Run with `make bench`.
+
+#include <fcntl.h>
+#include <atomic>
+#include <iostream>
+#include <limits>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+#include "bench.hh"
+#include "mock_socket.hh"
+// the client headers expect the standard library to be visible already
+#include "../client/model.hh"
+#include "../client/proxy.hh"
+#include "../client/registry.hh"
+#include "../client/ui.hh"
+#include "../client/utils.hh"
+
+using namespace std;
+
+class ClientBench {
+ public:
+  static sockaddr_in proxy_addr(u32 i) {
+    sockaddr_in addr;
+    memset(&addr, 0, sizeof addr);
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(0x0A000000 + i);
+    addr.sin_port = htons(16000);
+    return addr;
+  }
+
+  static vector<shared_ptr<ProxyInfo>> make_proxies(u32 count) {
+    vector<shared_ptr<ProxyInfo>> proxies;
+    for (u32 i = 0; i < count; i++) {
+      auto addr = proxy_addr(i);
+      proxies.push_back(make_shared<ProxyInfo>("Radio Benchmark " + to_string(i),
+                                               "Benchmark Artist - Benchmark Title",
+                                               hash_sockaddr_in(addr), now(), i == 0, addr));
+    }
+    return proxies;
+  }
+
+  // Adds `count` telnet sessions over socketpairs to `telnet`, which does not have to listen.
+  // Returns the other ends, which drain has to read before the sessions fall behind.
+  static vector<int> open_sessions(TelnetServer& telnet, u32 count) {
+    if (telnet.epoll_fd < 0) telnet.epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    vector<int> peers;
+    for (u32 i = 0; i < count; i++) {
+      int fds[2];
+      if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, fds) < 0)
+        throw runtime_error("socketpair failed");
+      fcntl(fds[1], F_SETFL, O_NONBLOCK);
+      lock_guard<mutex> lock_g(telnet.lock);
+      telnet.open_session(fds[0]);
+      peers.push_back(fds[1]);
+    }
+    return peers;
+  }
+
+  static void drain(const vector<int>& peers) {
+    static char buf[1 << 16];
+    for (int fd : peers) {
+      while (read(fd, buf, sizeof buf) > 0) {
+      }
+    }
+  }
+
+  static void close_all(const vector<int>& peers) {
+    for (int fd : peers) close(fd);
+  }
+
+  static void proxy_registry(BenchSuite& suite, u32 count) {
+    ProxyRegistry registry(5000);
+    for (auto& proxy : make_proxies(count)) registry.insert(proxy);
+    u32 i = 0;
+    suite.run("proxy_registry_find_" + to_string(count), [&] {
+      keep(registry.find(hash_sockaddr_in(proxy_addr(i++ % count))).get());
+    });
+    auto extra = make_proxies(count + 1).back();
+    suite.run("proxy_registry_insert_erase_" + to_string(count), [&] {
+      registry.insert(extra);
+      registry.erase(extra->id);
+    });
+  }
+
+  // One operation is the timeout, 5 s, of expiry checks every 100 ms with `count` proxies that
+  // keep being heard from.
+  static void proxy_registry_expire(BenchSuite& suite, u32 count) {
+    ProxyRegistry registry(5000);
+    auto proxies = make_proxies(count);
+    for (auto& proxy : proxies) registry.insert(proxy);
+    i64 time = now();
+    suite.run("proxy_registry_expire_" + to_string(count), [&] {
+      for (auto& proxy : proxies) proxy->last_contact = time;
+      for (u32 step = 0; step < 50; step++) {
+        time += 100;
+        keep(registry.expire(time).size());
+      }
+    });
+    if (registry.size() != count) throw runtime_error("a proxy expired");
+  }
+
+  static void parse_metadata(BenchSuite& suite) {
+    string meta = "StreamTitle='Benchmark Artist - Benchmark Title (Radio Edit)';StreamUrl='';";
+    suite.run("parse_metadata", [&] { keep(::parse_metadata(meta).size()); }, meta.size());
+  }
+
+  // The menu as the model renders it for one telnet session at the top of the list.
+  static void generate_ui(BenchSuite& suite, u32 count) {
+    auto proxies = make_proxies(count);
+    vector<pair<int, int>> shown{{0, 40}};
+    suite.run("generate_ui_" + to_string(count),
+              [&] { keep(::generate_ui(proxies, shown).size()); });
+  }
+
+  static void process_msg(BenchSuite& suite) {
+    const size_t len = 1024;
+    ProxyClient client("localhost", 16000, [](Event&&) { return true; }, nullptr);
+    client.msg_len = encode_header<AUDIO>(client.msg_buf, len);
+    memset(client.msg_buf + HEADER_SIZE, 0x55, len);
+    client.msg_sender = proxy_addr(0);
+    suite.run("proxy_client_process_audio", [&] { client.process_msg(); }, len);
+  }
+
+  // AUDIO datagrams of the proxy being played, received into slots of the output like
+  // ProxyClient::receive_msg does it and written to /dev/null. One operation is a writev.
+  static void play_audio(BenchSuite& suite) {
+    const size_t len = 1024;
+    const size_t per_write = 64;
+    auto output = make_shared<AudioOutput>(open("/dev/null", O_WRONLY | O_CLOEXEC), 0);
+    ProxyClient client("localhost", 16000, [](Event&&) { return true; }, output);
+    vector<u8> datagram(HEADER_SIZE + len, 0x55);
+    encode_header<AUDIO>(datagram.data(), len);
+    auto addr = proxy_addr(0);
+    client.msg_sender = addr;
+    client.play(hash_sockaddr_in(addr), 0);
+    suite.run(
+        "proxy_client_play_audio_64",
+        [&] {
+          for (size_t i = 0; i < per_write; i++) {
+            u32 slot;
+            if (client.msg_slot < 0 && output->take_slot(slot)) client.msg_slot = slot;
+            client.msg_data =
+                client.msg_slot >= 0 ? output->slot_data(client.msg_slot) : client.msg_buf;
+            memcpy(client.msg_data, datagram.data(), datagram.size());
+            client.msg_len = datagram.size();
+            client.process_msg();
+          }
+          output->write_pending();
+        },
+        len * per_write);
+  }
+
+  // AUDIO datagrams read from a socket and played, with recvmmsg like ProxyClient does it and,
+  // for comparison, with a recvfrom per datagram like it did before. The datagrams come from a
+  // local datagram socket pair, since sendto is mocked. One operation is 32 datagrams.
+  static void receive_audio(BenchSuite& suite) {
+    const size_t len = 1024;
+    const size_t per_op = 32;
+    int pair[2];
+    if (socketpair(AF_UNIX, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0, pair) < 0)
+      throw runtime_error("socketpair failed");
+    vector<u8> datagram(HEADER_SIZE + len, 0x55);
+    encode_header<AUDIO>(datagram.data(), len);
+    // sent with a single sendmmsg, so that sending costs little next to receiving
+    mmsghdr msgs[per_op];
+    iovec iov = {datagram.data(), datagram.size()};
+    memset(msgs, 0, sizeof msgs);
+    for (auto& msg : msgs) {
+      msg.msg_hdr.msg_iov = &iov;
+      msg.msg_hdr.msg_iovlen = 1;
+    }
+    auto send_all = [&] {
+      if (sendmmsg(pair[1], msgs, per_op, 0) != static_cast<int>(per_op))
+        throw runtime_error("sendmmsg failed");
+    };
+
+    auto output = make_shared<AudioOutput>(open("/dev/null", O_WRONLY | O_CLOEXEC), 0);
+    ProxyClient client("localhost", 16000, [](Event&&) { return true; }, output);
+    client.sock = pair[0];
+    // datagrams on the socket pair come from no address, so the sender stays the proxy played
+    auto addr = proxy_addr(0);
+    for (auto& sender : client.batch_senders) sender = addr;
+    client.play(hash_sockaddr_in(addr), 0);
+    suite.run(
+        "proxy_client_receive_audio_32",
+        [&] {
+          send_all();
+          size_t received = 0;
+          while (received < per_op) {
+            size_t count = client.receive_batch();
+            for (size_t i = 0; i < count; i++) {
+              client.take_from_batch(i);
+              client.process_msg();
+              if (client.msg_slot >= 0) client.spare_slots.push_back(client.msg_slot);
+              client.msg_slot = -1;
+            }
+            received += count;
+          }
+          output->write_pending();
+        },
+        len * per_op);
+
+    suite.run(
+        "proxy_client_recvfrom_audio_32",
+        [&] {
+          send_all();
+          for (size_t i = 0; i < per_op; i++) {
+            u32 slot;
+            if (client.msg_slot < 0 && output->take_slot(slot)) client.msg_slot = slot;
+            client.msg_data =
+                client.msg_slot >= 0 ? output->slot_data(client.msg_slot) : client.msg_buf;
+            socklen_t addrlen = sizeof client.msg_sender;
+            client.msg_len = recvfrom(pair[0], client.msg_data, AudioOutput::slot_size, 0,
+                                      (sockaddr*)&client.msg_sender, &addrlen);
+            client.msg_sender = addr;
+            client.process_msg();
+          }
+          output->write_pending();
+        },
+        len * per_op);
+    client.sock = -1;
+    close(pair[0]);
+    close(pair[1]);
+  }
+
+  // Batches of two MP3 frames each through the jitter buffer, every fourth pair arriving swapped.
+  // One operation is 64 batches pushed and played.
+  static void jitter_buffer(BenchSuite& suite) {
+    const size_t frame_len = 417;  // MPEG-1 layer III, 128 kbit/s, 44.1 kHz
+    const size_t per_op = 64;
+    vector<u8> batch(2 * frame_len, 0);
+    for (size_t offset = 0; offset < batch.size(); offset += frame_len) {
+      const u8 header[] = {0xFF, 0xFB, 0x90, 0x00};
+      memcpy(batch.data() + offset, header, sizeof header);
+    }
+    JitterBuffer jitter(100, 2000);
+    vector<iovec> out;
+    vector<u32> freed;
+    u32 seq = 0;
+    i64 time = 0;
+    suite.run(
+        "jitter_buffer_reorder_64",
+        [&] {
+          for (size_t i = 0; i < per_op; i++) {
+            u32 packet_seq = i % 8 == 2 ? seq + 1 : i % 8 == 3 ? seq - 1 : seq;
+            jitter.push({static_cast<u32>(i), batch.data(), batch.size(), time, 0, 0, true,
+                         packet_seq},
+                        freed);
+            seq++;
+            time += 52245;  // the time two frames take to play
+          }
+          jitter.pop_due(time + 3000000, out, freed);
+          keep(out.size());
+          out.clear();
+          freed.clear();
+        },
+        batch.size() * per_op);
+  }
+
+  // The searches for where the standby's audio goes on when failing over, in 32 warm datagrams of
+  // MP3 frames whose payload repeats but for a frame number: for the last bytes played, which end
+  // in the 24th datagram, and for a frame to splice at in the datagrams after them.
+  static void failover(BenchSuite& suite) {
+    const size_t frame_len = 417;  // MPEG-1 layer III, 128 kbit/s, 44.1 kHz
+    const size_t datagram_len = 1446;
+    const size_t count = 32;
+    vector<u8> stream(count * datagram_len);
+    for (size_t i = 0; i < stream.size(); i++) stream[i] = i % 128;
+    for (size_t offset = 0; offset + 8 <= stream.size(); offset += frame_len) {
+      const u8 header[] = {0xFF, 0xFB, 0x90, 0x00};
+      memcpy(stream.data() + offset, header, sizeof header);
+      store_be32(stream.data() + offset + sizeof header, offset / frame_len);
+    }
+    auto output = make_shared<AudioOutput>(open("/dev/null", O_WRONLY | O_CLOEXEC), 0);
+    ProxyClient client("localhost", 16000, [](Event&&) { return true; }, output, 400);
+    for (size_t i = 0; i < count; i++) {
+      u32 slot;
+      if (!output->take_slot(slot)) throw runtime_error("no free slot");
+      memcpy(output->slot_data(slot), stream.data() + i * datagram_len, datagram_len);
+      client.warm.push_back({slot, output->slot_data(slot), datagram_len, static_cast<i64>(i), 0,
+                             -1, false, 0});
+    }
+    size_t played = 23 * datagram_len + 700;
+    client.remember_tail(stream.data() + played - ProxyClient::anchor_size,
+                         ProxyClient::anchor_size);
+    client.last_played = 23;
+    size_t first;
+    size_t offset;
+    suite.run("proxy_client_failover_find_tail", [&] { keep(client.find_tail(first, offset)); });
+    suite.run("proxy_client_failover_find_splice",
+              [&] { keep(client.find_splice(first, offset)); });
+  }
+
+  // The menu of 10 proxies with new metadata rendered once and sent to `count` telnet sessions,
+  // which read it right away.
+  static void render_sessions(BenchSuite& suite, u32 count) {
+    TelnetServer telnet(8000, [](Event&&) { return true; });
+    auto peers = open_sessions(telnet, count);
+    auto proxies = make_proxies(10);
+    vector<pair<int, int>> shown{{0, 40}};
+    auto lines = ::generate_ui(proxies, shown);
+    u32 track = 0;
+    suite.run("telnet_render_sessions_" + to_string(count), [&] {
+      lines.back() = "Benchmark Artist - Benchmark Title " + to_string(track++);
+      telnet.render(lines, 12, shown);
+      drain(peers);
+    });
+    if (telnet.num_sessions() != count) throw runtime_error("a telnet session was dropped");
+    close_all(peers);
+  }
+
+  // A model that knows `count` proxies, which do not time out, rendering at most 20 times a
+  // second.
+  static void big_model(BenchSuite& suite, u32 count) {
+    atomic<bool> keep_running = true;
+    Model model(8000, "localhost", 16000, 3600, 0, 20, 0, false, &keep_running);
+    for (u32 i = 0; i < count; i++) {
+      auto addr = proxy_addr(i);
+      model.notify(
+          EventIamSent(hash_sockaddr_in(addr), now(), addr, "Radio Benchmark " + to_string(i)));
+      model.process_event_from_queue();
+    }
+    model.last_keepalive = numeric_limits<i64>::max() / 2;  // no keepalives to the proxies
+
+    // picking a proxy plays it, picking it again stops it
+    u32 i = 0;
+    suite.run("model_select_proxy_" + to_string(count), [&] {
+      model.notify(EventUserInput(2 + (i++ / 2) % count));
+      model.process_event_from_queue();
+    });
+    suite.run("model_tick_" + to_string(count), [&] {
+      model.tick();
+      keep(model.next_tick());
+    });
+  }
+
+  // Events go through Model::notify and Model::process_event_from_queue like they do when
+  // produced by the proxy client thread. Renders go to one telnet session.
+  static void dispatch(BenchSuite& suite) {
+    atomic<bool> keep_running = true;
+    Model model(8000, "localhost", 16000, 5, 0, 0, 0, false, &keep_running);
+    auto peers = open_sessions(*model.telnet, 1);
+    for (u32 i = 0; i < 10; i++) {
+      auto addr = proxy_addr(i);
+      model.notify(
+          EventIamSent(hash_sockaddr_in(addr), now(), addr, "Radio Benchmark " + to_string(i)));
+      model.process_event_from_queue();
+    }
+
+    const size_t len = 1024;
+    u64 inactive_id = hash_sockaddr_in(proxy_addr(1));
+    suite.run(
+        "model_dispatch_audio",
+        [&] {
+          model.notify(EventAudioSent(inactive_id, now(), len, false));
+          model.process_event_from_queue();
+        },
+        len);
+
+    string meta = "StreamTitle='Benchmark Artist - Benchmark Title (Radio Edit)';";
+    suite.run("model_dispatch_meta_render", [&] {
+      model.notify(EventMetaSent(inactive_id, now(), meta));
+      model.process_event_from_queue();
+      drain(peers);
+    });
+    close_all(peers);
+  }
+
+  // AUDIO datagrams decoded by the proxy client on its own thread and dispatched by the model on
+  // this one, like the client does it. One operation is a thousand datagrams.
+  static void events_across_threads(BenchSuite& suite) {
+    const size_t len = 1024;
+    const u64 events_per_op = 1000;
+    atomic<bool> keep_running = true;
+    Model model(8000, "localhost", 16000, 5, 0, 0, 0, false, &keep_running);
+    auto addr = proxy_addr(1);
+    model.notify(EventIamSent(hash_sockaddr_in(addr), now(), addr, "Radio Benchmark"));
+    model.process_event_from_queue();
+
+    ProxyClient& client = *model.proxy_client;
+    client.msg_len = encode_header<AUDIO>(client.msg_buf, len);
+    memset(client.msg_buf + HEADER_SIZE, 0x55, len);
+    client.msg_sender = addr;
+    atomic<u64> requested = 0;
+    atomic<bool> done = false;
+    thread producer([&] {
+      u64 produced = 0;
+      while (!done) {
+        if (produced < requested) {
+          client.process_msg();
+          produced++;
+        } else {
+          this_thread::yield();
+        }
+      }
+    });
+    u64 consumed = 0;
+    suite.run(
+        "model_events_across_threads",
+        [&] {
+          requested += events_per_op;
+          while (consumed < requested) {
+            while (model.process_event_from_queue()) consumed++;
+            this_thread::yield();
+          }
+        },
+        len * events_per_op);
+    done = true;
+    producer.join();
+  }
+};
+
+int main(int argc, char** argv) {
+  try {
+    BenchSuite suite("client", argc, argv);
+    ClientBench::proxy_registry(suite, 10);
+    ClientBench::proxy_registry(suite, 1000);
+    ClientBench::proxy_registry(suite, 10000);
+    ClientBench::proxy_registry_expire(suite, 10000);
+    ClientBench::parse_metadata(suite);
+    ClientBench::generate_ui(suite, 10);
+    ClientBench::generate_ui(suite, 100);
+    ClientBench::generate_ui(suite, 10000);
+    ClientBench::process_msg(suite);
+    ClientBench::play_audio(suite);
+    ClientBench::receive_audio(suite);
+    ClientBench::jitter_buffer(suite);
+    ClientBench::failover(suite);
+    ClientBench::render_sessions(suite, 1);
+    ClientBench::render_sessions(suite, 64);
+    ClientBench::dispatch(suite);
+    ClientBench::big_model(suite, 10000);
+    ClientBench::events_across_threads(suite);
+    suite.print_json(cout);
+    return 0;
+  } catch (exception& e) {
+    cerr << "An error occurred:" << endl;
+    cerr << e.what() << endl;
+    return 1;
+  }
+}
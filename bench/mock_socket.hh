@@ -0,0 +1,47 @@
+#ifndef MOCK_SOCKET_HH
+#define MOCK_SOCKET_HH
+
+// A stand-in for the network so benchmarks measure the code around the sockets and nothing else.
+//
+// Including this header replaces sendto in the whole benchmark binary: datagrams are counted and
+// discarded. Stream sockets are replaced with in-memory files holding a canned byte stream, which
+// the code under test reads with plain read calls like it reads a TCP socket.
+
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <stdexcept>
+#include <string>
+#include "../common/types.hh"
+
+using namespace std;
+
+struct MockSocketStats {
+  u64 datagrams = 0;
+  u64 bytes = 0;
+};
+
+inline MockSocketStats mock_socket_stats;
+
+extern "C" ssize_t sendto(int, const void*, size_t len, int, const sockaddr*, socklen_t) {
+  mock_socket_stats.datagrams++;
+  mock_socket_stats.bytes += len;
+  return len;
+}
+
+// Returns a readable descriptor that yields `data` and then EOF.
+inline conn_t mock_stream(const string& data) {
+  conn_t fd = memfd_create("mock-stream", MFD_CLOEXEC);
+  if (fd < 0) throw runtime_error("memfd_create failed");
+  if (write(fd, data.data(), data.size()) != static_cast<ssize_t>(data.size()))
+    throw runtime_error("write failed");
+  if (lseek(fd, 0, SEEK_SET) < 0) throw runtime_error("lseek failed");
+  return fd;
+}
+
+// Makes a mock stream yield its data from the start again.
+inline void mock_stream_rewind(conn_t fd) {
+  if (lseek(fd, 0, SEEK_SET) < 0) throw runtime_error("lseek failed");
+}
+
+#endif
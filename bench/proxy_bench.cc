@@ -0,0 +1,387 @@
+// Microbenchmarks for the proxy's hot paths: parsing the upstream, the wire codec, framing UDP
+// messages, keeping the client table and the TCP fanout. Run with `make bench`.
+
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <sys/epoll.h>
+#include <iostream>
+#include <random>
+#include <string>
+#include <vector>
+#include "../common/log.hh"
+#include "../proxy/broadcaster.hh"
+#include "../proxy/icy.hh"
+#include "../proxy/packetizer.hh"
+#include "../proxy/redundant.hh"
+#include "../proxy/tcp.hh"
+#include "bench.hh"
+#include "mock_socket.hh"
+
+using namespace std;
+
+class ProxyBench {
+ public:
+  static string icy_response(size_t metaint) {
+    return "ICY 200 OK\r\n"
+           "icy-notice1:<BR>This stream requires a media player<BR>\r\n"
+           "icy-notice2:SHOUTcast Distributed Network Audio Server/Linux v1.9.8<BR>\r\n"
+           "icy-name:Radio Benchmark - the best hits of the 80s, 90s and today\r\n"
+           "icy-genre:Pop\r\n"
+           "icy-url:http://radio.example.com\r\n"
+           "content-type:audio/mpeg\r\n"
+           "icy-pub:1\r\n"
+           "icy-metaint:" +
+           to_string(metaint) +
+           "\r\n"
+           "icy-br:128\r\n"
+           "\r\n";
+  }
+
+  // A metadata interval of audio followed by a metadata block, `periods` times.
+  static string icy_body(size_t metaint, size_t periods) {
+    string title = "StreamTitle='Benchmark Artist - Benchmark Title (Radio Edit)';";
+    size_t blocks = (title.size() + 15) / 16;
+    string meta(1 + blocks * 16, '\0');
+    meta[0] = static_cast<char>(blocks);
+    meta.replace(1, title.size(), title);
+    string body;
+    for (size_t i = 0; i < periods; i++) body += string(metaint, '\x55') + meta;
+    return body;
+  }
+
+  static void parse_headers(BenchSuite& suite) {
+    ICYStream stream("localhost", "/", 8000, 5, true);
+    stream.sock = mock_stream(icy_response(8192));
+    suite.run("icy_parse_headers", [&] {
+      mock_stream_rewind(stream.sock);
+      stream.request_meta = true;
+      stream.parse_headers();
+      keep(stream.meta_offset);
+    });
+  }
+
+  static void read_chunk(BenchSuite& suite, size_t metaint) {
+    const size_t periods = 64;
+    ICYStream stream("localhost", "/", 8000, 5, true);
+    stream.sock = mock_stream(icy_body(metaint, periods));
+    stream.meta_offset = metaint;
+    vector<u8> buf(metaint);
+    size_t chunks = 0;
+    suite.run(
+        "icy_read_chunk_meta_" + to_string(metaint),
+        [&] {
+          if (chunks++ % periods == 0) mock_stream_rewind(stream.sock);
+          ICYPart part = stream.read_chunk(buf.data());
+          keep(part.size);
+        },
+        metaint);
+  }
+
+  static void prepare_msg(BenchSuite& suite, size_t len) {
+    UDPBroadcaster udp(16000, "", "benchmark", 5);
+    vector<u8> data(len, 0x55);
+    suite.run(
+        "udp_prepare_msg_" + to_string(len),
+        [&] {
+          auto msg = udp.prepare_msg(AUDIO, data.data(), data.size());
+          keep(msg.first.get());
+        },
+        len);
+  }
+
+  static void wire(BenchSuite& suite) {
+    vector<u8> datagram(HEADER_SIZE + 1024, 0x55);
+    encode_header<AUDIO>(datagram.data(), 1024);
+    suite.run("wire_decode_audio", [&] {
+      MessageView msg{};
+      keep(decode_message(datagram.data(), datagram.size(), msg));
+      keep(msg.payload);
+    });
+    u16 type = AUDIO;
+    suite.run("wire_encode_header", [&] {
+      keep(type);
+      keep(encode_header(datagram.data(), type, 1024));
+    });
+  }
+
+  static sockaddr_in client_addr(u32 i) {
+    sockaddr_in addr;
+    memset(&addr, 0, sizeof addr);
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(0x0A000000 + i / 50000);
+    addr.sin_port = htons(10000 + i % 50000);
+    return addr;
+  }
+
+  static void add_clients(UDPBroadcaster& udp, u32 count) {
+    for (u32 i = 0; i < count; i++) {
+      auto addr = client_addr(i);
+      udp.clients.emplace(udp.hash_sockaddr_in(addr), make_shared<ClientInfo>(udp.now(), addr, 0));
+    }
+  }
+
+  // One part read from the upstream sent to every client.
+  static void send_to_clients(BenchSuite& suite, u32 num_clients) {
+    const size_t part_size = 8192;
+    UDPBroadcaster udp(16000, "", "benchmark", 5);
+    add_clients(udp, num_clients);
+    vector<u8> data(part_size, 0x55);
+    suite.run(
+        "udp_send_to_clients_" + to_string(num_clients),
+        [&] { udp.send_to_clients(0, AUDIO, data.data(), data.size()); },
+        part_size * num_clients);
+  }
+
+  // Parts as small as a low-bitrate upstream delivers them, sent as AUDIO or batched.
+  static void broadcast_small_parts(BenchSuite& suite, u32 num_clients, bool batched) {
+    const size_t part_size = 80;
+    UDPBroadcaster udp(16000, "", "benchmark", 5);
+    add_clients(udp, num_clients);
+    for (auto& it : udp.clients) it.second->batched = batched;
+    vector<u8> data(part_size, 0x55);
+    ICYPart part(part_size);
+    u64 datagrams_before = mock_socket_stats.datagrams;
+    u64 parts = 0;
+    suite.run(
+        string("udp_broadcast_80b_") + (batched ? "batched_" : "legacy_") + to_string(num_clients),
+        [&] {
+          udp.broadcast(part, data.data());
+          parts++;
+        },
+        part_size * num_clients);
+    cerr << "  datagrams per part: "
+         << (double)(mock_socket_stats.datagrams - datagrams_before) / parts << endl;
+  }
+
+  // 128 kbit/s MPEG-1 layer III frames at 44.1 kHz, with padding like an encoder adds it.
+  static vector<u8> mp3_stream(size_t size) {
+    vector<u8> stream;
+    for (u32 i = 0; stream.size() < size; i++) {
+      bool padding = i % 3 != 0;
+      size_t length = 417 + padding;
+      vector<u8> frame(length, 0x55);
+      frame[0] = 0xFF;
+      frame[1] = 0xFB;
+      frame[2] = 0x90 | (padding << 1);
+      frame[3] = 0x64;
+      stream.insert(stream.end(), frame.begin(), frame.end());
+    }
+    stream.resize(size);
+    return stream;
+  }
+
+  // 96 kbit/s AAC-LC stereo frames at 44.1 kHz.
+  static vector<u8> adts_stream(size_t size) {
+    const size_t length = 279;
+    vector<u8> frame(length, 0x55);
+    u8 header[7] = {0xFF, 0xF1, 0x50, 0x80, 0, 0x1F, 0xFC};
+    header[3] |= length >> 11;
+    header[4] = (length >> 3) & 0xFF;
+    header[5] |= (length & 7) << 5;
+    memcpy(frame.data(), header, sizeof header);
+    vector<u8> stream;
+    while (stream.size() < size) stream.insert(stream.end(), frame.begin(), frame.end());
+    stream.resize(size);
+    return stream;
+  }
+
+  static vector<u8> noise(size_t size) {
+    mt19937 rng(1);
+    vector<u8> data(size);
+    for (auto& byte : data) byte = rng();
+    return data;
+  }
+
+  // Upstream reads pushed through the frame packetizer. Noise exercises the sync search.
+  static void packetize(BenchSuite& suite, const string& name, const vector<u8>& stream) {
+    const size_t part_size = 8192;
+    FramePacketizer packetizer(1024);
+    size_t offset = 0;
+    size_t packets = 0;
+    suite.run(
+        "packetize_" + name,
+        [&] {
+          if (offset + part_size > stream.size()) offset = 0;
+          packetizer.push(stream.data() + offset, part_size,
+                          [&](const u8* packet, size_t len) {
+                            keep(packet);
+                            packets += len > 0;
+                          });
+          offset += part_size;
+        },
+        part_size);
+    keep(packets);
+  }
+
+  static void find_sync(BenchSuite& suite) {
+    vector<u8> data = noise(1 << 16);
+    // no sync candidates at all, so the whole buffer is scanned
+    for (auto& byte : data) byte &= 0x7F;
+    suite.run(
+        "find_sync_64k", [&] { keep(::find_sync(data.data(), data.size(), 0)); }, data.size());
+  }
+
+  // Matching a primary and a standby that are `lag` bytes apart, with full windows. This is what
+  // RedundantStream does once a second.
+  static void align_mirrors(BenchSuite& suite, size_t lag) {
+    RedundantStream stream(make_unique<ICYStream>("localhost", "/", 8000, 5, true),
+                           make_unique<ICYStream>("localhost", "/", 8001, 5, true), 500, 5);
+    vector<u8> audio = mp3_stream(RedundantStream::window + lag);
+    // frames with distinct payloads, like real audio
+    mt19937 rng(1);
+    for (auto& byte : audio) {
+      if (byte == 0x55) byte = rng() & 0x7F;
+    }
+    for (size_t id = 0; id < 2; id++) {
+      auto& mirror = stream.mirrors[id];
+      mirror.connected = true;
+      mirror.start = id == 0 ? lag : 0;
+      mirror.data.assign(audio.begin() + mirror.start,
+                         audio.begin() + mirror.start + RedundantStream::window);
+    }
+    suite.run("align_mirrors_lag_" + to_string(lag), [&] {
+      stream.align();
+      keep(stream.offset);
+    });
+  }
+
+  // A chunk of audio served by the TCP fanout to `count` HTTP listeners on loopback, which read
+  // it from a single epoll loop. One operation is the chunk broadcast and read by all of them.
+  static void tcp_fanout(BenchSuite& suite, u32 count) {
+    const size_t chunk_size = 1024;
+    TCPBroadcaster tcp(0, "benchmark", {}, 8192, count);
+    tcp.init();
+    sockaddr_in addr;
+    socklen_t addr_len = sizeof addr;
+    if (getsockname(tcp.sock, (sockaddr*)&addr, &addr_len) < 0)
+      throw runtime_error("getsockname failed");
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+    int epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (epoll_fd < 0) throw runtime_error("epoll_create1 failed");
+    vector<int> listeners;
+    const string request = "GET / HTTP/1.0\r\n\r\n";
+    for (u32 i = 0; i < count; i++) {
+      int fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+      if (fd < 0) throw runtime_error("socket failed");
+      listeners.push_back(fd);
+      if (connect(fd, (sockaddr*)&addr, sizeof addr) < 0) throw runtime_error("connect failed");
+      if (write(fd, request.data(), request.size()) != static_cast<ssize_t>(request.size()))
+        throw runtime_error("write failed");
+      if (fcntl(fd, F_SETFL, O_NONBLOCK) < 0) throw runtime_error("fcntl failed");
+      epoll_event ev;
+      ev.events = EPOLLIN;
+      ev.data.fd = fd;
+      if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &ev) < 0) throw runtime_error("epoll_ctl failed");
+    }
+
+    vector<u8> data(chunk_size, 0x55);
+    vector<u8> buf(1 << 16);
+    // Reads until `bytes` arrived or nothing did for `idle_ms`, and returns what was read.
+    auto read_listeners = [&](size_t bytes, int idle_ms) {
+      size_t total = 0;
+      epoll_event events[256];
+      while (total < bytes) {
+        int num_events = epoll_wait(epoll_fd, events, 256, idle_ms);
+        if (num_events <= 0) break;
+        for (int i = 0; i < num_events; i++) {
+          ssize_t len;
+          while ((len = read(events[i].data.fd, buf.data(), buf.size())) > 0) total += len;
+        }
+      }
+      return total;
+    };
+    // once every listener is served, a chunk brings exactly its size to each of them and the
+    // response headers are out of the way
+    size_t round = 0;
+    while (read_listeners(SIZE_MAX, 200) != count * chunk_size) {
+      if (++round > 50) throw runtime_error("the listeners were not served");
+      tcp.broadcast(ICYPart(chunk_size), data.data());
+    }
+
+    suite.run(
+        "tcp_fanout_" + to_string(count),
+        [&] {
+          tcp.broadcast(ICYPart(chunk_size), data.data());
+          keep(read_listeners(count * chunk_size, 1000));
+        },
+        chunk_size * count);
+    tcp.clean_up();
+    for (int fd : listeners) close(fd);
+    close(epoll_fd);
+  }
+
+  // A flood of bad datagrams as the UDP server reports it: all but the first messages of every
+  // second are suppressed, so this is mostly the cost of the rate limiter.
+  static void log_rate_limited(BenchSuite& suite) {
+    runtime_error e("unexpected message type");
+    suite.run("log_rate_limited", [&] {
+      LOG_WARN("Could not process an incoming message, skipping it: %s", e.what());
+    });
+  }
+
+  static void set_msg(UDPBroadcaster& udp, u16 type) {
+    udp.msg_len = encode_header(udp.msg_buf, type, 0);
+  }
+
+  // KEEPALIVEs from known clients, i.e. a lookup and an update in the client table.
+  static void process_keepalive(BenchSuite& suite, u32 num_clients) {
+    UDPBroadcaster udp(16000, "", "benchmark", 5);
+    add_clients(udp, num_clients);
+    set_msg(udp, KEEPALIVE);
+    u32 i = 0;
+    suite.run("udp_process_keepalive_" + to_string(num_clients), [&] {
+      udp.msg_sender = client_addr(i++ % num_clients);
+      udp.process_msg();
+    });
+  }
+
+  // A DISCOVER from a new client followed by its removal, i.e. an insertion into and an erasure
+  // from the client table plus the IAM and METADATA responses.
+  static void process_discover(BenchSuite& suite, u32 num_clients) {
+    UDPBroadcaster udp(16000, "", "benchmark", 5);
+    add_clients(udp, num_clients);
+    udp.variants[0]->last_meta = "StreamTitle='Benchmark Artist - Benchmark Title';";
+    set_msg(udp, DISCOVER);
+    u32 i = 0;
+    suite.run("udp_process_discover_" + to_string(num_clients), [&] {
+      udp.msg_sender = client_addr(num_clients + i++ % 1000);
+      udp.process_msg();
+      udp.clients.erase(udp.hash_sockaddr_in(udp.msg_sender));
+    });
+  }
+};
+
+int main(int argc, char** argv) {
+  try {
+    BenchSuite suite("proxy", argc, argv);
+    ProxyBench::parse_headers(suite);
+    ProxyBench::read_chunk(suite, 8192);
+    ProxyBench::read_chunk(suite, 16000);
+    ProxyBench::wire(suite);
+    ProxyBench::find_sync(suite);
+    ProxyBench::packetize(suite, "mp3", ProxyBench::mp3_stream(1 << 20));
+    ProxyBench::packetize(suite, "adts", ProxyBench::adts_stream(1 << 20));
+    ProxyBench::packetize(suite, "noise", ProxyBench::noise(1 << 20));
+    ProxyBench::align_mirrors(suite, 0);
+    ProxyBench::align_mirrors(suite, 300000);
+    ProxyBench::prepare_msg(suite, 1024);
+    ProxyBench::send_to_clients(suite, 1);
+    ProxyBench::send_to_clients(suite, 100);
+    ProxyBench::send_to_clients(suite, 1000);
+    ProxyBench::broadcast_small_parts(suite, 1000, false);
+    ProxyBench::broadcast_small_parts(suite, 1000, true);
+    ProxyBench::process_keepalive(suite, 100);
+    ProxyBench::process_keepalive(suite, 10000);
+    ProxyBench::process_discover(suite, 10000);
+    ProxyBench::tcp_fanout(suite, 100);
+    ProxyBench::tcp_fanout(suite, 5000);
+    ProxyBench::log_rate_limited(suite);
+    suite.print_json(cout);
+    return 0;
+  } catch (exception& e) {
+    cerr << "An error occurred:" << endl;
+    cerr << e.what() << endl;
+    return 1;
+  }
+}
@@ -0,0 +1,141 @@
+// Fuzzes the wire codec. Every input is decoded, and every input that decodes is encoded again and
+// has to come out byte for byte the same.
+//
+// Built by `make fuzz` with a simple random driver that mutates valid messages. With clang it can
+// also be built as a libFuzzer target:
+//   clang++ -std=c++17 -g -O1 -fsanitize=fuzzer,address -DLIBFUZZER bench/wire_fuzz.cc
+
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <random>
+#include <string>
+#include <vector>
+#include "../common/wire.hh"
+
+using namespace std;
+
+static void fail(const string& reason) {
+  cerr << "wire fuzz failure: " << reason << endl;
+  abort();
+}
+
+extern "C" int LLVMFuzzerTestOneInput(const u8* data, size_t size) {
+  MessageView msg;
+  DecodeStatus status = decode_message(data, size, msg);
+  if (status != DecodeStatus::OK) {
+    if (size >= HEADER_SIZE && size == HEADER_SIZE + load_be16(data + 2) &&
+        payload_fits(load_be16(data), size - HEADER_SIZE))
+      fail("a valid message was rejected");
+    return 0;
+  }
+  if (msg.payload != data + HEADER_SIZE || msg.len + HEADER_SIZE != size)
+    fail("the view does not cover the payload");
+  vector<u8> encoded(HEADER_SIZE + msg.len);
+  if (encode_header(encoded.data(), msg.type, msg.len) != size) fail("wrong encoded size");
+  if (msg.len > 0) memcpy(encoded.data() + HEADER_SIZE, msg.payload, msg.len);
+  if (memcmp(encoded.data(), data, size) != 0) fail("the message does not round-trip");
+  if (msg.type == SEEK) {
+    u8 seek[fixed_message_size<SEEK>()];
+    encode_seek(seek, decode_seek(msg));
+    if (memcmp(seek, data, size) != 0) fail("SEEK does not round-trip");
+  }
+  if (msg.type == SELECT) {
+    u8 select[fixed_message_size<SELECT>()];
+    encode_select(select, decode_select(msg));
+    if (memcmp(select, data, size) != 0) fail("SELECT does not round-trip");
+  }
+  if (msg.type == PROBE) {
+    u8 probe[fixed_message_size<PROBE>()];
+    encode_probe(probe, decode_probe(msg));
+    if (memcmp(probe, data, size) != 0) fail("PROBE does not round-trip");
+  }
+  if (msg.type == LOAD) {
+    u8 load[fixed_message_size<LOAD>()];
+    encode_load(load, decode_load(msg));
+    if (memcmp(load, data, size) != 0) fail("LOAD does not round-trip");
+  }
+  if (msg.type == IAM) {
+    string_view name;
+    vector<VariantInfo> variants;
+    if (decode_iam(msg, name, variants) && !variants.empty()) {
+      string payload = encode_iam_variants(string(name), variants);
+      if (payload.size() != msg.len || memcmp(payload.data(), msg.payload, msg.len) != 0)
+        fail("the variants in IAM do not round-trip");
+    }
+  }
+  if (msg.type == BATCH) {
+    // records read from a well-formed batch have to build the same batch again
+    vector<u8> rebuilt(size);
+    BatchWriter writer(rebuilt.data(), rebuilt.size());
+    BatchReader reader(msg);
+    writer.begin(reader.seq);
+    u8 kind;
+    const u8* record;
+    size_t len;
+    while (reader.next(kind, record, len)) {
+      if (record < msg.payload || record + len > msg.payload + msg.len)
+        fail("a record is outside of the batch");
+      writer.add(kind, record, len);
+    }
+    if (reader.ok() && (writer.finish() != size || memcmp(rebuilt.data(), data, size) != 0))
+      fail("the batch does not round-trip");
+  }
+  return 0;
+}
+
+#ifndef LIBFUZZER
+int main(int argc, char** argv) {
+  u64 iterations = argc > 1 ? stoull(argv[1]) : 1000000;
+  mt19937_64 rng(argc > 2 ? stoull(argv[2]) : 1);
+  const u16 types[] = {
+      0, DISCOVER, IAM, KEEPALIVE, AUDIO, 5, METADATA, SEEK, BATCH, CAPS, SELECT, PROBE, LOAD,
+      0xFFFF};
+  vector<u8> buf;
+  for (u64 i = 0; i < iterations; i++) {
+    // start from a valid message most of the time so that decoding gets past the header checks
+    u16 type = types[rng() % size(types)];
+    size_t len = rng() % 4 == 0 ? rng() % 70000 : rng() % 64;
+    if (type == SEEK && rng() % 2 == 0) len = sizeof(u64);
+    if ((type == CAPS || type == SELECT || type == PROBE) && rng() % 2 == 0) len = sizeof(u32);
+    if (type == LOAD && rng() % 2 == 0) len = MessageLayout<LOAD>::max_payload;
+    buf.assign(HEADER_SIZE + len, 0);
+    store_be16(buf.data(), type);
+    store_be16(buf.data() + 2, static_cast<u16>(len));
+    for (size_t j = HEADER_SIZE; j < buf.size(); j++) buf[j] = rng();
+    if (type == BATCH && len >= BATCH_HEADER_SIZE && len <= MAX_PAYLOAD_SIZE && rng() % 2 == 0) {
+      // well-formed records, so that the reader gets past the first one
+      vector<u8> record(buf.begin(), buf.end());
+      BatchWriter writer(buf.data(), buf.size(), buf.size());
+      writer.begin(rng());
+      while (writer.space() > 0) {
+        size_t record_len = min<size_t>(writer.space(), rng() % 300);
+        writer.add(1 + rng() % 2, record.data(), record_len);
+      }
+      buf.resize(writer.finish());
+    }
+    if (type == IAM && rng() % 2 == 0) {
+      // a well-formed variant table, so that decoding gets past the count
+      vector<VariantInfo> variants(rng() % 8);
+      for (auto& variant : variants) variant = {static_cast<u8>(rng()), static_cast<u32>(rng())};
+      string payload = encode_iam_variants(string(rng() % 20, 'a'), variants);
+      buf.resize(HEADER_SIZE + payload.size());
+      encode_header<IAM>(buf.data(), payload.size());
+      memcpy(buf.data() + HEADER_SIZE, payload.data(), payload.size());
+    }
+    switch (rng() % 4) {
+      case 0:  // truncate
+        buf.resize(rng() % (buf.size() + 1));
+        break;
+      case 1:  // flip a byte
+        buf[rng() % buf.size()] ^= 1 + rng() % 255;
+        break;
+      default:
+        break;
+    }
+    LLVMFuzzerTestOneInput(buf.data(), buf.size());
+  }
+  cerr << "wire fuzz: " << iterations << " inputs, no failures" << endl;
+  return 0;
+}
+#endif
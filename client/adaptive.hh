@@ -0,0 +1,121 @@
+#ifndef ADAPTIVE_HH
+#define ADAPTIVE_HH
+
+// Picks the bitrate variant of a station that the link to its proxy can carry.
+
+#include <cmath>
+#include <vector>
+#include "../common/types.hh"
+#include "../common/wire.hh"
+
+using namespace std;
+
+struct LinkQuality {
+  u64 batches;    // received in the window
+  double loss;    // share of batches lost
+  double jitter;  // in milliseconds
+};
+
+// Measures the link from the BATCH messages of one variant. Losses are gaps in sequence numbers.
+// Jitter is estimated like RFC 3550 does, with the duration of the audio received in place of the
+// sender's timestamps, which the protocol does not carry.
+class LinkMonitor {
+  static const i64 window = 2000;  // time in milliseconds
+
+  i64 window_start;
+  u64 received;
+  u64 lost;
+
+  bool seen_batch;
+  u32 last_seq;
+  double last_transit;  // arrival time minus audio time, in milliseconds
+  double audio_time;    // duration of the audio received so far, in milliseconds
+  double jitter;
+
+ public:
+  LinkMonitor() { restart(0); }
+
+  // Starts over, e.g. for another variant, whose batches are numbered separately.
+  void restart(i64 time) {
+    window_start = time;
+    received = 0;
+    lost = 0;
+    seen_batch = false;
+    last_seq = 0;
+    last_transit = 0;
+    audio_time = 0;
+    jitter = 0;
+  }
+
+  // Records a batch carrying `audio_len` bytes of a stream at `bitrate` bits per second. Jitter is
+  // not measured if the bitrate is not known.
+  void on_batch(u32 seq, i64 time, size_t audio_len, u32 bitrate) {
+    double transit = time - audio_time;
+    if (seen_batch) {
+      u32 gap = seq - last_seq;
+      // batches that come late after a newer one were already counted as lost
+      if (gap == 0 || gap > 0x80000000u) return;
+      lost += gap - 1;
+      if (bitrate > 0) jitter += (fabs(transit - last_transit) - jitter) / 16;
+    }
+    received++;
+    seen_batch = true;
+    last_seq = seq;
+    last_transit = transit;
+    if (bitrate > 0) audio_time += audio_len * 8000.0 / bitrate;
+  }
+
+  bool window_done(i64 time) { return time - window_start >= window; }
+
+  i64 window_end() const { return window_start + window; }
+
+  // Returns the quality measured since the last call and starts a new window.
+  LinkQuality take_window(i64 time) {
+    LinkQuality quality;
+    quality.batches = received;
+    quality.loss = received + lost > 0 ? static_cast<double>(lost) / (received + lost) : 1.0;
+    quality.jitter = jitter;
+    window_start = time;
+    received = 0;
+    lost = 0;
+    return quality;
+  }
+};
+
+// Steps down to a lower bitrate after a single bad window and up only after a run of good ones,
+// so that a link on the edge does not flip between variants.
+class VariantPolicy {
+  static constexpr double bad_loss = 0.03;
+  static constexpr double bad_jitter = 100;  // in milliseconds
+  static constexpr double good_loss = 0.005;
+  static constexpr double good_jitter = 40;  // in milliseconds
+  static const u32 good_windows_to_step_up = 5;
+
+  u32 good_windows;
+
+ public:
+  VariantPolicy() : good_windows(0) {}
+
+  void reset() { good_windows = 0; }
+
+  // Returns the id of the variant to play next. `variants` is sorted by bitrate.
+  u32 choose(const LinkQuality& quality, const vector<VariantInfo>& variants, u32 current) {
+    size_t index = 0;
+    while (index < variants.size() && variants[index].id != current) index++;
+    if (index == variants.size()) return current;
+
+    if (quality.loss > bad_loss || quality.jitter > bad_jitter) {
+      good_windows = 0;
+      return index > 0 ? variants[index - 1].id : current;
+    }
+    if (quality.loss > good_loss || quality.jitter > good_jitter) {
+      good_windows = 0;
+      return current;
+    }
+    if (++good_windows < good_windows_to_step_up || index + 1 == variants.size()) return current;
+    good_windows = 0;
+    return variants[index + 1].id;
+  }
+};
+
+#endif
@@ -4,7 +4,8 @@
 #include <exception>
 #include <stdexcept>
 #include <string>
-#include "types.hh"
+#include "../common/log.hh"
+#include "../common/types.hh"
 
 using namespace std;
 
@@ -15,6 +16,11 @@ struct CmdArgs {
   u32 proxy_port;
   u32 tcp_port;
   u32 timeout;
+  u32 jitter_delay;  // least time in milliseconds audio is held back for, 0 plays it on arrival
+  u32 max_fps;       // renders of the telnet UI a second at most, 0 renders every change
+  u32 failover_gap;  // milliseconds without audio before failing over to another proxy, 0 never
+  bool reactor;      // run everything but audio output on one thread, see Model::start_reactor
+  LogLevel log_level;
 
   void parse(int argc, char** argv) {
     if (argc % 2 != 1) throw runtime_error("wrong number of parameters");
@@ -23,6 +29,11 @@ struct CmdArgs {
     bool proxy_port_set = false;
     bool tcp_port_set = false;
     bool timeout_set = false;
+    bool jitter_delay_set = false;
+    bool max_fps_set = false;
+    bool failover_gap_set = false;
+    bool reactor_set = false;
+    bool log_level_set = false;
 
     for (int i = 1; i < argc; i += 2) {
       string flag(argv[i]);
@@ -47,6 +58,34 @@ struct CmdArgs {
         timeout_set = true;
         timeout = stoul(value);
         if (timeout == 0) throw runtime_error("invalid timeout value");
+      } else if (flag == "-J") {
+        if (jitter_delay_set) throw runtime_error("duplicate jitter delay flag");
+        jitter_delay_set = true;
+        jitter_delay = stoul(value);
+        if (jitter_delay > 2000) throw runtime_error("jitter delay too high");
+      } else if (flag == "-F") {
+        if (max_fps_set) throw runtime_error("duplicate frame rate flag");
+        max_fps_set = true;
+        max_fps = stoul(value);
+        if (max_fps > 1000) throw runtime_error("frame rate too high");
+      } else if (flag == "-G") {
+        if (failover_gap_set) throw runtime_error("duplicate failover gap flag");
+        failover_gap_set = true;
+        failover_gap = stoul(value);
+      } else if (flag == "-R") {
+        if (reactor_set) throw runtime_error("duplicate reactor flag");
+        if (value == "yes") {
+          reactor = true;
+        } else if (value == "no") {
+          reactor = false;
+        } else {
+          throw runtime_error("unexpected value for -R: " + value);
+        }
+        reactor_set = true;
+      } else if (flag == "-l") {
+        if (log_level_set) throw runtime_error("duplicate log level flag");
+        log_level_set = true;
+        log_level = parse_log_level(value);
       } else {
         throw runtime_error("unexpected flag: " + flag);
       }
@@ -57,6 +96,14 @@ struct CmdArgs {
     }
 
     timeout = timeout_set ? timeout : 5;
+    jitter_delay = jitter_delay_set ? jitter_delay : 100;
+    max_fps = max_fps_set ? max_fps : 20;
+    failover_gap = failover_gap_set ? failover_gap : 400;
+    // the active proxy has to be failed over from before it is dropped
+    if (failover_gap >= static_cast<u64>(timeout) * 1000)
+      throw runtime_error("failover gap not shorter than the timeout");
+    reactor = reactor_set ? reactor : false;
+    log_level = log_level_set ? log_level : LogLevel::INFO;
   }
 };
 
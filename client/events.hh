@@ -6,64 +6,112 @@
 #include <netinet/in.h>
 #include <sys/socket.h>
 #include <unistd.h>
-#include <memory>
+#include <exception>
+#include <functional>
 #include <stdexcept>
+#include <string>
+#include <string_view>
+#include <variant>
 #include <vector>
+#include "../common/types.hh"
+#include "../common/wire.hh"
 #include "proxyinfo.hh"
-#include "types.hh"
 
-struct Event {
-  virtual void makeMePolymorphic(){};  // a virtual method needs to be here for dynamic_cast to work
-};
+// Events are values in a variant, so that passing one from the telnet server or the proxy client
+// to the model is a move into a ring cell and not an allocation.
 
-struct EventUserInput : public Event {
-  u8 input;
-  EventUserInput(u8 input) : input(input) {}
+// A telnet session pressed enter on a line of the menu, see TelnetServer.
+struct EventUserInput {
+  int line;  // indexing starts at 1
+  EventUserInput(int line = 0) : line(line) {}
 };
 
-struct EventNewTelnetConnection : public Event {
-  EventNewTelnetConnection() {}
-};
+// A telnet session scrolled to options the last frame did not format, see TelnetServer::viewports.
+struct EventScrolled {};
 
-struct EventIamSent : public Event {
+struct EventIamSent {
   u64 sender_id;
   i64 timestamp;
-  shared_ptr<sockaddr_in> sender;
-  shared_ptr<string> iam;
-  EventIamSent(u64 sender_id, i64 timestamp, const sockaddr_in& sender_ref, const string& iam_str)
-      : sender_id(sender_id), timestamp(timestamp) {
-    iam = make_shared<string>(iam_str);
-    sender = make_shared<sockaddr_in>(sender_ref);
-  }
+  sockaddr_in sender;
+  string iam;
+  vector<VariantInfo> variants;  // empty unless the proxy advertised variants of the station
+  EventIamSent(u64 sender_id, i64 timestamp, const sockaddr_in& sender, string_view iam,
+               const vector<VariantInfo>& variants = {})
+      : sender_id(sender_id), timestamp(timestamp), sender(sender), iam(iam), variants(variants) {}
 };
 
-struct EventAudioSent : public Event {
+// Audio that arrived from a proxy. The audio itself goes from the proxy client straight to the
+// AudioOutput if it is played, the model only follows the link and the variant.
+struct EventAudioSent {
   u64 sender_id;
   i64 timestamp;
-  shared_ptr<u8[]> audio;
   size_t length;
-  EventAudioSent(u64 sender_id, i64 timestamp, shared_ptr<u8[]> audio, size_t length)
-      : sender_id(sender_id), timestamp(timestamp), audio(audio), length(length) {}
+  bool played;
+  bool batched;  // whether the audio came in a BATCH message, which has the fields below
+  u32 seq;
+  i32 variant;  // -1 if the batch does not say
+  EventAudioSent(u64 sender_id, i64 timestamp, size_t length, bool played)
+      : sender_id(sender_id),
+        timestamp(timestamp),
+        length(length),
+        played(played),
+        batched(false),
+        seq(0),
+        variant(-1) {}
+  EventAudioSent(u64 sender_id, i64 timestamp, size_t length, bool played, u32 seq, i32 variant)
+      : sender_id(sender_id),
+        timestamp(timestamp),
+        length(length),
+        played(played),
+        batched(true),
+        seq(seq),
+        variant(variant) {}
+};
+
+struct EventLoadSent {
+  u64 sender_id;
+  i64 timestamp;
+  ProxyLoad load;
+  EventLoadSent(u64 sender_id, i64 timestamp, const ProxyLoad& load)
+      : sender_id(sender_id), timestamp(timestamp), load(load) {}
 };
 
-struct EventMetaSent : public Event {
+struct EventMetaSent {
   u64 sender_id;
   i64 timestamp;
-  shared_ptr<string> meta;
-  EventMetaSent(u64 sender_id, i64 timestamp, const string& meta_str)
-      : sender_id(sender_id), timestamp(timestamp) {
-    meta = make_shared<string>(meta_str);
-  }
+  string meta;
+  EventMetaSent(u64 sender_id, i64 timestamp, string_view meta)
+      : sender_id(sender_id), timestamp(timestamp), meta(meta) {}
+};
+
+// The proxy client switched from the active proxy, which went quiet, to the standby proxy of the
+// same station, see ProxyClient::fail_over.
+struct EventFailover {
+  u64 from_id;
+  u64 to_id;
+  i64 gap;            // in milliseconds, from the last audio of one proxy to the first of the other
+  bool aligned;       // whether the audio of the standby went on right after the last bytes played
+  size_t bytes_lost;  // skipped to splice at a frame if it did not
+  EventFailover(u64 from_id, u64 to_id, i64 gap, bool aligned, size_t bytes_lost)
+      : from_id(from_id), to_id(to_id), gap(gap), aligned(aligned), bytes_lost(bytes_lost) {}
 };
 
-struct EventProxyClientCrashed : public Event {
+struct EventProxyClientCrashed {
   exception_ptr exc;
   EventProxyClientCrashed(exception_ptr exc) : exc(exc) {}
 };
 
-struct EventTelnetServerCrashed : public Event {
+struct EventTelnetServerCrashed {
   exception_ptr exc;
   EventTelnetServerCrashed(exception_ptr exc) : exc(exc) {}
 };
 
+using Event = variant<EventUserInput, EventScrolled, EventIamSent, EventAudioSent,
+                      EventMetaSent, EventLoadSent, EventFailover, EventProxyClientCrashed,
+                      EventTelnetServerCrashed>;
+
+// Passes an event to the model. Returns false if the event was dropped because the model fell
+// behind, which only happens to audio.
+using Notify = function<bool(Event&&)>;
+
 #endif
@@ -0,0 +1,363 @@
+#ifndef JITTER_HH
+#define JITTER_HH
+
+// Holds audio back before it is played, so that datagrams that arrive late or out of order are
+// still played in time and in order. Audio is timed by its frames: a datagram is due once the
+// audio played before it has had the time it takes to play, counted from when the first datagram
+// arrived plus the target delay. The target delay follows the jitter of the arrivals, measured
+// like RFC 3550 does it. When it grows it is applied at once, as a pause, because datagrams that
+// come too late meanwhile are lost. When it shrinks it is applied once the buffer runs empty.
+//
+// Batches are ordered by their sequence numbers. Legacy AUDIO datagrams have none, so a duplicate
+// is one whose content hash was seen recently and whose frames do not continue those received
+// before it, as byte-identical datagrams such as encoded silence are legitimate. Of the datagrams
+// waiting the one is played next whose first frame starts where the last frame of the datagram
+// played before ends.
+
+#include <sys/uio.h>
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <deque>
+#include <iterator>
+#include <ostream>
+#include <vector>
+#include "../common/frames.hh"
+#include "../common/types.hh"
+
+using namespace std;
+
+// Returns the time in microseconds on a clock that only goes forward.
+inline i64 clock_us() {
+  return chrono::duration_cast<chrono::microseconds>(
+             chrono::steady_clock::now().time_since_epoch())
+      .count();
+}
+
+// Audio of one datagram, in a slot of the AudioOutput.
+struct AudioPacket {
+  u32 slot;
+  const u8* data;
+  size_t len;
+  i64 arrival;     // in microseconds
+  u32 stream;      // changes when another proxy is played, see ProxyClient::play
+  i32 variant;     // -1 for AUDIO datagrams
+  bool sequenced;  // whether `seq` is set, only batches have sequence numbers
+  u32 seq;
+};
+
+struct JitterStats {
+  u64 played = 0;
+  u64 reordered = 0;   // played before datagrams that arrived earlier
+  u64 late = 0;        // arrived after their turn and were dropped
+  u64 duplicates = 0;  // dropped
+  u64 lost = 0;        // never arrived
+  u64 concealed = 0;   // of the lost ones, replaced by the audio played before them
+  u64 underruns = 0;   // times the buffer ran empty while playing
+};
+
+class JitterBuffer {
+  friend class ClientBench;
+
+  static const size_t max_pending = 64;   // datagrams, half of the slots of the output
+  static const u32 max_concealed = 4;     // longer gaps are skipped instead of filled
+  static const size_t recent_hashes = 64;  // of AUDIO datagrams, to recognize duplicates
+
+  struct Buffered {
+    AudioPacket packet;
+    i64 duration;       // in microseconds, 0 if there are no frames in the datagram
+    size_t frames_end;  // where the last frame that starts in the datagram ends, may be past len
+    bool whole_frames;  // the datagram starts and ends at frame boundaries
+  };
+
+  const i64 min_delay;  // in microseconds, 0 turns the buffer off
+  const i64 max_delay;
+
+  deque<Buffered> pending;  // sorted by seq for batches, by arrival for AUDIO datagrams
+  vector<AudioPacket> flushed;  // of the stream played before, played right away
+
+  // The stream being played.
+  bool have_stream;
+  u32 stream;
+  i32 variant;
+  bool timed;  // frames were found in the stream, otherwise datagrams are due `target` after
+               // they arrive
+  u32 next_seq;
+  bool have_next_seq;
+  i64 next_frame;  // offset of the frame header in the next AUDIO datagram, -1 if not known
+  i64 received_next_frame;  // the same for the datagram after the last one received
+
+  // The playout clock. Audio played since `base` takes until base + played_duration to play.
+  bool started;
+  bool stalled;  // ran empty, the next start is an underrun
+  i64 base;
+  i64 played_duration;
+  i64 applied;  // the target delay the clock runs with
+
+  // The datagram played last, kept to conceal losses with. Its slot is given back when the next
+  // one is played.
+  bool have_last;
+  Buffered last;
+
+  // Jitter of the arrivals, from the transit time of every datagram relative to the audio
+  // received before it.
+  i64 received_duration;
+  i64 last_transit;
+  bool have_transit;
+  double jitter;  // in microseconds
+  i64 target;
+
+  u64 hashes[recent_hashes];
+  size_t next_hash;
+
+  static u64 content_hash(const u8* data, size_t len) {
+    u64 hash = 14695981039346656037ull;  // FNV-1a
+    for (size_t i = 0; i < len; i++) hash = (hash ^ data[i]) * 1099511628211ull;
+    return hash;
+  }
+
+  // Finds the frames that start in the datagram, see find_frame.
+  static void scan_frames(Buffered& b) {
+    const u8* data = b.packet.data;
+    size_t len = b.packet.len;
+    FrameInfo info;
+    b.duration = 0;
+    b.frames_end = 0;
+    b.whole_frames = false;
+    size_t offset = find_frame(data, len);
+    size_t first = offset;
+    while (offset + MAX_FRAME_HEADER_SIZE <= len && parse_frame_header(data + offset, info)) {
+      b.duration += static_cast<i64>(info.samples) * 1000000 / info.sample_rate;
+      offset += info.length;
+    }
+    if (b.duration == 0) return;
+    b.frames_end = offset;
+    b.whole_frames = first == 0 && offset == len;
+  }
+
+  // Returns the offset of the frame header in the datagram after `b`, given its offset in `b`.
+  static i64 frame_after(const Buffered& b, i64 frame) {
+    i64 len = b.packet.len;
+    if (b.duration > 0) return static_cast<i64>(b.frames_end) >= len ? b.frames_end - len : -1;
+    return frame >= len ? frame - len : -1;  // all of it was inside a frame
+  }
+
+  static bool seq_before(u32 a, u32 b) { return static_cast<i32>(a - b) < 0; }
+
+  void measure_jitter(const Buffered& b) {
+    i64 transit = b.packet.arrival - received_duration;
+    received_duration += b.duration;
+    if (have_transit) jitter += (abs(transit - last_transit) - jitter) / 16;
+    last_transit = transit;
+    have_transit = true;
+  }
+
+  void start_stream(const AudioPacket& packet) {
+    for (auto& b : pending) flushed.push_back(b.packet);
+    pending.clear();
+    last.whole_frames = false;  // audio of another stream conceals nothing
+    have_stream = true;
+    stream = packet.stream;
+    variant = packet.variant;
+    timed = false;
+    have_next_seq = false;
+    next_frame = -1;
+    received_next_frame = -1;
+    started = false;
+    stalled = false;
+    received_duration = 0;
+    have_transit = false;
+  }
+
+  // The time the next datagram is due at.
+  i64 due() const {
+    if (!started || !timed) return pending.front().packet.arrival + target;
+    return base + played_duration;
+  }
+
+  void play(Buffered& b, vector<iovec>& out, vector<u32>& freed) {
+    out.push_back({const_cast<u8*>(b.packet.data), b.packet.len});
+    if (have_last) freed.push_back(last.packet.slot);
+    last = b;
+    have_last = true;
+    played_duration += b.duration;
+    next_seq = b.packet.seq + 1;
+    have_next_seq = b.packet.sequenced;
+    next_frame = frame_after(b, next_frame);
+    stats.played++;
+  }
+
+  // Whether the frame header in the AUDIO datagram `b` is at `frame`, where the frames before it
+  // say it is. A datagram that is all inside a frame has none.
+  static bool continues(const Buffered& b, i64 frame) {
+    i64 len = b.packet.len;
+    FrameInfo info;
+    if (frame >= len) return b.duration == 0;
+    return frame + static_cast<i64>(MAX_FRAME_HEADER_SIZE) <= len &&
+           parse_frame_header(b.packet.data + frame, info);
+  }
+
+  // Of the AUDIO datagrams waiting, returns the one that continues the frames of the last one
+  // played, or the first to arrive if none does.
+  size_t next_unsequenced() const {
+    if (next_frame < 0) return 0;
+    for (size_t i = 0; i < pending.size(); i++) {
+      if (continues(pending[i], next_frame)) return i;
+    }
+    return 0;
+  }
+
+ public:
+  JitterStats stats;
+
+  // The delays are in milliseconds. A minimum delay of 0 plays everything the moment it arrives.
+  JitterBuffer(u32 min_delay_ms, u32 max_delay_ms)
+      : min_delay(static_cast<i64>(min_delay_ms) * 1000),
+        max_delay(static_cast<i64>(max(min_delay_ms, max_delay_ms)) * 1000),
+        have_stream(false),
+        stream(0),
+        variant(-1),
+        timed(false),
+        next_seq(0),
+        have_next_seq(false),
+        next_frame(-1),
+        received_next_frame(-1),
+        started(false),
+        stalled(false),
+        base(0),
+        played_duration(0),
+        applied(0),
+        have_last(false),
+        last(),
+        received_duration(0),
+        last_transit(0),
+        have_transit(false),
+        jitter(0),
+        target(min_delay),
+        hashes(),
+        next_hash(0) {}
+
+  bool enabled() const { return min_delay > 0; }
+
+  // In milliseconds.
+  double target_delay() const { return target / 1000.0; }
+  double measured_jitter() const { return jitter / 1000.0; }
+
+  // Takes a datagram. The slots of datagrams that are dropped right away are added to `freed`.
+  void push(const AudioPacket& packet, vector<u32>& freed) {
+    if (!enabled()) {
+      flushed.push_back(packet);
+      return;
+    }
+    if (!have_stream || packet.stream != stream || packet.variant != variant) start_stream(packet);
+
+    Buffered b{packet, 0, 0, false};
+    scan_frames(b);
+    if (b.duration > 0) timed = true;
+
+    if (packet.sequenced) {
+      if (have_next_seq && seq_before(packet.seq, next_seq)) {
+        stats.late++;
+        freed.push_back(packet.slot);
+        return;
+      }
+      auto it = pending.end();
+      while (it != pending.begin() && !seq_before(prev(it)->packet.seq, packet.seq)) it--;
+      if (it != pending.end() && it->packet.seq == packet.seq) {
+        stats.duplicates++;
+        freed.push_back(packet.slot);
+        return;
+      }
+      if (it != pending.end()) stats.reordered++;
+      pending.insert(it, b);
+    } else {
+      u64 hash = content_hash(packet.data, packet.len);
+      bool seen = find(begin(hashes), end(hashes), hash) != end(hashes);
+      if (seen && received_next_frame >= 0 && !continues(b, received_next_frame)) {
+        stats.duplicates++;
+        freed.push_back(packet.slot);
+        return;
+      }
+      if (!seen) hashes[next_hash++ % recent_hashes] = hash;
+      received_next_frame = frame_after(b, received_next_frame);
+      pending.push_back(b);
+    }
+    measure_jitter(b);
+    target = clamp(static_cast<i64>(4 * jitter), min_delay, max_delay);
+    if (started && timed && target > applied * 5 / 4) {
+      base += target - applied;
+      applied = target;
+    }
+  }
+
+  // Adds the audio that is due at `time` to `out`, and the slots that are free once `out` is
+  // written to `freed`.
+  void pop_due(i64 time, vector<iovec>& out, vector<u32>& freed) {
+    for (auto& packet : flushed) {
+      out.push_back({const_cast<u8*>(packet.data), packet.len});
+      freed.push_back(packet.slot);
+    }
+    flushed.clear();
+    if (!enabled()) return;
+
+    while (!pending.empty()) {
+      // audio that waited too long, or too many datagrams, are played right away
+      bool overdue = time - pending.front().packet.arrival >= max_delay ||
+                     pending.size() > max_pending;
+      if (!overdue && time < due()) return;
+      if (!started || overdue) {
+        if (!started && stalled) stats.underruns++;
+        started = true;
+        stalled = false;
+        base = time;
+        played_duration = 0;
+        applied = target;
+      }
+
+      if (!pending.front().packet.sequenced) {
+        size_t i = next_unsequenced();
+        if (i > 0) stats.reordered++;
+        play(pending[i], out, freed);
+        pending.erase(pending.begin() + i);
+        continue;
+      }
+
+      u32 seq = pending.front().packet.seq;
+      if (!have_next_seq || seq == next_seq || seq - next_seq > max_concealed) {
+        if (have_next_seq) stats.lost += seq - next_seq;
+        play(pending.front(), out, freed);
+        pending.pop_front();
+        continue;
+      }
+      // the datagram due now is missing, but later ones arrived
+      stats.lost++;
+      next_seq++;
+      if (have_last && last.whole_frames) {
+        stats.concealed++;
+        out.push_back({const_cast<u8*>(last.packet.data), last.packet.len});
+        played_duration += last.duration;
+      }
+    }
+    if (started && timed && time >= base + played_duration) {
+      started = false;
+      stalled = true;
+    }
+  }
+
+  // Returns the time the next datagram is due at, or -1 if none is waiting.
+  i64 next_due() const {
+    if (!flushed.empty()) return 0;
+    if (pending.empty()) return -1;
+    return due();
+  }
+
+  void print_stats(ostream& out) const {
+    if (!enabled()) return;
+    out << "Jitter buffer: target delay " << target_delay() << " ms, jitter " << measured_jitter()
+        << " ms, played " << stats.played << ", reordered " << stats.reordered << ", late "
+        << stats.late << ", duplicates " << stats.duplicates << ", lost " << stats.lost
+        << ", concealed " << stats.concealed << ", underruns " << stats.underruns << endl;
+  }
+};
+
+#endif
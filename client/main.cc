@@ -35,7 +35,7 @@ int main(int argc, char** argv) {
       }
     };
   };
-  auto ft_signal_handler = async(launch::async, signal_handler);
+  future<void> ft_signal_handler;
 
   try {
     CmdArgs cmd;
@@ -43,11 +43,16 @@ int main(int argc, char** argv) {
       cmd.parse(argc, argv);
     } catch (exception& e) {
       cerr << "Failed to parse command line arguments. Reason: " << e.what() << endl << endl;
-      cerr << "Usage: " << argv[0] << " -H host -P port -p port [-T timeout]" << endl;
+      cerr << "Usage: " << argv[0] << " -H host -P port -p port [-T timeout] [-J delay] [-F fps]"
+           << " [-G gap] [-R yes|no] [-l level]" << endl;
       keep_running = 0;
       return 1;
     }
-    Model model(cmd.tcp_port, cmd.proxy_host, cmd.proxy_port, cmd.timeout, &keep_running);
+    // in reactor mode the model's loop takes the signals
+    if (!cmd.reactor) ft_signal_handler = async(launch::async, signal_handler);
+    Logger::get().set_level(cmd.log_level);
+    Model model(cmd.tcp_port, cmd.proxy_host, cmd.proxy_port, cmd.timeout, cmd.jitter_delay,
+                cmd.max_fps, cmd.failover_gap, cmd.reactor, &keep_running);
     model.init();
     model.start();
 
@@ -4,17 +4,20 @@
 #include <algorithm>
 #include <atomic>
 #include <chrono>
-#include <condition_variable>
 #include <deque>
 #include <future>
+#include <iostream>
 #include <memory>
-#include <mutex>
-#include <queue>
 #include <utility>
+#include <variant>
 #include <vector>
 #include "events.hh"
+#include "output.hh"
 #include "proxy.hh"
 #include "proxyinfo.hh"
+#include "queue.hh"
+#include "reactor.hh"
+#include "registry.hh"
 #include "telnet.hh"
 #include "ui.hh"
 
@@ -22,44 +25,67 @@ using namespace std;
 using namespace chrono_literals;
 
 class Model {
+  friend class ClientBench;
+
  private:
+  static const i64 keepalive_interval = 3500;  // in milliseconds
+
   u32 proxy_timeout;
+  i64 failover_gap;     // in milliseconds, 0 if there is no failover
+  i64 render_interval;  // least time in milliseconds between renders
+  bool reactor_mode;  // events are dispatched as they happen instead of queued, see start_reactor
 
   shared_ptr<TelnetServer> telnet;
   shared_ptr<ProxyClient> proxy_client;
-  deque<u8> input_buf;
-  queue<shared_ptr<Event>> event_queue;
-  mutex lock_mutex;
-  condition_variable cv;
+  shared_ptr<AudioOutput> output;
+
+  static const size_t event_queue_size = 4096;
+  EventQueue events;
+  Event current_event;  // reused, so that taking an event from the queue does not construct one
   atomic<bool>* keep_running;
   future<void> telnet_ft;
   future<void> proxy_client_ft;
+  future<void> output_ft;
 
-  int cursor_line;
-  unordered_map<u64, shared_ptr<ProxyInfo>> proxies;
+  ProxyRegistry proxies;
+  shared_ptr<ProxyInfo> playing;  // the active proxy, nullptr if there is none
+  shared_ptr<ProxyInfo> standby;  // kept warm by the proxy client, see choose_standby
   i64 last_keepalive;
 
-  int get_num_menu_options() { return 2 + proxies.size(); }
+  i64 last_render;
+  bool render_pending;  // something changed since the last render
 
-  vector<u64> get_ordered_proxy_ids() {
-    vector<u64> ids;
-    for (auto& proxy : proxies) {
-      ids.push_back(proxy.first);
-    }
-    sort(ids.begin(), ids.end());
-    return ids;
-  }
+  u32 last_probe_token;  // every DISCOVER and keepalive round sends a new one
+  u32 discover_token;
+  i64 last_discover;  // time in milliseconds
+
+  int get_num_menu_options() { return 2 + proxies.size(); }
 
  public:
+  // Renders at most `max_fps` times a second, or on every change if it is 0. Fails over to another
+  // proxy of the station after `failover_gap` milliseconds without audio, or never if it is 0.
   Model(u16 telnet_port, const string& proxy_host, u16 proxy_port, u32 proxy_timeout,
+        u32 jitter_delay, u32 max_fps, u32 failover_gap, bool reactor_mode,
         atomic<bool>* keep_running)
-      : proxy_timeout(proxy_timeout), keep_running(keep_running) {
-    auto f_notify = [this](auto e) { notify(e); };
+      : proxy_timeout(proxy_timeout),
+        failover_gap(failover_gap),
+        render_interval(max_fps > 0 ? 1000 / max_fps : 0),
+        reactor_mode(reactor_mode),
+        events(event_queue_size),
+        keep_running(keep_running),
+        proxies(static_cast<i64>(proxy_timeout) * 1000) {
+    auto f_notify = [this](Event&& event) { return notify(move(event)); };
 
     telnet = make_shared<TelnetServer>(telnet_port, f_notify);
-    proxy_client = make_shared<ProxyClient>(proxy_host, proxy_port, f_notify);
+    output = make_shared<AudioOutput>(STDOUT_FILENO, jitter_delay);
+    proxy_client =
+        make_shared<ProxyClient>(proxy_host, proxy_port, f_notify, output, failover_gap);
     last_keepalive = now();
-    cursor_line = 1;
+    last_render = 0;
+    render_pending = false;
+    last_probe_token = 0;
+    discover_token = 0;
+    last_discover = 0;
   }
 
   ~Model() {
@@ -73,6 +99,11 @@ class Model {
     telnet->init();
     proxy_client->init();
 
+    auto output_loop = [this]() { output->start(keep_running); };
+    output_ft = async(launch::async, output_loop);
+
+    render();  // what telnet sessions see until something changes
+    if (reactor_mode) return;
     auto telnet_loop = [this]() { telnet->start(keep_running); };
     telnet_ft = async(launch::async, telnet_loop);
 
@@ -82,189 +113,358 @@ class Model {
 
   void clean_up() {
     *keep_running = 0;
-    telnet_ft.get();
-    proxy_client_ft.get();
+    proxy_client->stop();
+    output->stop();
+    if (telnet_ft.valid()) telnet_ft.get();
+    if (proxy_client_ft.valid()) proxy_client_ft.get();
+    output_ft.get();
   }
 
-  void notify(shared_ptr<Event> event) {
-    lock_guard<mutex> lock(lock_mutex);
-    event_queue.push(event);
-    cv.notify_one();
+  // Called from the telnet server and proxy client threads, see EventQueue::push. In reactor mode
+  // they run on the model's thread and the event is dispatched right away.
+  bool notify(Event&& event) {
+    if (!reactor_mode) return events.push(move(event), *keep_running);
+    dispatch(event);
+    return true;
   }
 
-  bool react(EventUserInput* event) {
-    input_buf.push_front(event->input);
-    while (input_buf.size() > 3) {
-      input_buf.pop_back();
-    }
-    auto& in = input_buf;
+  bool react(EventUserInput& event) {
+    // the menu may have changed since the session saw it
     int num_options = get_num_menu_options();
-    if (in.size() >= 3 && in[0] == 65 && in[1] == 91 && in[2] == 27) {  // up arrow
-      cursor_line = cursor_line - 1;
-    } else if (in.size() >= 3 && in[0] == 66 && in[1] == 91 && in[2] == 27) {  // down arrow
-      cursor_line = cursor_line + 1;
-    } else if (in.size() >= 2 && in[0] == 0 && in[1] == 13) {  // enter
-      if (cursor_line == 1) {
-        try {
-          proxy_client->discover_proxies();
-        } catch (...) {
-          // ignore errors
-        }
-      } else if (cursor_line == num_options) {
-        *keep_running = 0;
+    if (event.line < 1 || event.line > num_options) return true;
+    if (event.line == 1) {
+      try {
+        discover_token = ++last_probe_token;
+        last_discover = now();
+        proxy_client->discover_proxies(discover_token);
+      } catch (...) {
+        // ignore errors
+      }
+    } else if (event.line == num_options) {
+      *keep_running = 0;
+    } else {
+      auto selected_proxy = proxies.at(event.line - 2);
+      // picking any proxy of the station that is playing stops it, picking one of another
+      // station plays that station from its preferred proxy
+      bool station_active = playing && playing->info == selected_proxy->info;
+      if (playing) playing->active = false;
+      playing = nullptr;
+      if (!station_active) {
+        auto target = preferred_proxy(selected_proxy);
+        playing = target;
+        target->active = true;
+        target->link.restart(now());
+        target->policy.reset();
+        proxy_client->play(target->id, target->variant);
+        proxy_client->request_variant(target->requested_variant);
       } else {
-        int proxy_index = cursor_line - 2;
-        auto selected_proxy_id = get_ordered_proxy_ids()[proxy_index];
-        auto selected_proxy = proxies[selected_proxy_id];
-        selected_proxy->active = !selected_proxy->active;
-        for (auto& pair : proxies) {
-          auto proxy = pair.second;
-          if (proxy->id != selected_proxy_id) proxy->active = false;
-        }
+        proxy_client->stop_playing();
       }
+      choose_standby();
+    }
+    return true;
+  }
+
+  bool react(EventScrolled&) { return true; }
+
+  bool react(EventIamSent& event) {
+    auto sender_id = event.sender_id;
+    auto proxy = proxies.find(sender_id);
+    if (proxy) {
+      proxies.set_info(proxy, event.iam);
+      if (!event.variants.empty()) set_variants(*proxy, event.variants);
+      proxy->last_contact = event.timestamp;
     } else {
-      // unrecognized input, do nothing
-      return false;
+      proxy = make_shared<ProxyInfo>(event.iam, "", sender_id, event.timestamp, false,
+                                     event.sender);
+      if (!event.variants.empty()) set_variants(*proxy, event.variants);
+      // a new proxy answers the probe sent with the DISCOVER it answered
+      if (event.timestamp - last_discover < 2000)
+        proxy->probes.on_probe(discover_token, last_discover);
+      proxies.insert(proxy);
+      if (!standby && playing && proxy->info == playing->info) choose_standby();
     }
     return true;
   }
 
-  bool react(__attribute__((unused)) EventNewTelnetConnection* event) {
-    // trigger a render
+  bool react(EventLoadSent& event) {
+    auto proxy = proxies.find(event.sender_id);
+    if (!proxy) return false;
+    proxy->last_contact = event.timestamp;
+    if (!proxy->probes.on_answer(event.load.token, event.timestamp)) return false;
+    proxy->load_known = true;
+    proxy->load = event.load;
     return true;
   }
 
-  bool react(EventIamSent* event) {
-    auto sender_id = event->sender_id;
-    auto it = proxies.find(sender_id);
-    if (it != proxies.end()) {
-      auto proxy = it->second;
-      proxy->info = *(event->iam);
+  // Returns the proxy to listen to for the station of `selected`: the cheapest of the proxies
+  // relaying it, see proxy_cost, or `selected` if none of them answered probes.
+  shared_ptr<ProxyInfo> preferred_proxy(const shared_ptr<ProxyInfo>& selected) {
+    i64 current_time = now();
+    auto best = selected;
+    double best_cost = proxy_cost(selected->probes, selected->load.clients, current_time);
+    for (auto& proxy : proxies.station(selected->info)) {
+      double cost = proxy_cost(proxy->probes, proxy->load.clients, current_time);
+      if (cost >= 0 && (best_cost < 0 || cost < best_cost)) {
+        best = proxy;
+        best_cost = cost;
+      }
+    }
+    if (best != selected) {
+      cerr << "Playing " << selected->info << " from " << inet_ntoa(best->addr.sin_addr) << ":"
+           << ntohs(best->addr.sin_port) << ": " << best->probes.rtt() << " ms round trip, "
+           << best->load.clients << " clients" << endl;
+    }
+    return best;
+  }
+
+  // Picks the proxy the proxy client fails over to: the cheapest one of the active proxy's station
+  // that was heard from lately, see preferred_proxy. It is asked for the variant the active proxy
+  // plays, so that the audio goes on in the same one.
+  void choose_standby() {
+    shared_ptr<ProxyInfo> best;
+    if (playing && failover_gap > 0) {
+      i64 current_time = now();
+      double best_cost = -1;
+      for (auto& proxy : proxies.station(playing->info)) {
+        if (proxy == playing || current_time - proxy->last_contact > failover_gap) continue;
+        double cost = proxy_cost(proxy->probes, proxy->load.clients, current_time);
+        if (!best || (cost >= 0 && (best_cost < 0 || cost < best_cost))) {
+          best = proxy;
+          best_cost = cost;
+        }
+      }
+    }
+    if (best && best->requested_variant != playing->requested_variant) {
+      best->requested_variant = playing->requested_variant;
+      try {
+        proxy_client->select_variant(best->addr, best->requested_variant);
+      } catch (...) {
+        // ignore errors
+      }
+    }
+    if (best == standby) return;
+    standby = best;
+    if (standby) {
+      proxy_client->set_standby(standby->id);
     } else {
-      proxies[sender_id] = make_shared<ProxyInfo>(*(event->iam), "", sender_id, event->timestamp,
-                                                  false, *(event->sender));
+      proxy_client->clear_standby();
     }
-    proxies[sender_id]->last_contact = event->timestamp;
+  }
+
+  bool react(EventFailover& event) {
+    // the user may have picked something else meanwhile
+    if (!playing || playing->id != event.from_id) return false;
+    auto target = proxies.find(event.to_id);
+    playing->active = false;
+    playing = target;
+    standby = nullptr;
+    if (target) {
+      target->active = true;
+      target->link.restart(now());
+      target->policy.reset();
+      proxy_client->request_variant(target->requested_variant);
+      cerr << "Failed over to " << inet_ntoa(target->addr.sin_addr) << ":"
+           << ntohs(target->addr.sin_port) << " after " << event.gap << " ms without audio, ";
+      if (event.aligned) {
+        cerr << "no audio lost" << endl;
+      } else {
+        cerr << "spliced at a frame, " << event.bytes_lost << " bytes lost" << endl;
+      }
+    } else {
+      proxy_client->stop_playing();
+    }
+    choose_standby();
+    return true;
+  }
+
+  bool react(EventMetaSent& event) {
+    auto proxy = proxies.find(event.sender_id);
+    if (!proxy) return false;
+    proxy->meta = parse_metadata(event.meta);
+    proxy->last_contact = event.timestamp;
     return true;
   }
 
-  bool react(EventMetaSent* event) {
-    auto sender_id = event->sender_id;
-    auto it = proxies.find(sender_id);
-    if (it != proxies.end()) {
-      auto proxy = it->second;
-      proxy->meta = parse_metadata(*event->meta);
-      proxies[sender_id]->last_contact = event->timestamp;
-      return true;
+  void set_variants(ProxyInfo& proxy, vector<VariantInfo> variants) {
+    sort(variants.begin(), variants.end(),
+         [](const VariantInfo& a, const VariantInfo& b) { return a.bitrate < b.bitrate; });
+    proxy.variants = variants;
+  }
+
+  // Follows the batches the proxy client played: the variant it switched to, see
+  // ProxyClient::accept_audio, and the quality of the link.
+  void on_played(ProxyInfo& proxy, const EventAudioSent& event) {
+    if (!event.batched) return;
+    if (event.variant >= 0 && static_cast<u32>(event.variant) != proxy.variant) {
+      proxy.variant = event.variant;
+      proxy.link.restart(event.timestamp);
     }
-    return false;
+    proxy.link.on_batch(event.seq, event.timestamp, event.length,
+                        proxy.get_bitrate(proxy.variant));
   }
 
-  bool react(EventAudioSent* event) {
-    auto sender_id = event->sender_id;
-    auto it = proxies.find(sender_id);
-    if (it != proxies.end()) {
-      it->second->last_contact = event->timestamp;
-      if (it->second->active) {
-        for (size_t i = 0; i < event->length; i++) {
-          cout << event->audio[i];
-        }
-      }
+  bool react(EventAudioSent& event) {
+    auto proxy = proxies.find(event.sender_id);
+    if (proxy) {
+      proxy->last_contact = event.timestamp;
+      if (proxy->active && event.played) on_played(*proxy, event);
     }
     return false;
   }
 
-  bool react(EventProxyClientCrashed* event) {
+  bool react(EventProxyClientCrashed& event) {
     *keep_running = 0;
-    rethrow_exception(event->exc);
+    rethrow_exception(event.exc);
     return false;
   }
 
-  bool react(EventTelnetServerCrashed* event) {
+  bool react(EventTelnetServerCrashed& event) {
     *keep_running = 0;
-    rethrow_exception(event->exc);
+    rethrow_exception(event.exc);
     return false;
   }
 
   bool remove_inactive_proxies() {
-    i64 disconnect_after_ms = proxy_timeout * 1000;
-    i64 current_time = now();
-    bool proxies_were_removed = false;
-    auto it = proxies.begin();
-    while (it != proxies.end()) {
-      if (current_time - it->second->last_contact > disconnect_after_ms) {
-        it = proxies.erase(it);
-        proxies_were_removed = true;
-      } else {
-        it++;
-      }
+    auto removed = proxies.expire(now());
+    for (auto& proxy : removed) {
+      if (proxy != playing) continue;
+      proxy_client->stop_playing();
+      playing = nullptr;
     }
-    return proxies_were_removed;
+    if (!removed.empty()) choose_standby();
+    return !removed.empty();
   }
 
   void send_keepalive() {
     i64 current_time = now();
-    if (current_time - last_keepalive >= 3500) {
-      for (auto& pair : proxies) {
-        auto proxy = pair.second;
+    if (current_time - last_keepalive >= keepalive_interval) {
+      u32 token = ++last_probe_token;
+      for (auto& proxy : proxies) {
         try {
-          proxy_client->send_keepalive(proxy->addr);
+          proxy->probes.on_probe(token, current_time);
+          proxy_client->send_keepalive(proxy->addr, token);
+          // a proxy that forgot the client starts over with variant 0
+          if (proxy->requested_variant != 0)
+            proxy_client->select_variant(proxy->addr, proxy->requested_variant);
         } catch (...) {
           // ignore errors
         }
       }
       last_keepalive = current_time;
+      choose_standby();  // with the round trips and loads the last round brought
     }
   }
 
-  void render() {
-    cursor_line = max(1, cursor_line);
-    cursor_line = min(get_num_menu_options(), cursor_line);
-    vector<shared_ptr<ProxyInfo>> proxy_info_vector;
-    for (auto id : get_ordered_proxy_ids()) {
-      proxy_info_vector.push_back(proxies[id]);
+  // Whether adapt_variants may move the active proxy to another variant: its station has more
+  // than one and no switch is under way.
+  bool adapting() {
+    if (!playing || playing->variants.size() < 2) return false;
+    return playing->requested_variant == playing->variant;
+  }
+
+  // Moves the active proxy to another variant of its station when the link calls for it.
+  void adapt_variants() {
+    i64 current_time = now();
+    if (!adapting() || !playing->link.window_done(current_time)) return;
+    auto proxy = playing;
+    LinkQuality quality = proxy->link.take_window(current_time);
+    u32 target = proxy->policy.choose(quality, proxy->variants, proxy->variant);
+    if (target == proxy->variant) return;
+    cerr << "Switching to " << proxy->get_bitrate(target) / 1000 << " kbit/s (variant " << target
+         << "): loss " << quality.loss * 100 << "%, jitter " << quality.jitter << " ms" << endl;
+    proxy->requested_variant = target;
+    proxy_client->request_variant(target);
+    try {
+      proxy_client->select_variant(proxy->addr, target);
+    } catch (...) {
+      // ignore errors
     }
-    string ui = generate_ui(proxy_info_vector);
+    choose_standby();  // the standby is asked for the new variant too
+  }
+
+  // Renders the menu once for all telnet sessions, right away unless the last render was less than
+  // render_interval ago. Then the changes that come meanwhile are rendered together by tick.
+  void render() {
+    render_pending = true;
+    render_if_due();
+  }
+
+  void render_if_due() {
+    i64 current_time = now();
+    if (!render_pending || current_time - last_render < render_interval) return;
+    render_pending = false;
+    last_render = current_time;
     try {
-      telnet->render(ui, cursor_line);
+      // only what the telnet sessions look at is formatted
+      auto shown = telnet->viewports();
+      auto lines = generate_ui(proxies.in_order(), shown);
+      if (telnet->render(move(lines), get_num_menu_options(), move(shown))) render_pending = true;
     } catch (...) {
       // ignore errors
     }
   }
 
-  void process_event_from_queue() {
-    if (event_queue.empty()) return;
-    auto event = event_queue.front();
-    event_queue.pop();
-    bool should_render = false;
-    if (auto ev = dynamic_cast<EventUserInput*>(event.get())) {
-      should_render = react(ev);
-    } else if (auto ev = dynamic_cast<EventNewTelnetConnection*>(event.get())) {
-      should_render = react(ev);
-    } else if (auto ev = dynamic_cast<EventIamSent*>(event.get())) {
-      should_render = react(ev);
-    } else if (auto ev = dynamic_cast<EventAudioSent*>(event.get())) {
-      should_render = react(ev);
-    } else if (auto ev = dynamic_cast<EventMetaSent*>(event.get())) {
-      should_render = react(ev);
-    } else if (auto ev = dynamic_cast<EventProxyClientCrashed*>(event.get())) {
-      should_render = react(ev);
-    } else if (auto ev = dynamic_cast<EventTelnetServerCrashed*>(event.get())) {
-      should_render = react(ev);
-    };
+  void dispatch(Event& event) {
+    bool should_render = visit([this](auto& e) { return react(e); }, event);
     if (should_render) render();
   }
 
+  // Returns false if there was no event to process.
+  bool process_event_from_queue() {
+    if (!events.pop(current_event)) return false;
+    dispatch(current_event);
+    return true;
+  }
+
+  // Does what is due at some time rather than on an event.
+  void tick() {
+    if (remove_inactive_proxies()) render();
+    render_if_due();
+    send_keepalive();
+    adapt_variants();
+  }
+
+  // Returns the time in milliseconds until tick has something to do.
+  i64 next_tick() {
+    i64 next = last_keepalive + keepalive_interval;
+    if (render_pending) next = min(next, last_render + render_interval);
+    next = min(next, proxies.next_expiry());
+    if (adapting()) next = min(next, playing->link.window_end());
+    return next - now();
+  }
+
+  // Runs the telnet server, the proxy client, the timers and the signals on this thread, so an
+  // event is handled the moment it happens and in the order epoll reports it, and the thread
+  // only wakes up for something to do. Audio is still written by the output thread, so that a
+  // player that stops reading cannot stop the rest.
+  void start_reactor() {
+    Reactor reactor;
+
+    sigset_t signals;
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGINT);
+    sigaddset(&signals, SIGTERM);
+    reactor.add_signals(signals, [this](int) { *keep_running = 0; });
+    reactor.add_timer([this] { tick(); });
+    reactor.add(proxy_client->socket_fd(), EPOLLIN,
+                [this](u32) { proxy_client->receive_available(); });
+    // the sessions are on an epoll instance of their own, which is readable when any of them is
+    reactor.add(telnet->poll_fd(), EPOLLIN, [this](u32) { telnet->poll(0); });
+
+    tick();
+    reactor.run(keep_running, [&] { reactor.set_timer(next_tick()); });
+  }
+
   void start() {
+    if (reactor_mode) return start_reactor();
     while (*keep_running) {
-      unique_lock<mutex> lock(lock_mutex);
-      cv.wait_for(lock, 100ms, []() { return true; });
-      while (!event_queue.empty()) {
-        process_event_from_queue();
+      events.wait(chrono::milliseconds(clamp<i64>(next_tick(), 1, 100)));
+      while (process_event_from_queue()) {
       }
-      if (remove_inactive_proxies()) render();
-      send_keepalive();
+      tick();
     }
+    events.print_stats(cerr);
   }
 };
 
@@ -0,0 +1,160 @@
+#ifndef OUTPUT_HH
+#define OUTPUT_HH
+
+// Plays audio on its own thread. The proxy client receives datagrams straight into slots of a fixed
+// pool and hands the slots with audio to be played over, so audio never waits for the model, the
+// telnet UI or discovery traffic. The output thread puts the audio through the jitter buffer,
+// writes everything that is due with a single writev and gives the slots back.
+
+#include <sys/uio.h>
+#include <unistd.h>
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <condition_variable>
+#include <cstring>
+#include <memory>
+#include <iostream>
+#include <mutex>
+#include <vector>
+#include "../common/log.hh"
+#include "../common/types.hh"
+#include "jitter.hh"
+#include "ring.hh"
+
+using namespace std;
+
+class AudioOutput {
+  friend class ClientBench;
+
+ public:
+  static const size_t slot_size = 65568;  // fits any datagram
+  static const size_t num_slots = 128;
+  static const u32 max_jitter_delay = 2000;  // in milliseconds
+
+ private:
+  static const size_t max_iov = 64;  // slots written by one writev
+
+  int fd;
+  unique_ptr<u8[]> slots;
+  MpscRing<AudioPacket> chunks;  // from the proxy client to the output thread
+  MpscRing<u32> free_slots;  // and back
+
+  mutex lock;
+  condition_variable cv;
+  atomic<bool> sleeping;
+  bool stopped;  // guarded by lock
+
+  JitterBuffer jitter;
+  vector<iovec> iov;  // audio that is due
+  vector<u32> freed;  // slots to give back once it is written
+
+  // Waits for audio to arrive, for at most `timeout` microseconds unless that is -1.
+  void wait_for_chunks(i64 timeout) {
+    unique_lock<mutex> lock_g(lock);
+    sleeping.store(true, memory_order_relaxed);
+    atomic_thread_fence(memory_order_seq_cst);
+    if (chunks.empty() && !stopped) {
+      if (timeout < 0) {
+        cv.wait(lock_g);
+      } else {
+        cv.wait_for(lock_g, chrono::microseconds(timeout));
+      }
+    }
+    sleeping.store(false, memory_order_relaxed);
+  }
+
+  // Writes `count` entries of iov starting at `next`, continuing after partial writes.
+  void write_all(iovec* next, size_t count) {
+    while (count > 0) {
+      ssize_t written = writev(fd, next, count);
+      if (written < 0 && errno == EINTR) continue;
+      if (written < 0) {
+        LOG_ERROR("Could not write audio: %s", strerror(errno));
+        return;
+      }
+      size_t left = written;
+      while (count > 0 && left >= next->iov_len) {
+        left -= next->iov_len;
+        next++;
+        count--;
+      }
+      if (count > 0) {
+        next->iov_base = static_cast<u8*>(next->iov_base) + left;
+        next->iov_len -= left;
+      }
+    }
+  }
+
+ public:
+  // Audio is held back by the jitter buffer for at least `jitter_delay` milliseconds, or played
+  // as it arrives if that is 0.
+  AudioOutput(int fd, u32 jitter_delay)
+      : fd(fd),
+        slots(new u8[slot_size * num_slots]),
+        chunks(num_slots),
+        free_slots(num_slots),
+        sleeping(false),
+        stopped(false),
+        jitter(jitter_delay, max_jitter_delay) {
+    for (u32 slot = 0; slot < num_slots; slot++) free_slots.try_push(slot);
+    iov.reserve(num_slots);
+    freed.reserve(num_slots);
+  }
+
+  // Returns a slot to receive a datagram into, or false if all of them wait to be written.
+  bool take_slot(u32& slot) { return free_slots.try_pop(slot); }
+
+  u8* slot_data(u32 slot) { return slots.get() + slot * slot_size; }
+
+  // Hands the audio in a slot over to be written. The slot comes back once it is.
+  void play(AudioPacket& packet) {
+    chunks.try_push(packet);  // there are as many places in the ring as there are slots
+    atomic_thread_fence(memory_order_seq_cst);
+    if (sleeping.load(memory_order_relaxed)) {
+      lock_guard<mutex> lock_g(lock);
+      cv.notify_one();
+    }
+  }
+
+  // Wakes the output thread, so that it sees keep_running go false right away.
+  void stop() {
+    lock_guard<mutex> lock_g(lock);
+    stopped = true;
+    cv.notify_one();
+  }
+
+  // Passes the audio that arrived to the jitter buffer and writes whatever audio is due. Returns
+  // false if there was none of either.
+  bool write_pending() {
+    bool arrived = false;
+    AudioPacket packet;
+    while (chunks.try_pop(packet)) {
+      jitter.push(packet, freed);
+      arrived = true;
+    }
+    jitter.pop_due(clock_us(), iov, freed);
+    bool written = !iov.empty();
+    for (size_t i = 0; i < iov.size(); i += max_iov) {
+      write_all(iov.data() + i, min(max_iov, iov.size() - i));
+    }
+    iov.clear();
+    for (u32 slot : freed) free_slots.try_push(slot);
+    freed.clear();
+    return arrived || written;
+  }
+
+  void start(atomic<bool>* keep_running) {
+    while (*keep_running) {
+      if (write_pending()) continue;
+      i64 due = jitter.next_due();
+      // with nothing waiting to be played, only new audio or stop wake the thread
+      i64 timeout = due < 0 ? -1 : max<i64>(due - clock_us(), 0);
+      if (timeout != 0) wait_for_chunks(timeout);
+    }
+    jitter.print_stats(cerr);
+  }
+};
+
+#endif
@@ -0,0 +1,73 @@
+#ifndef PREFERENCE_HH
+#define PREFERENCE_HH
+
+// Measures the link to every proxy and how busy the proxy is, to prefer the least loaded and
+// closest of the proxies that relay the same station.
+
+#include <deque>
+#include "../common/types.hh"
+
+using namespace std;
+
+// Measures the round-trip time and loss to one proxy from its LOAD answers to PROBE messages.
+class ProbeMonitor {
+  static const size_t history = 8;         // number of probes the loss is measured over
+  static const i64 answer_timeout = 2000;  // time in milliseconds after which a probe is lost
+
+  struct Probe {
+    u32 token;
+    i64 sent;  // time in milliseconds
+    bool answered;
+  };
+
+  deque<Probe> probes;
+  double srtt;  // in milliseconds, smoothed like TCP does it (RFC 6298)
+  u64 answers;
+
+ public:
+  ProbeMonitor() : srtt(0), answers(0) {}
+
+  void on_probe(u32 token, i64 time) {
+    probes.push_back({token, time, false});
+    if (probes.size() > history) probes.pop_front();
+  }
+
+  // Returns false if the answer is to a probe that was not sent to the proxy or already answered.
+  bool on_answer(u32 token, i64 time) {
+    for (auto& probe : probes) {
+      if (probe.token != token || probe.answered) continue;
+      probe.answered = true;
+      double sample = time - probe.sent;
+      srtt = answers == 0 ? sample : srtt + (sample - srtt) / 8;
+      answers++;
+      return true;
+    }
+    return false;
+  }
+
+  bool measured() const { return answers > 0; }
+
+  double rtt() const { return srtt; }
+
+  // Returns the share of recent probes that were not answered in time.
+  double loss(i64 time) const {
+    size_t due = 0;
+    size_t lost = 0;
+    for (auto& probe : probes) {
+      if (!probe.answered && time - probe.sent < answer_timeout) continue;  // may still come
+      due++;
+      if (!probe.answered) lost++;
+    }
+    return due > 0 ? static_cast<double>(lost) / due : 0;
+  }
+};
+
+// Returns the cost of listening through a proxy in milliseconds of round-trip time. Every percent
+// of loss counts like 10 ms and every 100 clients of the proxy like 5 ms, so the closest proxy wins
+// unless it loses probes or is much busier. Returns -1 if the proxy never answered a probe.
+inline double proxy_cost(const ProbeMonitor& probes, u32 clients, i64 time) {
+  if (!probes.measured()) return -1;
+  return probes.rtt() + probes.loss(time) * 1000 + clients * 0.05;
+}
+
+#endif
@@ -4,63 +4,139 @@
 #include <arpa/inet.h>
 #include <netdb.h>
 #include <netinet/in.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
 #include <sys/socket.h>
 #include <unistd.h>
 #include <algorithm>
 #include <atomic>
 #include <chrono>
 #include <cstring>
+#include <deque>
 #include <functional>
-#include <iostream>
 #include <memory>
+#include <optional>
 #include <stdexcept>
 #include <string>
 #include <unordered_map>
+#include <vector>
+#include "../common/frames.hh"
+#include "../common/log.hh"
+#include "../common/types.hh"
+#include "../common/wire.hh"
 #include "events.hh"
-#include "types.hh"
+#include "output.hh"
 #include "utils.hh"
 
 using namespace std;
 
-// UDP message types
-constexpr u16 DISCOVER = 1;
-constexpr u16 IAM = 2;
-constexpr u16 KEEPALIVE = 3;
-constexpr u16 AUDIO = 4;
-constexpr u16 METADATA = 6;
-
-constexpr size_t HEADER_SIZE = 4;
-
 class ProxyClient {
+  friend class ClientBench;
+
  private:
   string host;
   u16 port;
 
   conn_t sock;
+  int epoll_fd;
+  int event_fd;  // written by stop
   sockaddr_in my_address;
   sockaddr_in proxy_address;
-  sockaddr_in msg_sender;
 
-  static const size_t msg_buf_size = 65568;
-  u8 msg_buf[msg_buf_size];
-  ssize_t msg_len;
-
-  function<void(shared_ptr<Event>)> notify;
+  static const size_t msg_buf_size = AudioOutput::slot_size;
+  static const size_t batch_size = 32;  // datagrams read by one recvmmsg
 
-  // Tries to read a message from sock into msg_buf. Saves the address of the sender in msg_sender.
-  // Returns true if a message was read, false otherwise.
-  bool receive_msg() {
-    static socklen_t addrlen = sizeof(struct sockaddr);
+  // Datagrams are read in batches, straight into slots of the output.
+  mmsghdr batch[batch_size];
+  iovec batch_iov[batch_size];
+  sockaddr_in batch_senders[batch_size];
+  i64 batch_slots[batch_size];  // -1 for msg_buf
+  vector<u32> spare_slots;      // taken from the output, but not holding a message
 
-    errno = 0;
-    ssize_t read_len = recvfrom(sock, &msg_buf, msg_buf_size, 0, (sockaddr*)&msg_sender, &addrlen);
+  // The message being processed.
+  sockaddr_in msg_sender;
+  u8 msg_buf[msg_buf_size];  // used when every slot of the output waits to be written
+  u8* msg_data;              // the message, in msg_buf or in msg_slot
+  i64 msg_slot;              // slot of the output the message is in, -1 if it is in msg_buf
+  ssize_t msg_len;
 
-    if (read_len < 0) {
-      if (errno == EAGAIN || errno == EWOULDBLOCK) return false;
-      throw runtime_error("recvfrom failed");
+  Notify notify;
+  shared_ptr<AudioOutput> output;  // nullptr if audio is not played
+
+  // What the model wants played, see play. The model thread writes it and this thread reads it.
+  atomic<bool> playing;
+  atomic<u64> playing_id;
+  atomic<u32> playing_variant;  // switched by this thread when the requested variant arrives
+  atomic<u32> requested_variant;
+  atomic<u32> playing_stream;  // counts the calls of play, so the jitter buffer knows when to start
+                               // over
+
+  // Failover. The last datagrams of the standby, a proxy of the same station that the model picks,
+  // are kept warm in their slots. If the active proxy sends nothing for failover_gap while the
+  // standby goes on, this thread switches to the standby without waiting for the model, see
+  // fail_over.
+  static const size_t max_warm = 32;  // datagrams of the standby held at most
+  // Bytes looked for in the standby's audio. More than the longest frame, so that a match spans a
+  // whole frame and not only a stretch that repeats from frame to frame.
+  static const size_t anchor_size = 2048;
+  i64 failover_gap;          // in microseconds, 0 if there is no failover
+  atomic<bool> has_standby;  // written by the model thread, like playing
+  atomic<u64> standby_id;
+  u64 warm_id;              // the proxy the datagrams in warm came from
+  deque<AudioPacket> warm;  // oldest first, stream is set when they are played
+  u8 tail[anchor_size];     // the last bytes played
+  size_t tail_len;
+  u32 seen_stream;  // the playing_stream that tail and last_played are for
+  i64 last_played;  // clock_us of the last audio played
+
+  // Reads the datagrams waiting on sock with a single recvmmsg, each into a slot of the output.
+  // If every slot waits to be written, a single datagram is read into msg_buf instead. Returns the
+  // number of datagrams read.
+  size_t receive_batch() {
+    size_t count = 0;
+    while (count < batch_size) {
+      u32 slot;
+      if (!spare_slots.empty()) {
+        slot = spare_slots.back();
+        spare_slots.pop_back();
+      } else if (output == nullptr || !output->take_slot(slot)) {
+        break;
+      }
+      batch_slots[count++] = slot;
     }
-    msg_len = read_len;
-    return true;
+    if (count == 0) batch_slots[count++] = -1;
+
+    for (size_t i = 0; i < count; i++) {
+      batch_iov[i].iov_base = batch_slots[i] >= 0 ? output->slot_data(batch_slots[i]) : msg_buf;
+      batch_iov[i].iov_len = msg_buf_size;
+      memset(&batch[i].msg_hdr, 0, sizeof batch[i].msg_hdr);
+      batch[i].msg_hdr.msg_name = &batch_senders[i];
+      batch[i].msg_hdr.msg_namelen = sizeof batch_senders[i];
+      batch[i].msg_hdr.msg_iov = &batch_iov[i];
+      batch[i].msg_hdr.msg_iovlen = 1;
+    }
+    int received = recvmmsg(sock, batch, count, MSG_DONTWAIT, nullptr);
+    bool failed = received < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR;
+    for (size_t i = max(received, 0); i < count; i++) {
+      if (batch_slots[i] >= 0) spare_slots.push_back(batch_slots[i]);
+    }
+    if (failed) throw runtime_error("recvmmsg failed");
+    return max(received, 0);
+  }
+
+  // Makes the message `i` of the last batch the one process_msg processes.
+  void take_from_batch(size_t i) {
+    msg_slot = batch_slots[i];
+    msg_data = static_cast<u8*>(batch_iov[i].iov_base);
+    msg_len = batch[i].msg_len;
+    msg_sender = batch_senders[i];
+  }
+
+  // Blocks until a datagram arrives or stop is called.
+  void wait_for_datagrams() {
+    epoll_event events[2];
+    int num_events = epoll_wait(epoll_fd, events, 2, -1);
+    if (num_events < 0 && errno != EINTR) throw runtime_error("epoll_wait failed");
   }
 
   void send_msg(const sockaddr* addr, u16 msg_type, const u8* msg, size_t len) {
@@ -68,10 +144,8 @@ class ProxyClient {
     static socklen_t socklen = sizeof(struct sockaddr);
     size_t sent = 0;
 
-    ((u16*)(buf))[0] = htons(msg_type);
-    ((u16*)(buf))[1] = htons(static_cast<u16>(len));
-    memcpy(buf + HEADER_SIZE, msg, len);
-    len += HEADER_SIZE;
+    len = encode_header(buf, msg_type, len);
+    if (len > HEADER_SIZE) memcpy(buf + HEADER_SIZE, msg, len - HEADER_SIZE);
 
     while (sent < len) {
       ssize_t sent_partial = sendto(sock, buf + sent, len, 0, addr, socklen);
@@ -80,47 +154,337 @@ class ProxyClient {
     }
   }
 
-  // Processes a message that is in msg_buf.
+  // Decides whether audio from `sender_id` is played. After a SELECT the old variant plays on until
+  // the first batch of the new one arrives, and batches of the old one that come later are dropped.
+  // Batches carry whole frames, so the output goes from one variant to the other at a frame
+  // boundary and without a gap.
+  bool accept_audio(u64 sender_id, bool batched, i32 variant) {
+    if (!playing.load(memory_order_relaxed) || playing_id.load(memory_order_relaxed) != sender_id)
+      return false;
+    if (!batched || variant < 0) return true;
+    if (static_cast<u32>(variant) == playing_variant.load(memory_order_relaxed)) return true;
+    if (static_cast<u32>(variant) != requested_variant.load(memory_order_relaxed)) return false;
+    playing_variant.store(variant, memory_order_relaxed);
+    return true;
+  }
+
+  // Hands audio in the message over to the output, which then owns the slot of the message.
+  // Returns false if the audio could not be played.
+  bool play(const u8* audio, size_t len, i32 variant = -1, bool sequenced = false, u32 seq = 0) {
+    if (msg_slot < 0) {
+      LOG_WARN("The audio output fell behind, dropping audio");
+      return false;
+    }
+    AudioPacket packet{static_cast<u32>(msg_slot), audio, len, clock_us(),
+                       playing_stream.load(memory_order_relaxed), variant, sequenced, seq};
+    follow_stream(packet.arrival);
+    // only needed to fail over with
+    if (has_standby.load(memory_order_relaxed)) {
+      remember_tail(audio, len);
+    } else {
+      tail_len = 0;
+    }
+    last_played = packet.arrival;
+    output->play(packet);
+    msg_slot = -1;
+    return true;
+  }
+
+  // Starts following the audio played over if the model called play since the last time.
+  void follow_stream(i64 current_time) {
+    u32 stream = playing_stream.load(memory_order_relaxed);
+    if (stream == seen_stream) return;
+    seen_stream = stream;
+    tail_len = 0;
+    last_played = current_time;  // a proxy that never sends is failed over from too
+  }
+
+  void remember_tail(const u8* audio, size_t len) {
+    if (len >= anchor_size) {
+      memcpy(tail, audio + len - anchor_size, anchor_size);
+      tail_len = anchor_size;
+      return;
+    }
+    size_t kept = min(tail_len, anchor_size - len);
+    memmove(tail, tail + tail_len - kept, kept);
+    memcpy(tail + kept, audio, len);
+    tail_len = kept + len;
+  }
+
+  bool is_standby(u64 sender_id) {
+    return failover_gap > 0 && has_standby.load(memory_order_relaxed) &&
+           standby_id.load(memory_order_relaxed) == sender_id &&
+           playing.load(memory_order_relaxed) && playing_id.load(memory_order_relaxed) != sender_id;
+  }
+
+  void release_warm() {
+    for (auto& packet : warm) spare_slots.push_back(packet.slot);
+    warm.clear();
+  }
+
+  // Keeps audio of the standby in the message, and fails over to the standby if the active proxy
+  // has been quiet for too long. Returns true if it did, and the audio was played. A standby
+  // lagging behind gets another failover_gap for the last bytes played to come, after that the
+  // audio is spliced at a frame.
+  bool keep_warm(u64 sender_id, const u8* audio, size_t len, i32 variant = -1,
+                 bool sequenced = false, u32 seq = 0) {
+    if (msg_slot < 0) return false;
+    if (sender_id != warm_id) release_warm();
+    warm_id = sender_id;
+    i64 current_time = clock_us();
+    warm.push_back({static_cast<u32>(msg_slot), audio, len, current_time, 0, variant, sequenced,
+                    seq});
+    msg_slot = -1;
+    // enough to reach back to the last bytes played until the standby is given up on, and a gap
+    // more for a standby ahead
+    while (warm.size() > max_warm || current_time - warm.front().arrival > 3 * failover_gap) {
+      spare_slots.push_back(warm.front().slot);
+      warm.pop_front();
+    }
+    follow_stream(current_time);
+    i64 gap = current_time - last_played;
+    if (gap <= failover_gap) return false;
+    size_t first;
+    size_t offset;
+    if (find_tail(first, offset)) {
+      fail_over(current_time, first, offset, true, 0);
+    } else if (gap > 2 * failover_gap) {
+      size_t bytes_lost = find_splice(first, offset);
+      fail_over(current_time, first, offset, false, bytes_lost);
+    } else {
+      return false;
+    }
+    return true;
+  }
+
+  // Whether the warm datagrams have the tail starting at `offset` of datagram `i`. If they do, the
+  // point right after it is stored in `end` and `end_offset`.
+  bool tail_at(size_t i, size_t offset, size_t& end, size_t& end_offset) {
+    size_t matched = 0;
+    for (; i < warm.size(); i++, offset = 0) {
+      size_t n = min(tail_len - matched, warm[i].len - offset);
+      if (memcmp(warm[i].data + offset, tail + matched, n) != 0) return false;
+      matched += n;
+      if (matched == tail_len) {
+        end = i;
+        end_offset = offset + n;
+        return true;
+      }
+    }
+    return false;
+  }
+
+  // Looks for the last bytes played in the warm datagrams, which hold the same stream if the
+  // proxies relay the same source. Returns false if they are not there.
+  bool find_tail(size_t& first, size_t& offset) {
+    if (tail_len < anchor_size) return false;
+    for (size_t i = 0; i < warm.size(); i++) {
+      const u8* data = warm[i].data;
+      const u8* end = data + warm[i].len;
+      for (const u8* p = data; (p = static_cast<const u8*>(memchr(p, tail[0], end - p))); p++) {
+        if (tail_at(i, p - data, first, offset)) return true;
+      }
+    }
+    return false;
+  }
+
+  // Returns how far into its last frame the audio played ends, and stores the length of that
+  // frame in `frame_len`, or 0 if the header itself is cut. Returns 0 if the audio ends at a frame
+  // boundary or there are no frames in the tail.
+  size_t tail_cut(size_t& frame_len) {
+    FrameInfo info;
+    frame_len = 0;
+    size_t offset = find_frame(tail, tail_len);
+    if (offset == tail_len) return 0;
+    while (offset + MAX_FRAME_HEADER_SIZE <= tail_len && parse_frame_header(tail + offset, info)) {
+      if (offset + info.length > tail_len) {
+        frame_len = info.length;
+        return tail_len - offset;
+      }
+      offset += info.length;
+    }
+    return offset + MAX_FRAME_HEADER_SIZE > tail_len ? tail_len - offset : 0;
+  }
+
+  // Finds where to go on in the warm datagrams when the last bytes played are not among them: in
+  // the first frame that arrived after the last audio was played, which is about where the active
+  // proxy stopped if the proxies keep pace, and as far into it as the last frame played was cut.
+  // That frame has to be as long as the cut one, so that the frames go on where its header says.
+  // Returns the bytes skipped to get there.
+  size_t find_splice(size_t& first, size_t& offset) {
+    size_t frame_len;
+    size_t cut = tail_cut(frame_len);
+    size_t skipped = 0;
+    FrameInfo info;
+    for (size_t i = 0; i < warm.size(); i++) {
+      if (warm[i].arrival <= last_played) continue;
+      const u8* data = warm[i].data;
+      size_t len = warm[i].len;
+      for (size_t frame = find_frame(data, len);
+           frame + MAX_FRAME_HEADER_SIZE <= len && parse_frame_header(data + frame, info);
+           frame += info.length) {
+        if ((frame_len == 0 || info.length == frame_len) && frame + cut <= len) {
+          first = i;
+          offset = frame + cut;
+          return skipped + offset;
+        }
+      }
+      skipped += len;
+    }
+    // not framed audio, it goes on from the first datagram
+    for (first = 0; first < warm.size() && warm[first].arrival <= last_played; first++) {
+    }
+    offset = 0;
+    return 0;
+  }
+
+  // Switches from the active proxy to the standby, going on from `offset` of the warm datagram
+  // `first`. If the proxies relay the same stream, that is right after the last bytes played, see
+  // find_tail, so nothing is lost or played twice. The warm datagrams from there on are played as
+  // a new stream with their arrival times, so the jitter buffer plays the ones that are overdue
+  // right away.
+  void fail_over(i64 current_time, size_t first, size_t offset, bool aligned, size_t bytes_lost) {
+    u64 from_id = playing_id.load(memory_order_relaxed);
+    has_standby = false;
+    playing_id = warm_id;
+    for (size_t i = first; i < warm.size(); i++) {
+      if (warm[i].variant >= 0) {
+        playing_variant = warm[i].variant;
+        break;
+      }
+    }
+    u32 stream = ++playing_stream;
+    seen_stream = stream;
+    for (size_t i = 0; i < warm.size(); i++) {
+      AudioPacket& packet = warm[i];
+      if (i < first) {
+        spare_slots.push_back(packet.slot);
+        continue;
+      }
+      if (i == first) {
+        packet.data += offset;
+        packet.len -= offset;
+      }
+      packet.stream = stream;
+      remember_tail(packet.data, packet.len);
+      output->play(packet);
+    }
+    warm.clear();
+    notify(EventFailover(from_id, warm_id, (current_time - last_played) / 1000, aligned,
+                         bytes_lost));
+    last_played = current_time;
+  }
+
+  // The audio of a batch is played as a whole, and the model gets a single event for it, followed
+  // by the batch's latest metadata if there is any. A batch without audio makes an event too, so
+  // that its sequence number counts, and goes to the output empty so that the jitter buffer does
+  // not take it for lost.
+  void process_batch(const MessageView& msg, u64 sender_id, i64 current_time) {
+    u8 kind;
+    const u8* data;
+    size_t len;
+    size_t audio_len = 0;
+    // copied, as the audio records are moved over it below
+    optional<string> meta;
+    i32 variant = -1;
+    BatchReader reader(msg);
+    while (reader.next(kind, data, len)) {
+      if (kind == BATCH_AUDIO) {
+        audio_len += len;
+      } else if (kind == BATCH_METADATA) {
+        meta.emplace(reinterpret_cast<const char*>(data), len);
+      } else if (kind == BATCH_VARIANT && len == 1) {
+        variant = data[0];
+      }
+    }
+    if (!reader.ok()) throw runtime_error("malformed batch");
+
+    bool played = false;
+    bool accepted = accept_audio(sender_id, true, variant);
+    bool standby = !accepted && is_standby(sender_id);
+    if (accepted || standby) {
+      // the records are moved together at the start of the message, they only move backwards
+      size_t offset = 0;
+      BatchReader audio_reader(msg);
+      while (audio_reader.next(kind, data, len)) {
+        if (kind != BATCH_AUDIO) continue;
+        memmove(msg_data + offset, data, len);
+        offset += len;
+      }
+      if (accepted) {
+        played = play(msg_data, audio_len, variant, true, reader.seq) && audio_len > 0;
+      } else {
+        played = keep_warm(sender_id, msg_data, audio_len, variant, true, reader.seq);
+      }
+    }
+    notify(EventAudioSent(sender_id, current_time, audio_len, played, reader.seq, variant));
+    if (meta) notify(EventMetaSent(sender_id, current_time, *meta));
+  }
+
+  void send_caps(const sockaddr* addr) {
+    u8 caps[sizeof(u32)];
+    store_be32(caps, CAP_BATCH | CAP_VARIANTS);
+    send_msg(addr, CAPS, caps, sizeof caps);
+  }
+
+  void send_probe(const sockaddr* addr, u32 token) {
+    u8 payload[sizeof(u32)];
+    store_be32(payload, token);
+    send_msg(addr, PROBE, payload, sizeof payload);
+  }
+
+  // Processes the message that receive_msg read.
   void process_msg() {
-    if (msg_len < static_cast<ssize_t>(HEADER_SIZE)) throw runtime_error("invalid message");
-    u16 msg_type = ntohs(((u16*)(&msg_buf))[0]);
-    u16 msg_content_len = ntohs(((u16*)(&msg_buf))[1]);
-    u8* msg_content = msg_buf + HEADER_SIZE;
+    MessageView msg = decode_message_or_throw(msg_data, msg_len);
 
     i64 current_time = now();
     u64 sender_id = hash_sockaddr_in(msg_sender);
 
-    if (msg_type == IAM) {
-      char* msg = (char*)(msg_content);
-      msg[msg_content_len] = '\0';
-      notify(make_shared<EventIamSent>(sender_id, current_time, msg_sender, string(msg)));
-    } else if (msg_type == AUDIO) {
-      auto audio = shared_ptr<u8[]>(new u8[msg_content_len]);
-      memcpy(audio.get(), msg_content, msg_content_len);
-      notify(make_shared<EventAudioSent>(sender_id, current_time, audio, msg_content_len));
-    } else if (msg_type == METADATA) {
-      char* msg = (char*)(msg_content);
-      msg[msg_content_len] = '\0';
-      notify(make_shared<EventMetaSent>(sender_id, current_time, string(msg)));
+    if (msg.type == IAM) {
+      string_view name;
+      vector<VariantInfo> variants;
+      if (!decode_iam(msg, name, variants)) throw runtime_error("malformed variants in IAM");
+      notify(EventIamSent(sender_id, current_time, msg_sender, name, variants));
+    } else if (msg.type == AUDIO) {
+      bool played = false;
+      if (accept_audio(sender_id, false, -1)) {
+        played = play(msg.payload, msg.len);
+      } else if (is_standby(sender_id)) {
+        played = keep_warm(sender_id, msg.payload, msg.len);
+      }
+      notify(EventAudioSent(sender_id, current_time, msg.len, played));
+    } else if (msg.type == METADATA) {
+      notify(EventMetaSent(sender_id, current_time, msg.text()));
+    } else if (msg.type == BATCH) {
+      process_batch(msg, sender_id, current_time);
+    } else if (msg.type == LOAD) {
+      notify(EventLoadSent(sender_id, current_time, decode_load(msg)));
     } else {
-      throw runtime_error("unexpected message type: " + to_string(msg_type));
+      throw runtime_error("unexpected message type: " + to_string(msg.type));
     }
   }
 
   void init_my_address() {
-    timeval read_timeout;
-    read_timeout.tv_sec = 0;
-    read_timeout.tv_usec = (suseconds_t)100000;  // 100 ms
-
-    sock = socket(AF_INET, SOCK_DGRAM, 0);
+    sock = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
     if (sock < 0) throw runtime_error("socket failed");
 
     my_address.sin_family = AF_INET;
     my_address.sin_addr.s_addr = htonl(INADDR_ANY);
     my_address.sin_port = htons(port);
+  }
 
-    if (setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, (void*)&read_timeout, sizeof(read_timeout)) < 0)
-      throw runtime_error("setsockopt set timeout failed");
+  // The thread sleeps in epoll_wait until a datagram arrives, and stop wakes it through event_fd.
+  void init_epoll() {
+    epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (epoll_fd < 0) throw runtime_error("epoll_create1 failed");
+    event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (event_fd < 0) throw runtime_error("eventfd failed");
+    for (int fd : {static_cast<int>(sock), event_fd}) {
+      epoll_event ev;
+      ev.events = EPOLLIN;
+      ev.data.fd = fd;
+      if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &ev) < 0) throw runtime_error("epoll_ctl failed");
+    }
   }
 
   void init_proxy_address() {
@@ -155,42 +519,137 @@ class ProxyClient {
   }
 
  public:
-  ProxyClient(const string& host, u16 port, function<void(shared_ptr<Event>)> notify)
-      : host(host), port(port), notify(notify) {
+  // Fails over to the standby after `failover_gap` milliseconds without audio from the active
+  // proxy, or never if that is 0.
+  ProxyClient(const string& host, u16 port, Notify notify, shared_ptr<AudioOutput> output,
+              u32 failover_gap = 0)
+      : host(host),
+        port(port),
+        sock(-1),
+        epoll_fd(-1),
+        event_fd(-1),
+        msg_data(msg_buf),
+        msg_slot(-1),
+        notify(notify),
+        output(output),
+        playing(false),
+        playing_id(0),
+        playing_variant(0),
+        requested_variant(0),
+        playing_stream(0),
+        failover_gap(static_cast<i64>(failover_gap) * 1000),
+        has_standby(false),
+        standby_id(0),
+        warm_id(0),
+        tail_len(0),
+        seen_stream(0),
+        last_played(0) {
     memset(&msg_buf, 0, msg_buf_size);
+    spare_slots.reserve(batch_size + max_warm);
   }
 
+  ~ProxyClient() { clean_up(); }
+
   void init() {
     init_my_address();
     init_proxy_address();
+    init_epoll();
   }
 
   void clean_up() {
+    if (event_fd >= 0) close(event_fd);
+    if (epoll_fd >= 0) close(epoll_fd);
     if (sock >= 0) close(sock);
-    sock = -1;
+    event_fd = epoll_fd = sock = -1;
   }
 
-  void discover_proxies() { send_msg((sockaddr*)(&proxy_address), DISCOVER, nullptr, 0); }
+  // The reactor (see Model::start_reactor) calls receive_available when this is readable, instead
+  // of start.
+  conn_t socket_fd() const { return sock; }
+
+  // Reads and processes a batch of datagrams. Returns the number read.
+  size_t receive_and_process() {
+    size_t received = receive_batch();
+    for (size_t i = 0; i < received; i++) {
+      take_from_batch(i);
+      try {
+        process_msg();
+      } catch (exception& e) {
+        LOG_WARN("process_msg failed, skipping the message: %s", e.what());
+      }
+      if (msg_slot >= 0) spare_slots.push_back(msg_slot);  // the audio was not played
+      msg_slot = -1;
+    }
+    if (!warm.empty() && !is_standby(warm_id)) release_warm();
+    return received;
+  }
+
+  // Processes what is waiting on the socket, but at most a few batches, so that a flood of
+  // datagrams does not hold up the rest of the reactor.
+  void receive_available() {
+    for (u32 i = 0; i < 4 && receive_and_process() == batch_size; i++) {
+    }
+  }
+
+  // Wakes the thread, so that it sees keep_running go false right away.
+  void stop() {
+    u64 one = 1;
+    if (event_fd >= 0 && write(event_fd, &one, sizeof one) < 0 && errno != EAGAIN)
+      throw runtime_error("eventfd write failed");
+  }
 
-  void send_keepalive(const sockaddr_in& addr) {
+  // Plays the audio of the proxy `id`, starting with `variant` of its station.
+  void play(u64 id, u32 variant) {
+    playing = false;
+    playing_id = id;
+    playing_variant = variant;
+    requested_variant = variant;
+    playing_stream++;
+    playing = true;
+  }
+
+  void stop_playing() { playing = false; }
+
+  // Keeps the proxy `id` warm, to fail over to if the active one goes quiet.
+  void set_standby(u64 id) {
+    standby_id = id;
+    has_standby = true;
+  }
+
+  void clear_standby() { has_standby = false; }
+
+  // The variant is played once its first batch arrives, see accept_audio.
+  void request_variant(u32 variant) { requested_variant = variant; }
+
+  // Every DISCOVER and KEEPALIVE is followed by CAPS, so that a proxy learns the client's
+  // capabilities again after forgetting the client, and by a PROBE with `token`, which the proxy
+  // answers with its load.
+  void discover_proxies(u32 token) {
+    send_msg((sockaddr*)(&proxy_address), DISCOVER, nullptr, 0);
+    send_caps((sockaddr*)(&proxy_address));
+    send_probe((sockaddr*)(&proxy_address), token);
+  }
+
+  void send_keepalive(const sockaddr_in& addr, u32 token) {
     send_msg((sockaddr*)(&addr), KEEPALIVE, nullptr, 0);
+    send_caps((sockaddr*)(&addr));
+    send_probe((sockaddr*)(&addr), token);
+  }
+
+  // Asks the proxy at `addr` to send the given variant of its station.
+  void select_variant(const sockaddr_in& addr, u32 variant) {
+    u8 payload[sizeof(u32)];
+    store_be32(payload, variant);
+    send_msg((sockaddr*)(&addr), SELECT, payload, sizeof payload);
   }
 
   void start(atomic<bool>* keep_running) {
     try {
       while (*keep_running) {
-        if (receive_msg()) {
-          try {
-            process_msg();
-          } catch (exception& e) {
-            cerr << "process_msg failed - skipping the message. Failure reason:" << endl;
-            cerr << e.what() << endl;
-          }
-        }
+        if (receive_and_process() == 0) wait_for_datagrams();
       }
     } catch (...) {
-      auto event = make_shared<EventProxyClientCrashed>(current_exception());
-      notify(event);
+      notify(EventProxyClientCrashed(current_exception()));
       throw;
     }
   }
@@ -7,7 +7,11 @@
 #include <sys/socket.h>
 #include <unistd.h>
 #include <string>
-#include "types.hh"
+#include <vector>
+#include "../common/types.hh"
+#include "../common/wire.hh"
+#include "adaptive.hh"
+#include "preference.hh"
 
 struct ProxyInfo {
   string info;
@@ -17,9 +21,35 @@ struct ProxyInfo {
   bool active;
   sockaddr_in addr;
 
+  vector<VariantInfo> variants;  // sorted by bitrate, empty if the station has a single variant
+  u32 variant;                   // variant being played
+  u32 requested_variant;         // variant asked for with SELECT, played from its first batch on
+  LinkMonitor link;
+  VariantPolicy policy;
+
+  ProbeMonitor probes;
+  bool load_known;  // whether the proxy answered a probe with its load
+  ProxyLoad load;
+
   ProxyInfo(const string& info, const string& meta, u64 id, i64 last_contact, bool active,
             const sockaddr_in& addr)
-      : info(info), meta(meta), id(id), last_contact(last_contact), active(active), addr(addr) {}
+      : info(info),
+        meta(meta),
+        id(id),
+        last_contact(last_contact),
+        active(active),
+        addr(addr),
+        variant(0),
+        requested_variant(0),
+        load_known(false),
+        load({0, 0, 0}) {}
+
+  u32 get_bitrate(u32 variant_id) {
+    for (auto& info : variants) {
+      if (info.id == variant_id) return info.bitrate;
+    }
+    return 0;
+  }
 };
 
 #endif
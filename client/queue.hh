@@ -0,0 +1,171 @@
+#ifndef QUEUE_HH
+#define QUEUE_HH
+
+// The queue of events the model reacts to. Producers never take a lock unless the model sleeps, and
+// what happens to an event when the queue is full depends on its class, see event_classes. The
+// queue measures how deep it gets and how long events wait in it. Reading the clock costs about as
+// much as passing an event, so only every 16th event of a producer is timed.
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <iostream>
+#include <mutex>
+#include <thread>
+#include <utility>
+#include <variant>
+#include "../common/log.hh"
+#include "../common/types.hh"
+#include "events.hh"
+#include "ring.hh"
+
+using namespace std;
+using namespace chrono_literals;
+
+enum class EventPolicy {
+  WAIT,  // the producer waits for room
+  DROP,  // the event is dropped
+};
+
+struct EventClass {
+  const char* name;
+  EventPolicy policy;
+};
+
+// Indexed like the alternatives of Event. What the proxy client sends during playback is dropped
+// when the model falls behind, so that receiving the stream never waits for the model: audio is
+// played without it, and proxies send METADATA and LOAD again. IAM is the exception: the reply to
+// a search is not sent again, and losing it would leave the proxy out of the list. IAMs are rare,
+// so waiting for them costs the stream nothing.
+constexpr EventClass event_classes[] = {
+    {"input", EventPolicy::WAIT},
+    {"scroll", EventPolicy::WAIT},
+    {"IAM", EventPolicy::WAIT},
+    {"audio", EventPolicy::DROP},
+    {"metadata", EventPolicy::DROP},
+    {"load", EventPolicy::DROP},
+    {"failover", EventPolicy::WAIT},
+    {"proxy client crash", EventPolicy::WAIT},
+    {"telnet server crash", EventPolicy::WAIT},
+};
+constexpr size_t num_event_classes = variant_size_v<Event>;
+static_assert(sizeof event_classes / sizeof event_classes[0] == num_event_classes);
+
+class EventQueue {
+  friend class ClientBench;
+
+  static const u32 timing_interval = 16;
+
+  struct Queued {
+    Event event;
+    i64 queued;  // time in nanoseconds, 0 if the event is not timed
+  };
+
+  // Counted by the producers.
+  struct ProducerStats {
+    atomic<u64> dropped{0};
+    atomic<u64> waits{0};  // times a producer had to wait for room
+  };
+
+  // Counted by the model.
+  struct ConsumerStats {
+    u64 delivered = 0;
+    u64 timed = 0;
+    i64 total_wait = 0;  // of the timed events, in nanoseconds
+    i64 max_wait = 0;
+  };
+
+  MpscRing<Queued> ring;
+  size_t max_depth;
+  ProducerStats produced[num_event_classes];
+  ConsumerStats consumed[num_event_classes];
+
+  mutex lock;  // only for the model to sleep on
+  condition_variable cv;
+  atomic<bool> sleeping;
+
+  static i64 clock_ns() {
+    return chrono::duration_cast<chrono::nanoseconds>(
+               chrono::steady_clock::now().time_since_epoch())
+        .count();
+  }
+
+ public:
+  explicit EventQueue(size_t capacity)
+      : ring(capacity), max_depth(0), sleeping(false) {}
+
+  // Called by the producers. Returns false if the event was dropped, or if the queue is full and
+  // `keep_running` went false while waiting.
+  bool push(Event&& event, const atomic<bool>& keep_running) {
+    thread_local u32 pushed = 0;
+    size_t type = event.index();
+    Queued queued{move(event), pushed++ % timing_interval == 0 ? clock_ns() : 0};
+    u32 waits = 0;
+    while (!ring.try_push(queued)) {
+      if (event_classes[type].policy == EventPolicy::DROP) {
+        produced[type].dropped.fetch_add(1, memory_order_relaxed);
+        LOG_WARN("The model fell behind, dropping %s events", event_classes[type].name);
+        return false;
+      }
+      if (!keep_running) return false;
+      if (waits == 0) produced[type].waits.fetch_add(1, memory_order_relaxed);
+      // a model that is stuck, e.g. on a telnet client that does not read, gets no CPU taken away
+      if (waits++ < 16) {
+        this_thread::yield();
+      } else {
+        this_thread::sleep_for(1ms);
+      }
+    }
+    // pairs with the fence in wait, so that either the model sees the event or the producer sees
+    // the model sleeping
+    atomic_thread_fence(memory_order_seq_cst);
+    if (sleeping.load(memory_order_relaxed)) {
+      lock_guard<mutex> lock_g(lock);
+      cv.notify_one();
+    }
+    return true;
+  }
+
+  // Called by the model.
+  bool pop(Event& event) {
+    max_depth = max(max_depth, ring.size());
+    return ring.try_consume([&](Queued& queued) {
+      auto& stats = consumed[queued.event.index()];
+      stats.delivered++;
+      if (queued.queued != 0) {
+        i64 wait = clock_ns() - queued.queued;
+        stats.timed++;
+        stats.total_wait += wait;
+        stats.max_wait = max(stats.max_wait, wait);
+      }
+      event = move(queued.event);
+    });
+  }
+
+  // Called by the model when there are no events, returns when there are or after `timeout`.
+  template <class Duration>
+  void wait(Duration timeout) {
+    unique_lock<mutex> lock_g(lock);
+    sleeping.store(true, memory_order_relaxed);
+    atomic_thread_fence(memory_order_seq_cst);
+    if (ring.empty()) cv.wait_for(lock_g, timeout);
+    sleeping.store(false, memory_order_relaxed);
+  }
+
+  void print_stats(ostream& out) {
+    out << "Event queue: max depth " << max_depth << endl;
+    for (size_t type = 0; type < num_event_classes; type++) {
+      auto& c = consumed[type];
+      u64 dropped = produced[type].dropped.load(memory_order_relaxed);
+      u64 waits = produced[type].waits.load(memory_order_relaxed);
+      if (c.delivered == 0 && dropped == 0 && waits == 0) continue;
+      out << "Events " << event_classes[type].name << ": delivered " << c.delivered << ", dropped "
+          << dropped << ", producer waits " << waits << ", mean wait "
+          << (c.timed > 0 ? c.total_wait / c.timed / 1000 : 0) << " us, max wait "
+          << c.max_wait / 1000 << " us (" << c.timed << " timed)" << endl;
+    }
+  }
+};
+
+#endif
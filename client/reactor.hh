@@ -0,0 +1,123 @@
+#ifndef REACTOR_HH
+#define REACTOR_HH
+
+// A single-threaded event loop over epoll. Sockets, a timer (timerfd) and signals (signalfd) are
+// all descriptors on the same epoll instance, and their handlers run on the thread that calls
+// run, one after another in the order epoll reports them.
+
+#include <signal.h>
+#include <sys/epoll.h>
+#include <sys/signalfd.h>
+#include <sys/timerfd.h>
+#include <unistd.h>
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <functional>
+#include <stdexcept>
+#include <unordered_map>
+#include "../common/types.hh"
+
+using namespace std;
+
+class Reactor {
+ public:
+  using Handler = function<void(u32)>;  // gets the epoll events of the descriptor
+
+ private:
+  static const int max_events = 64;
+
+  int epoll_fd;
+  int timer_fd;
+  int signal_fd;
+  unordered_map<int, Handler> handlers;
+
+  void control(int op, int fd, u32 events) {
+    epoll_event ev;
+    ev.events = events;
+    ev.data.fd = fd;
+    if (epoll_ctl(epoll_fd, op, fd, &ev) < 0) throw runtime_error("epoll_ctl failed");
+  }
+
+ public:
+  Reactor() : timer_fd(-1), signal_fd(-1) {
+    epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (epoll_fd < 0) throw runtime_error("epoll_create1 failed");
+  }
+
+  Reactor(const Reactor&) = delete;
+  Reactor& operator=(const Reactor&) = delete;
+
+  ~Reactor() {
+    if (signal_fd >= 0) close(signal_fd);
+    if (timer_fd >= 0) close(timer_fd);
+    close(epoll_fd);
+  }
+
+  void add(int fd, u32 events, Handler handler) {
+    control(EPOLL_CTL_ADD, fd, events);
+    handlers[fd] = move(handler);
+  }
+
+  void modify(int fd, u32 events) { control(EPOLL_CTL_MOD, fd, events); }
+
+  // A closed descriptor leaves epoll by itself, but its handler stays until it is removed.
+  void remove(int fd) {
+    epoll_ctl(epoll_fd, EPOLL_CTL_DEL, fd, nullptr);
+    handlers.erase(fd);
+  }
+
+  // Calls `handler` when the timer set by set_timer expires.
+  void add_timer(function<void()> handler) {
+    timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (timer_fd < 0) throw runtime_error("timerfd_create failed");
+    add(timer_fd, EPOLLIN, [this, handler](u32) {
+      u64 expirations;
+      if (read(timer_fd, &expirations, sizeof expirations) > 0) handler();
+    });
+  }
+
+  // Makes the timer expire once, in `delay` milliseconds.
+  void set_timer(i64 delay) {
+    itimerspec spec = {};
+    delay = max<i64>(delay, 1);  // a zero value would disarm it
+    spec.it_value.tv_sec = delay / 1000;
+    spec.it_value.tv_nsec = (delay % 1000) * 1000000;
+    if (timerfd_settime(timer_fd, 0, &spec, nullptr) < 0)
+      throw runtime_error("timerfd_settime failed");
+  }
+
+  // Calls `handler` with the number of every signal in `signals` that arrives. The signals have
+  // to be blocked in every thread.
+  void add_signals(const sigset_t& signals, function<void(int)> handler) {
+    signal_fd = signalfd(-1, &signals, SFD_NONBLOCK | SFD_CLOEXEC);
+    if (signal_fd < 0) throw runtime_error("signalfd failed");
+    add(signal_fd, EPOLLIN, [this, handler](u32) {
+      signalfd_siginfo info;
+      while (read(signal_fd, &info, sizeof info) == sizeof info) handler(info.ssi_signo);
+    });
+  }
+
+  // Dispatches events until `keep_running` goes false. `after_events` is called after every
+  // round of events.
+  void run(atomic<bool>* keep_running, function<void()> after_events) {
+    epoll_event events[max_events];
+    while (*keep_running) {
+      int num_events = epoll_wait(epoll_fd, events, max_events, -1);
+      if (num_events < 0) {
+        if (errno == EINTR) continue;
+        throw runtime_error("epoll_wait failed");
+      }
+      for (int i = 0; i < num_events && *keep_running; i++) {
+        // a handler may have removed the descriptor of a later event
+        auto it = handlers.find(events[i].data.fd);
+        if (it == handlers.end()) continue;
+        Handler handler = it->second;
+        handler(events[i].events);
+      }
+      after_events();
+    }
+  }
+};
+
+#endif
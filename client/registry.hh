@@ -0,0 +1,167 @@
+#ifndef REGISTRY_HH
+#define REGISTRY_HH
+
+// The proxies the client knows about. They are found by id in a hash table, listed in the menu in
+// the order of their ids, which a sorted vector keeps without sorting on every render, and expire
+// through a timer wheel. Another hash table groups them by station, so that picking a proxy of a
+// station only looks at the proxies relaying it.
+//
+// The wheel is checked lazily: a proxy is put in the slot of the time it would expire at, and when
+// the slot comes up it is either removed or put in the slot of its new expiry time. So hearing
+// from a proxy, which happens with every datagram, only updates last_contact. An entry in the
+// wheel whose stamp is not the proxy's latest was left behind by an erase and is skipped.
+
+#include <algorithm>
+#include <limits>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include "../common/types.hh"
+#include "proxyinfo.hh"
+#include "utils.hh"
+
+using namespace std;
+
+class ProxyRegistry {
+  friend class ClientBench;
+
+  static const i64 slot_time = 100;  // milliseconds
+  static const size_t num_slots = 64;
+
+  struct Entry {
+    shared_ptr<ProxyInfo> proxy;
+    i64 slot;   // the slot time it is due at
+    u32 stamp;  // of its entry in the wheel
+  };
+
+  struct Timer {
+    u64 id;
+    u32 stamp;
+  };
+
+  i64 timeout;  // a proxy not heard from for longer, in milliseconds, expires
+  unordered_map<u64, Entry> by_id;
+  vector<shared_ptr<ProxyInfo>> ordered;  // by id
+  unordered_map<string, vector<shared_ptr<ProxyInfo>>> by_station;  // by info, in no order
+  vector<Timer> slots[num_slots];         // a slot holds the proxies due at every num_slots-th time
+  i64 checked;                            // the last slot time expire went through
+  u32 last_stamp;
+
+  static bool id_less(const shared_ptr<ProxyInfo>& proxy, u64 id) { return proxy->id < id; }
+
+  void unlink_station(const shared_ptr<ProxyInfo>& proxy) {
+    auto it = by_station.find(proxy->info);
+    if (it == by_station.end()) return;
+    auto& relays = it->second;
+    relays.erase(std::find(relays.begin(), relays.end(), proxy));
+    if (relays.empty()) by_station.erase(it);
+  }
+
+  // The slot time at which `proxy` expires if it is not heard from until then.
+  i64 expiry_slot(const ProxyInfo& proxy) const {
+    return (proxy.last_contact + timeout) / slot_time + 1;
+  }
+
+  void schedule(Entry& entry) {
+    // an expiry time already gone through waits for the next slot
+    entry.slot = max(expiry_slot(*entry.proxy), checked + 1);
+    entry.stamp = ++last_stamp;
+    slots[entry.slot % num_slots].push_back({entry.proxy->id, entry.stamp});
+  }
+
+ public:
+  explicit ProxyRegistry(i64 timeout)
+      : timeout(timeout), checked(now() / slot_time), last_stamp(0) {}
+
+  size_t size() const { return ordered.size(); }
+
+  // Returns nullptr if there is no proxy with `id`.
+  shared_ptr<ProxyInfo> find(u64 id) const {
+    auto it = by_id.find(id);
+    return it != by_id.end() ? it->second.proxy : nullptr;
+  }
+
+  // Adds a proxy with an id not in the registry yet.
+  void insert(const shared_ptr<ProxyInfo>& proxy) {
+    Entry& entry = by_id[proxy->id];
+    entry.proxy = proxy;
+    ordered.insert(lower_bound(ordered.begin(), ordered.end(), proxy->id, id_less), proxy);
+    by_station[proxy->info].push_back(proxy);
+    schedule(entry);
+  }
+
+  // Its slot in the wheel is left behind and skipped when it comes up.
+  void erase(u64 id) {
+    auto it = by_id.find(id);
+    if (it == by_id.end()) return;
+    unlink_station(it->second.proxy);
+    by_id.erase(it);
+    ordered.erase(lower_bound(ordered.begin(), ordered.end(), id, id_less));
+  }
+
+  // Changes the station of a proxy in the registry, the one in its IAM.
+  void set_info(const shared_ptr<ProxyInfo>& proxy, const string& info) {
+    if (proxy->info == info) return;
+    unlink_station(proxy);
+    proxy->info = info;
+    by_station[info].push_back(proxy);
+  }
+
+  // The proxies relaying the station `info`.
+  const vector<shared_ptr<ProxyInfo>>& station(const string& info) const {
+    static const vector<shared_ptr<ProxyInfo>> none;
+    auto it = by_station.find(info);
+    return it != by_station.end() ? it->second : none;
+  }
+
+  // Indexing starts at 0.
+  const shared_ptr<ProxyInfo>& at(size_t index) const { return ordered[index]; }
+
+  const vector<shared_ptr<ProxyInfo>>& in_order() const { return ordered; }
+
+  auto begin() const { return ordered.begin(); }
+  auto end() const { return ordered.end(); }
+
+  // Removes the proxies not heard from for longer than the timeout by `current_time` and returns
+  // them.
+  vector<shared_ptr<ProxyInfo>> expire(i64 current_time) {
+    vector<shared_ptr<ProxyInfo>> expired;
+    i64 last = current_time / slot_time;
+    // a wheel turn or more late, every slot is gone through once
+    i64 first = max(checked + 1, last - static_cast<i64>(num_slots) + 1);
+    vector<Timer> due;
+    for (i64 slot = first; slot <= last; slot++) {
+      checked = slot;
+      due.clear();
+      due.swap(slots[slot % num_slots]);
+      for (Timer timer : due) {
+        auto it = by_id.find(timer.id);
+        if (it == by_id.end() || it->second.stamp != timer.stamp) continue;  // left behind
+        Entry& entry = it->second;
+        if (entry.slot > slot) {
+          slots[slot % num_slots].push_back(timer);  // due in a later turn of the wheel
+        } else if (current_time - entry.proxy->last_contact > timeout) {
+          expired.push_back(entry.proxy);
+          erase(timer.id);
+        } else {
+          schedule(entry);
+        }
+      }
+    }
+    checked = last;
+    return expired;
+  }
+
+  // Returns the time in milliseconds expire has something to look at next, or the maximum i64
+  // value if the registry is empty.
+  i64 next_expiry() const {
+    if (by_id.empty()) return numeric_limits<i64>::max();
+    for (i64 slot = checked + 1; slot <= checked + static_cast<i64>(num_slots); slot++) {
+      if (!slots[slot % num_slots].empty()) return slot * slot_time;
+    }
+    return (checked + 1) * slot_time;
+  }
+};
+
+#endif
@@ -0,0 +1,84 @@
+#ifndef RING_HH
+#define RING_HH
+
+// A lock-free ring between the client's threads, used for the events the telnet server and the
+// proxy client pass to the model and for the audio the proxy client passes to the output.
+
+#include <atomic>
+#include <cstddef>
+#include <memory>
+#include <stdexcept>
+#include <utility>
+#include "../common/types.hh"
+
+using namespace std;
+
+// A bounded multi-producer single-consumer ring. Every cell carries a sequence number that says
+// whether it is free for the producer that claimed its position or full for the consumer, so
+// producers only contend on the head index (after D. Vyukov's bounded MPMC queue).
+template <class T>
+class MpscRing {
+  struct Cell {
+    atomic<size_t> seq;
+    T value;
+  };
+
+  const size_t capacity;
+  unique_ptr<Cell[]> cells;
+  alignas(64) atomic<size_t> head;  // next position a producer claims
+  alignas(64) size_t tail;          // next position the consumer takes, only used by the consumer
+
+ public:
+  // `capacity` has to be a power of two.
+  explicit MpscRing(size_t capacity)
+      : capacity(capacity), cells(new Cell[capacity]), head(0), tail(0) {
+    if (capacity == 0 || (capacity & (capacity - 1)) != 0)
+      throw runtime_error("ring capacity has to be a power of two");
+    for (size_t i = 0; i < capacity; i++) cells[i].seq.store(i, memory_order_relaxed);
+  }
+
+  // Moves `value` into the ring. Returns false and leaves `value` alone if the ring is full.
+  bool try_push(T& value) {
+    size_t pos = head.load(memory_order_relaxed);
+    Cell* cell;
+    while (true) {
+      cell = &cells[pos & (capacity - 1)];
+      size_t seq = cell->seq.load(memory_order_acquire);
+      auto diff = static_cast<ptrdiff_t>(seq) - static_cast<ptrdiff_t>(pos);
+      if (diff == 0) {
+        if (head.compare_exchange_weak(pos, pos + 1, memory_order_relaxed)) break;
+      } else if (diff < 0) {
+        return false;
+      } else {
+        pos = head.load(memory_order_relaxed);
+      }
+    }
+    cell->value = move(value);
+    cell->seq.store(pos + 1, memory_order_release);
+    return true;
+  }
+
+  bool try_pop(T& value) {
+    return try_consume([&](T& cell_value) { value = move(cell_value); });
+  }
+
+  // Passes the next value to `consume` in its cell, saving a move.
+  template <class F>
+  bool try_consume(F consume) {
+    Cell& cell = cells[tail & (capacity - 1)];
+    if (cell.seq.load(memory_order_acquire) != tail + 1) return false;
+    consume(cell.value);
+    cell.seq.store(tail + capacity, memory_order_release);
+    tail++;
+    return true;
+  }
+
+  // Only the consumer gets an exact size, producers may be pushing meanwhile.
+  size_t size() const { return head.load(memory_order_relaxed) - tail; }
+
+  bool empty() const {
+    return cells[tail & (capacity - 1)].seq.load(memory_order_acquire) != tail + 1;
+  }
+};
+
+#endif
@@ -1,48 +1,103 @@
 #ifndef TELNET_HH
 #define TELNET_HH
 
+// The telnet UI. Any number of sessions, up to max_sessions, watch the same menu, each with its
+// own cursor. The model renders the menu once per change and the frame is shared by all sessions.
+// Moving the cursor is handled here, the model only hears about the line a session pressed enter
+// on.
+//
+// Every session remembers what its screen shows, and a new frame only sends it the rows that
+// changed, each addressed with the cursor, all in one write. Of the options a session sees a page
+// of page_rows around its cursor, so a long list of proxies costs no more to show than a short one.
+// The model only formats the options near the sessions' pages, see viewports, and a session that
+// scrolls past them asks for another frame.
+//
+// Sessions are written to without blocking. A session that does not take its frames falls behind,
+// and once more than max_pending bytes wait for it, it is dropped.
+
 #include <fcntl.h>
 #include <netdb.h>
-#include <poll.h>
+#include <netinet/tcp.h>
+#include <sys/epoll.h>
 #include <sys/socket.h>
-#include <sys/stat.h>
-#include <sys/time.h>
 #include <sys/types.h>
+#include <sys/uio.h>
 #include <unistd.h>
 #include <algorithm>
 #include <atomic>
+#include <cerrno>
 #include <cstring>
+#include <deque>
 #include <exception>
 #include <functional>
-#include <iostream>
 #include <memory>
-#include <regex>
-#include <sstream>
+#include <mutex>
 #include <stdexcept>
 #include <string>
-#include <tuple>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+#include "../common/log.hh"
+#include "../common/types.hh"
 #include "events.hh"
-#include "types.hh"
 
 using namespace std;
 
 class TelnetServer {
+  friend class ClientBench;
+
+  static const size_t max_sessions = 64;
+  static const size_t max_pending = 1 << 16;  // bytes
+  static const size_t max_iov = 64;
+  static const int max_events = 64;
+  static const int page_rows = 20;  // rows of options a session sees at once
+
+  struct Frame {
+    vector<string> lines;
+    int num_options;  // the first lines, the ones a cursor can be on
+    vector<pair<int, int>> shown;  // the options that were formatted, the others are empty
+  };
+
+  struct Session {
+    conn_t sock;
+    deque<u8> input;  // the last bytes read, newest first, to recognize keys by
+    int cursor_line;  // indexing starts at 1
+    int top;          // the option on the first row, indexing starts at 0
+    // What the screen shows: a line of shown_frame for every row.
+    shared_ptr<const Frame> shown_frame;
+    vector<const string*> shown;
+    int cursor_row;  // indexing starts at 1, 0 if not known
+    deque<shared_ptr<const string>> output;  // waiting to be sent, shared with other sessions
+    size_t output_sent;  // bytes of the first one that were sent
+    size_t pending;      // bytes waiting
+    bool want_write;
+    bool dropped;
+  };
+
   u16 port;
 
   conn_t sock;
-  sockaddr_in client_address;
-  socklen_t client_address_len;
-  conn_t client_sock;
+  int epoll_fd;
+
+  Notify notify;
 
-  function<void(shared_ptr<Event>)> notify;
+  // The model's render and the telnet loop both write to sessions, in reactor mode on the same
+  // thread and otherwise on two.
+  mutex lock;
+  unordered_map<conn_t, Session> sessions;
+  shared_ptr<const Frame> frame;  // the menu rendered last, sent to new sessions right away
+  vector<int> selected;           // lines enter was pressed on, notified once lock is released
+  bool scrolled_out;  // a session's page has options the frame did not format
 
- private:
   void setup_connection() {
     if (sock >= 0) close(sock);
-    sock = socket(PF_INET, SOCK_STREAM, 0);
+    sock = socket(PF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
     if (sock < 0) {
       throw runtime_error("socket failed");
     }
+    int optval = 1;
+    if (setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, (void*)&optval, sizeof optval) < 0)
+      throw runtime_error("setsockopt reuseaddr failed");
     sockaddr_in server_address;
     server_address.sin_family = AF_INET;
     server_address.sin_addr.s_addr = htonl(INADDR_ANY);
@@ -51,97 +106,194 @@ class TelnetServer {
     if (bind(sock, (sockaddr*)&server_address, sizeof(server_address)) < 0) {
       throw runtime_error("telnet bind failed");
     }
+    if (listen(sock, SOMAXCONN) < 0) {
+      throw runtime_error("listen failed");
+    }
+
+    epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (epoll_fd < 0) throw runtime_error("epoll_create1 failed");
+    epoll_control(EPOLL_CTL_ADD, sock, EPOLLIN);
   }
 
-  void send_msg(const u8* msg, size_t size) {
-    size_t sent_total = 0;
-    ssize_t sent = 0;
+  void epoll_control(int op, int fd, u32 events) {
+    epoll_event ev;
+    ev.events = events;
+    ev.data.fd = fd;
+    if (epoll_ctl(epoll_fd, op, fd, &ev) < 0) throw runtime_error("epoll_ctl failed");
+  }
 
-    while (sent_total < size) {
-      sent = write(client_sock, msg, size - sent_total);
-      if (sent <= 0) throw runtime_error("write failed");
-      sent_total += sent;
-    }
+  static shared_ptr<const string> display_options() {
+    static const u8 options[] = {255, 253, 34,                       // do linemode
+                                 255, 250, 34, 1, 0, 255, 240,       // linemode options
+                                 255, 251, 1};                       // will echo
+    static auto bytes = make_shared<const string>(options, options + sizeof options);
+    return bytes;
   }
 
-  void set_display_options() {
-    static u8 do_linemode[] = {255, 253, 34};
-    static u8 linemode_options[] = {255, 250, 34, 1, 0, 255, 240};
-    static u8 will_echo[] = {255, 251, 1};
+  static string clear_screen() { return "\033[H\033[2J"; }
 
-    send_msg(do_linemode, sizeof(do_linemode));
-    send_msg(linemode_options, sizeof(linemode_options));
-    send_msg(will_echo, sizeof(will_echo));
-  }
+  // From the cursor to the end of its line.
+  static string clear_line() { return "\033[K"; }
 
-  void clear_screen() {
-    static u8 clear[] = {27, '[', 'H', 27, '[', '2', 'J'};
-    send_msg(clear, sizeof(clear));
-  }
+  // From the cursor to the end of the screen.
+  static string clear_below() { return "\033[J"; }
 
   // Indexing starts at 1.
-  void set_cursor_pos(u32 row) {
-    stringstream builder;
-    builder << (char)27 << "[" << to_string(row) << ";0H";
-    string command = builder.str();
-    send_msg((u8*)(command.c_str()), command.size());
-  }
+  static string set_cursor_pos(u32 row) { return "\033[" + to_string(row) + ";0H"; }
 
-  bool accept_new_connection() {
-    if (client_sock >= 0) close(client_sock);
+  // Sends as much of what waits for the session as it takes without blocking.
+  void flush(Session& s) {
+    while (s.pending > 0) {
+      iovec iov[max_iov];
+      size_t count = 0;
+      for (auto& bytes : s.output) {
+        if (count == max_iov) break;
+        size_t offset = count == 0 ? s.output_sent : 0;
+        iov[count++] = {const_cast<char*>(bytes->data()) + offset, bytes->size() - offset};
+      }
+      msghdr msg = {};
+      msg.msg_iov = iov;
+      msg.msg_iovlen = count;
+      ssize_t sent = sendmsg(s.sock, &msg, MSG_DONTWAIT | MSG_NOSIGNAL);
+      if (sent < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) break;
+      if (sent < 0) {
+        s.dropped = true;  // the client is gone
+        return;
+      }
+      s.pending -= sent;
+      size_t left = sent;
+      while (left > 0 && left >= s.output.front()->size() - s.output_sent) {
+        left -= s.output.front()->size() - s.output_sent;
+        s.output.pop_front();
+        s.output_sent = 0;
+      }
+      s.output_sent += left;
+    }
+    bool want_write = s.pending > 0;
+    if (want_write != s.want_write) {
+      u32 events = EPOLLIN | EPOLLRDHUP | (want_write ? static_cast<u32>(EPOLLOUT) : 0);
+      epoll_control(EPOLL_CTL_MOD, s.sock, events);
+      s.want_write = want_write;
+    }
+  }
 
-    if (listen(sock, 1) < 0) {
-      throw runtime_error("listen failed");
+  void queue(Session& s, const shared_ptr<const string>& bytes) {
+    if (s.dropped) return;
+    if (s.pending + bytes->size() > max_pending) {
+      LOG_WARN("A telnet session fell behind by %zu bytes, dropping it", s.pending);
+      s.dropped = true;
+      return;
     }
+    s.output.push_back(bytes);
+    s.pending += bytes->size();
+  }
 
-    pollfd fds[1];
-    fds[0].fd = sock;
-    fds[0].events = POLLIN;
-    fds[0].revents = 0;
+  // Brings the session's screen up to date with the frame and its cursor.
+  void update(Session& s) {
+    if (!frame) return;
+    int options = frame->num_options;
+    s.cursor_line = min(max(s.cursor_line, 1), max(options, 1));
+    // scroll as little as keeps the cursor on the page
+    s.top = min(s.top, s.cursor_line - 1);
+    s.top = max(s.top, s.cursor_line - page_rows);
+    s.top = max(0, min(s.top, options - page_rows));
 
-    int status = poll(fds, 1, 100);
-    if (status == -1) {
-      throw runtime_error("poll failed");
-    } else if (status == 0) {
-      // timeout occured
-      return false;
-    } else {
-      client_address_len = sizeof(client_address);
-      client_sock = accept(sock, (struct sockaddr*)&client_address, &client_address_len);
-      if (client_sock < 0) {
-        throw std::runtime_error("accept failed");
+    vector<const string*> rows;
+    for (int i = s.top; i < min(options, s.top + page_rows); i++) rows.push_back(&frame->lines[i]);
+    for (size_t i = options; i < frame->lines.size(); i++) rows.push_back(&frame->lines[i]);
+
+    string out;
+    for (size_t row = 0; row < rows.size(); row++) {
+      if (row < s.shown.size() && (s.shown[row] == rows[row] || *s.shown[row] == *rows[row]))
+        continue;
+      out += set_cursor_pos(row + 1) + *rows[row] + clear_line();
+    }
+    if (rows.size() < s.shown.size()) out += set_cursor_pos(rows.size() + 1) + clear_below();
+    int last = min(options, s.top + page_rows);
+    auto covers = [&](auto& range) { return range.first <= s.top && last <= range.second; };
+    if (!any_of(frame->shown.begin(), frame->shown.end(), covers)) scrolled_out = true;
+    int cursor_row = s.cursor_line - s.top;
+    if (!out.empty() || cursor_row != s.cursor_row) out += set_cursor_pos(cursor_row);
+    s.cursor_row = cursor_row;
+    s.shown_frame = frame;
+    s.shown = move(rows);
+    if (!out.empty()) queue(s, make_shared<const string>(move(out)));
+  }
+
+  void remove_dropped() {
+    for (auto it = sessions.begin(); it != sessions.end();) {
+      if (it->second.dropped) {
+        epoll_ctl(epoll_fd, EPOLL_CTL_DEL, it->first, nullptr);
+        close(it->first);
+        it = sessions.erase(it);
+      } else {
+        it++;
       }
     }
-    set_display_options();
+  }
 
-    return true;
+  void accept_sessions() {
+    while (true) {
+      conn_t fd = accept4(sock, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+      if (fd < 0) {
+        if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) return;
+        if (errno == EMFILE || errno == ENFILE || errno == ECONNABORTED) return;
+        throw runtime_error("accept failed");
+      }
+      if (sessions.size() >= max_sessions) {
+        close(fd);
+        continue;
+      }
+      // a frame is one write, there is nothing to wait for
+      int optval = 1;
+      setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &optval, sizeof optval);
+      open_session(fd);
+    }
   }
 
-  tuple<u8, bool> read_input() {
-    u8 input;
-    pollfd fds[1];
-    fds[0].fd = client_sock;
-    fds[0].events = POLLIN;
-    fds[0].revents = 0;
+  void open_session(conn_t fd) {
+    Session& s = sessions[fd];
+    s = Session{fd, {}, 1, 0, nullptr, {}, 0, {}, 0, 0, false, false};
+    epoll_control(EPOLL_CTL_ADD, fd, EPOLLIN | EPOLLRDHUP);
+    queue(s, display_options());
+    queue(s, make_shared<const string>(clear_screen()));
+    update(s);
+    flush(s);
+  }
 
-    int status = poll(fds, 1, 100);
-    if (status == -1) {
-      throw runtime_error("poll failed");
-    } else if (status == 0) {
-      // timeout occured
-      return {0, false};
+  // Moves the cursor on arrow keys and remembers the line enter is pressed on.
+  void on_input(Session& s, u8 byte) {
+    auto& in = s.input;
+    in.push_front(byte);
+    while (in.size() > 3) in.pop_back();
+    if (in.size() >= 3 && in[0] == 65 && in[1] == 91 && in[2] == 27) {  // up arrow
+      s.cursor_line--;
+    } else if (in.size() >= 3 && in[0] == 66 && in[1] == 91 && in[2] == 27) {  // down arrow
+      s.cursor_line++;
+    } else if (in.size() >= 2 && in[0] == 0 && in[1] == 13) {  // enter
+      selected.push_back(s.cursor_line);
+      return;
     } else {
-      if (read(client_sock, &input, 1) != 1) throw runtime_error("read failed");
-      return {input, true};
+      return;  // unrecognized input, do nothing
     }
+    update(s);
   }
 
- public:
-  TelnetServer(u16 port, function<void(shared_ptr<Event>)> notify) : port(port), notify(notify) {
-    sock = -1;
-    client_sock = -1;
+  // Reads what the session sent without blocking. Returns false if it closed the connection.
+  bool read_input(Session& s) {
+    u8 buf[256];
+    while (true) {
+      ssize_t len = recv(s.sock, buf, sizeof buf, MSG_DONTWAIT);
+      if (len == 0) return false;
+      if (len < 0) return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR;
+      for (ssize_t i = 0; i < len; i++) on_input(s, buf[i]);
+    }
   }
 
+ public:
+  TelnetServer(u16 port, Notify notify)
+      : port(port), sock(-1), epoll_fd(-1), notify(notify), scrolled_out(false) {}
+
   ~TelnetServer() {
     try {
       clean_up();
@@ -153,55 +305,108 @@ class TelnetServer {
   void init() { setup_connection(); }
 
   void clean_up() {
-    bool sock_failed = false;
-    bool client_sock_failed = false;
-
-    if (sock >= 0) {
-      try {
-        sock_failed = close(sock) != 0;
-      } catch (...) {
-        sock_failed = true;
-      }
+    lock_guard<mutex> lock_g(lock);
+    for (auto& pair : sessions) close(pair.first);
+    sessions.clear();
+    if (epoll_fd >= 0) close(epoll_fd);
+    epoll_fd = -1;
+    if (sock >= 0 && close(sock) != 0) {
+      sock = -1;
+      throw runtime_error("sock close failed");
     }
-    if (client_sock >= 0) {
-      try {
-        client_sock_failed = close(client_sock) != 0;
-      } catch (...) {
-        client_sock_failed = true;
+    sock = -1;
+  }
+
+  // Readable when there are connections, input or room for output, see poll. The reactor (see
+  // Model::start_reactor) waits for this instead of calling start.
+  int poll_fd() const { return epoll_fd; }
+
+  // Handles what happened on the sessions, waiting for at most `timeout` milliseconds.
+  void poll(int timeout) {
+    epoll_event events[max_events];
+    int num_events = epoll_wait(epoll_fd, events, max_events, timeout);
+    if (num_events < 0) {
+      if (errno == EINTR) return;
+      throw runtime_error("epoll_wait failed");
+    }
+    vector<int> lines;
+    bool scrolled;
+    {
+      lock_guard<mutex> lock_g(lock);
+      for (int i = 0; i < num_events; i++) {
+        int fd = events[i].data.fd;
+        u32 flags = events[i].events;
+        if (fd == sock) {
+          accept_sessions();
+          continue;
+        }
+        auto it = sessions.find(fd);
+        if (it == sessions.end()) continue;
+        Session& s = it->second;
+        if (flags & (EPOLLERR | EPOLLHUP)) s.dropped = true;
+        if (!s.dropped && (flags & (EPOLLIN | EPOLLRDHUP)) && !read_input(s)) s.dropped = true;
+        if (!s.dropped) flush(s);
       }
+      remove_dropped();
+      lines.swap(selected);
+      scrolled = scrolled_out;
+      scrolled_out = false;
     }
-
-    if (sock_failed) throw runtime_error("sock close failed");
-    if (client_sock_failed) throw runtime_error("client sock close failed");
+    // the model may render right away, so this happens without the lock
+    for (int line : lines) notify(EventUserInput(line));
+    if (scrolled) notify(EventScrolled());
   }
 
   void start(atomic<bool>* keep_running) {
     try {
-      bool connection_open = false;
-      while (*keep_running) {
-        while (*keep_running && !connection_open && !accept_new_connection()) {
-          // try to get a connection
-        }
-        if (!connection_open) notify(make_shared<EventNewTelnetConnection>());
-        connection_open = true;
-        try {
-          const auto& [in, read_succeeded] = read_input();
-          if (read_succeeded) notify(make_shared<EventUserInput>(in));
-        } catch (...) {
-          connection_open = false;
-        };
-      }
+      while (*keep_running) poll(100);
     } catch (...) {
-      auto event = make_shared<EventTelnetServerCrashed>(current_exception());
-      notify(event);
+      notify(EventTelnetServerCrashed(current_exception()));
       throw;
     }
   }
 
-  void render(const string& text, u32 cursor_pos) {
-    clear_screen();
-    send_msg((const u8*)(text.c_str()), text.size());
-    set_cursor_pos(cursor_pos);
+  // The options to format for the next frame: the sessions' pages, a page before and after each
+  // so that scrolling goes on without a new frame, and the first pages for sessions yet to come.
+  // The ranges are sorted and do not overlap.
+  vector<pair<int, int>> viewports() {
+    lock_guard<mutex> lock_g(lock);
+    vector<pair<int, int>> ranges{{0, 2 * page_rows}};
+    for (auto& pair : sessions) {
+      int top = pair.second.top;
+      ranges.push_back({max(0, top - page_rows), top + 2 * page_rows});
+    }
+    sort(ranges.begin(), ranges.end());
+    vector<pair<int, int>> merged;
+    for (auto& range : ranges) {
+      if (!merged.empty() && range.first <= merged.back().second) {
+        merged.back().second = max(merged.back().second, range.second);
+      } else {
+        merged.push_back(range);
+      }
+    }
+    return merged;
+  }
+
+  // Shows `lines` to every session, with the cursor of each on one of the first `options`, of
+  // which those in `shown` were formatted. Returns true if a session scrolled past them meanwhile,
+  // and the menu should be rendered again.
+  bool render(vector<string> lines, int options, vector<pair<int, int>> shown) {
+    lock_guard<mutex> lock_g(lock);
+    frame = make_shared<const Frame>(Frame{move(lines), options, move(shown)});
+    for (auto& pair : sessions) {
+      update(pair.second);
+      flush(pair.second);
+    }
+    remove_dropped();
+    bool scrolled = scrolled_out;
+    scrolled_out = false;
+    return scrolled;
+  }
+
+  size_t num_sessions() {
+    lock_guard<mutex> lock_g(lock);
+    return sessions.size();
   }
 };
 
@@ -1,27 +1,52 @@
 #ifndef UI_HH
 #define UI_HH
 
+#include <algorithm>
 #include <memory>
-#include <sstream>
 #include <string>
+#include <utility>
 #include <vector>
 #include "proxyinfo.hh"
+#include "utils.hh"
 
 using namespace std;
 
-string generate_ui(vector<shared_ptr<ProxyInfo>>& proxies) {
-  stringstream buf;
-  buf << "Szukaj pośrednika\r\n";
-  for (auto& proxy : proxies) {
-    buf << "Pośrednik " << proxy->info << (proxy->active ? " *\r\n" : "\r\n");
+// Returns the lines of the menu, see TelnetServer::render: the options, one for every proxy
+// between the first and the last, and then the metadata of the playing proxy. Only the options in
+// `shown`, ranges of option indices that start at 0, are formatted, the others are left empty, so
+// that a frame costs as much as the pages the telnet sessions look at.
+vector<string> generate_ui(const vector<shared_ptr<ProxyInfo>>& proxies,
+                           const vector<pair<int, int>>& shown) {
+  int options = static_cast<int>(proxies.size()) + 2;
+  vector<string> lines(options);
+  i64 current_time = now();
+  for (auto [first, last] : shown) {
+    for (int i = max(first, 0); i < min(last, options); i++) {
+      if (i == 0) {
+        lines[i] = "Szukaj pośrednika";
+        continue;
+      }
+      if (i == options - 1) {
+        lines[i] = "Koniec";
+        continue;
+      }
+      auto& proxy = proxies[i - 1];
+      string line = "Pośrednik " + proxy->info;
+      if (proxy->load_known) {
+        line += " (" + to_string(static_cast<i64>(proxy->probes.rtt())) + " ms";
+        i64 loss = static_cast<i64>(proxy->probes.loss(current_time) * 100);
+        if (loss > 0) line += ", straty " + to_string(loss) + "%";
+        line += ", słuchaczy: " + to_string(proxy->load.clients) + ", " +
+                to_string(proxy->load.egress_rate / 1000) + " kbit/s)";
+      }
+      if (proxy->active) line += " *";
+      lines[i] = move(line);
+    }
   }
-  buf << "Koniec\r\n";
   for (auto& proxy : proxies) {
-    if (proxy->active) {
-      buf << proxy->meta << "\r\n";
-    }
+    if (proxy->active) lines.push_back(proxy->meta);
   }
-  return buf.str();
-};
+  return lines;
+}
 
 #endif
@@ -7,7 +7,7 @@
 #include <sys/socket.h>
 #include <chrono>
 #include <regex>
-#include "types.hh"
+#include "../common/types.hh"
 
 using namespace std;
 
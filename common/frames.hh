@@ -0,0 +1,144 @@
+#ifndef FRAMES_HH
+#define FRAMES_HH
+
+// Parsing of MP3 and AAC (ADTS) frame headers, which the proxy packetizes the stream by and the
+// client orders and times audio by.
+
+#include <string>
+#include "types.hh"
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+using namespace std;
+
+enum class FrameFormat { UNKNOWN, MP3, ADTS };
+
+inline string frame_format_str(FrameFormat format) {
+  switch (format) {
+    case FrameFormat::MP3:
+      return "MPEG audio";
+    case FrameFormat::ADTS:
+      return "AAC (ADTS)";
+    default:
+      return "unknown";
+  }
+}
+
+struct FrameInfo {
+  FrameFormat format;
+  size_t length;     // in bytes, including the header
+  u32 sample_rate;   // in Hz
+  u32 samples;       // per channel in the frame
+  u32 bitrate;       // in bits per second, for ADTS derived from the frame length
+};
+
+// Longest header that parse_frame_header needs to see.
+constexpr size_t MAX_FRAME_HEADER_SIZE = 7;
+
+inline bool parse_mp3_header(const u8* p, FrameInfo& info) {
+  static const u32 bitrates[2][3][15] = {
+      // MPEG-1, layers I, II, III
+      {{0, 32, 64, 96, 128, 160, 192, 224, 256, 288, 320, 352, 384, 416, 448},
+       {0, 32, 48, 56, 64, 80, 96, 112, 128, 160, 192, 224, 256, 320, 384},
+       {0, 32, 40, 48, 56, 64, 80, 96, 112, 128, 160, 192, 224, 256, 320}},
+      // MPEG-2 and MPEG-2.5, layers I, II, III
+      {{0, 32, 48, 56, 64, 80, 96, 112, 128, 144, 160, 176, 192, 224, 256},
+       {0, 8, 16, 24, 32, 40, 48, 56, 64, 80, 96, 112, 128, 144, 160},
+       {0, 8, 16, 24, 32, 40, 48, 56, 64, 80, 96, 112, 128, 144, 160}}};
+  static const u32 sample_rates[3] = {44100, 48000, 32000};
+
+  if (p[0] != 0xFF || (p[1] & 0xE0) != 0xE0) return false;
+  u32 version = (p[1] >> 3) & 3;  // 0: MPEG-2.5, 1: reserved, 2: MPEG-2, 3: MPEG-1
+  u32 layer = 4 - ((p[1] >> 1) & 3);  // 4 means reserved
+  u32 bitrate_index = p[2] >> 4;
+  u32 sample_rate_index = (p[2] >> 2) & 3;
+  u32 padding = (p[2] >> 1) & 1;
+  // free-format frames have no length in the header, so they are treated as unframed data
+  if (version == 1 || layer == 4 || bitrate_index == 0 || bitrate_index == 15 ||
+      sample_rate_index == 3)
+    return false;
+
+  bool mpeg1 = version == 3;
+  u32 bitrate = bitrates[mpeg1 ? 0 : 1][layer - 1][bitrate_index] * 1000;
+  u32 sample_rate = sample_rates[sample_rate_index] >> (mpeg1 ? 0 : version == 2 ? 1 : 2);
+  if (layer == 1) {
+    info.samples = 384;
+    info.length = (12 * bitrate / sample_rate + padding) * 4;
+  } else if (layer == 2 || mpeg1) {
+    info.samples = 1152;
+    info.length = 144 * bitrate / sample_rate + padding;
+  } else {
+    info.samples = 576;
+    info.length = 72 * bitrate / sample_rate + padding;
+  }
+  info.format = FrameFormat::MP3;
+  info.sample_rate = sample_rate;
+  info.bitrate = bitrate;
+  return true;
+}
+
+inline bool parse_adts_header(const u8* p, FrameInfo& info) {
+  static const u32 sample_rates[13] = {96000, 88200, 64000, 48000, 44100, 32000, 24000,
+                                       22050, 16000, 12000, 11025, 8000,  7350};
+
+  if (p[0] != 0xFF || (p[1] & 0xF6) != 0xF0) return false;
+  u32 sample_rate_index = (p[2] >> 2) & 0xF;
+  size_t length = ((p[3] & 3) << 11) | (p[4] << 3) | (p[5] >> 5);
+  size_t header_size = (p[1] & 1) ? 7 : 9;
+  if (sample_rate_index >= 13 || length <= header_size) return false;
+
+  info.format = FrameFormat::ADTS;
+  info.length = length;
+  info.sample_rate = sample_rates[sample_rate_index];
+  info.samples = 1024 * ((p[6] & 3) + 1);
+  info.bitrate = static_cast<u32>(static_cast<u64>(length) * 8 * info.sample_rate / info.samples);
+  return true;
+}
+
+// Parses the frame header at `p`, which has to have MAX_FRAME_HEADER_SIZE readable bytes.
+inline bool parse_frame_header(const u8* p, FrameInfo& info) {
+  // MP3 headers never have layer bits 00, which ADTS headers always have
+  return parse_adts_header(p, info) || parse_mp3_header(p, info);
+}
+
+// Returns the offset of the first byte at or after `from` that may start a frame header, i.e. a
+// 0xFF followed by a byte with its top three bits set, or `len` if there is none. A 0xFF in the
+// last byte is returned too, since the byte after it is not known yet.
+inline size_t find_sync(const u8* data, size_t len, size_t from) {
+  size_t i = from;
+#ifdef __SSE2__
+  const __m128i all_ff = _mm_set1_epi8(static_cast<char>(0xFF));
+  const __m128i top_bits = _mm_set1_epi8(static_cast<char>(0xE0));
+  for (; i + 17 <= len; i += 16) {
+    __m128i first = _mm_loadu_si128(reinterpret_cast<const __m128i*>(data + i));
+    __m128i second = _mm_loadu_si128(reinterpret_cast<const __m128i*>(data + i + 1));
+    __m128i is_ff = _mm_cmpeq_epi8(first, all_ff);
+    __m128i has_top_bits = _mm_cmpeq_epi8(_mm_and_si128(second, top_bits), top_bits);
+    int mask = _mm_movemask_epi8(_mm_and_si128(is_ff, has_top_bits));
+    if (mask != 0) return i + __builtin_ctz(mask);
+  }
+#endif
+  for (; i < len; i++) {
+    if (data[i] == 0xFF && (i + 1 == len || (data[i + 1] & 0xE0) == 0xE0)) return i;
+  }
+  return len;
+}
+
+// Returns the offset of the first frame in the data, or `len` if there is none. That is where a
+// header parses that is followed by another one or by the end of the data, so that a sync word
+// inside a frame is not taken for a header.
+inline size_t find_frame(const u8* data, size_t len) {
+  FrameInfo info;
+  FrameInfo next;
+  for (size_t offset = find_sync(data, len, 0); offset + MAX_FRAME_HEADER_SIZE <= len;
+       offset = find_sync(data, len, offset + 1)) {
+    if (!parse_frame_header(data + offset, info)) continue;
+    size_t end = offset + info.length;
+    if (end + MAX_FRAME_HEADER_SIZE > len || parse_frame_header(data + end, next)) return offset;
+  }
+  return len;
+}
+
+#endif
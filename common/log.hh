@@ -0,0 +1,313 @@
+#ifndef LOG_HH
+#define LOG_HH
+
+// Asynchronous logging for the network loops. A thread that logs formats the message into a ring of
+// its own and returns; a background thread drains the rings and writes them to stderr. Every call
+// site is rate limited separately and the flusher reports how many of its messages it suppressed,
+// so a flood of bad datagrams costs a counter increment per datagram instead of a write to stderr.
+//
+//   LOG_WARN("Could not process an incoming message, skipping it: %s", e.what());
+
+#include <unistd.h>
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <cstdarg>
+#include <cstdio>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+#include "types.hh"
+
+using namespace std;
+
+enum class LogLevel { DEBUG, INFO, WARN, ERROR };
+
+inline LogLevel parse_log_level(const string& name) {
+  if (name == "debug") return LogLevel::DEBUG;
+  if (name == "info") return LogLevel::INFO;
+  if (name == "warn") return LogLevel::WARN;
+  if (name == "error") return LogLevel::ERROR;
+  throw runtime_error("unknown log level: " + name);
+}
+
+inline const char* log_level_prefix(LogLevel level) {
+  switch (level) {
+    case LogLevel::DEBUG:
+      return "debug: ";
+    case LogLevel::INFO:
+      return "";
+    case LogLevel::WARN:
+      return "warning: ";
+    case LogLevel::ERROR:
+      return "error: ";
+  }
+  return "";
+}
+
+inline i64 log_clock_ns() {
+  return chrono::duration_cast<chrono::nanoseconds>(
+             chrono::steady_clock::now().time_since_epoch())
+      .count();
+}
+
+struct LogRecord {
+  static const size_t max_text = 240;  // longer messages are truncated
+
+  i64 time;  // in nanoseconds, to order the records of different threads
+  LogLevel level;
+  u32 len;
+  char text[max_text];
+};
+
+// Records logged by one thread. The thread is the only producer and the flusher the only consumer,
+// so the indices are all the synchronization there is.
+class LogRing {
+  static const size_t capacity = 256;
+
+  LogRecord records[capacity];
+  alignas(64) atomic<u64> head;  // written by the producer
+  alignas(64) atomic<u64> tail;  // written by the flusher
+
+ public:
+  atomic<u64> dropped;  // records lost because the ring was full
+  atomic<bool> retired;  // the thread exited, the ring goes away once it is drained
+
+  LogRing() : head(0), tail(0), dropped(0), retired(false) {}
+
+  // Returns the slot for the next record, or nullptr if the flusher fell behind.
+  LogRecord* claim() {
+    u64 h = head.load(memory_order_relaxed);
+    if (h - tail.load(memory_order_acquire) >= capacity) {
+      dropped.fetch_add(1, memory_order_relaxed);
+      return nullptr;
+    }
+    return &records[h % capacity];
+  }
+
+  void publish() { head.store(head.load(memory_order_relaxed) + 1, memory_order_release); }
+
+  void drain(vector<LogRecord>& out) {
+    u64 t = tail.load(memory_order_relaxed);
+    u64 h = head.load(memory_order_acquire);
+    for (; t < h; t++) out.push_back(records[t % capacity]);
+    tail.store(h, memory_order_release);
+  }
+
+  bool empty() const {
+    return head.load(memory_order_acquire) == tail.load(memory_order_relaxed);
+  }
+};
+
+class LogSite;
+
+class Logger {
+  static const i64 flush_interval = 50;     // in milliseconds
+  static const i64 report_interval = 1000;  // time in milliseconds between suppression reports
+
+  // Registers the ring of a thread on its first message and retires it when the thread exits.
+  struct RingOwner {
+    shared_ptr<LogRing> ring;
+
+    explicit RingOwner(Logger& logger) : ring(make_shared<LogRing>()) {
+      lock_guard<mutex> lock_g(logger.lock);
+      logger.rings.push_back(ring);
+    }
+
+    ~RingOwner() { ring->retired = true; }
+  };
+
+  atomic<int> min_level;
+  mutex lock;  // guards rings and sites, taken by the flusher and when a thread or a site registers
+  vector<shared_ptr<LogRing>> rings;
+  vector<LogSite*> sites;
+  vector<LogRecord> batch;  // only used while flushing
+  string removed_reports;   // what sites destroyed since the last flush still had to report
+
+  atomic<bool> running;
+  thread flusher;
+
+  Logger() : min_level(static_cast<int>(LogLevel::INFO)), running(true) {
+    flusher = thread([this] {
+      while (running) {
+        this_thread::sleep_for(chrono::milliseconds(flush_interval));
+        flush();
+      }
+    });
+  }
+
+  ~Logger() {
+    running = false;
+    flusher.join();
+    flush();
+  }
+
+  static void write_all(const string& text) {
+    size_t offset = 0;
+    while (offset < text.size()) {
+      ssize_t written = ::write(STDERR_FILENO, text.data() + offset, text.size() - offset);
+      if (written < 0 && errno == EINTR) continue;
+      if (written <= 0) return;  // nowhere to log to
+      offset += written;
+    }
+  }
+
+  static void report_suppressed(LogSite& site, string& out);
+  void report_suppressed(i64 time, string& out);
+
+ public:
+  Logger(const Logger&) = delete;
+  Logger& operator=(const Logger&) = delete;
+
+  static Logger& get() {
+    static Logger logger;
+    return logger;
+  }
+
+  void set_level(LogLevel level) { min_level = static_cast<int>(level); }
+
+  bool enabled(LogLevel level) const {
+    return static_cast<int>(level) >= min_level.load(memory_order_relaxed);
+  }
+
+  LogRing& ring() {
+    thread_local RingOwner owner(*this);
+    return *owner.ring;
+  }
+
+  void add_site(LogSite* site) {
+    lock_guard<mutex> lock_g(lock);
+    sites.push_back(site);
+  }
+
+  // Sites are static and go away at exit, before the logger does its last flush.
+  void remove_site(LogSite* site) {
+    lock_guard<mutex> lock_g(lock);
+    report_suppressed(*site, removed_reports);
+    sites.erase(remove(sites.begin(), sites.end(), site), sites.end());
+  }
+
+  void push(LogLevel level, const char* format, va_list args) {
+    LogRing& r = ring();
+    LogRecord* record = r.claim();
+    if (record == nullptr) return;
+    record->time = log_clock_ns();
+    record->level = level;
+    int len = vsnprintf(record->text, LogRecord::max_text, format, args);
+    record->len = len < 0 ? 0 : min(static_cast<size_t>(len), LogRecord::max_text - 1);
+    r.publish();
+  }
+
+  // Writes out everything logged so far. Called by the flusher, and at exit.
+  void flush() {
+    string out;
+    {
+      lock_guard<mutex> lock_g(lock);
+      batch.clear();
+      u64 dropped = 0;
+      for (auto& r : rings) {
+        r->drain(batch);
+        dropped += r->dropped.exchange(0, memory_order_relaxed);
+      }
+      rings.erase(remove_if(rings.begin(), rings.end(),
+                            [](const shared_ptr<LogRing>& r) { return r->retired && r->empty(); }),
+                  rings.end());
+      stable_sort(batch.begin(), batch.end(),
+                  [](const LogRecord& a, const LogRecord& b) { return a.time < b.time; });
+      for (auto& record : batch) {
+        out += log_level_prefix(record.level);
+        out.append(record.text, record.len);
+        out += '\n';
+      }
+      if (dropped > 0)
+        out += "warning: the log fell behind, dropped " + to_string(dropped) + " messages\n";
+      report_suppressed(log_clock_ns() / 1000000, out);
+      out += removed_reports;
+      removed_reports.clear();
+    }
+    // stderr may block, but only this thread waits for it
+    write_all(out);
+  }
+};
+
+// State of one LOG call site, shared by all the threads that log from it. At most `burst` messages
+// a second get through, the rest are counted and reported by the flusher.
+class LogSite {
+  friend class Logger;
+
+  static const u32 burst = 10;
+  static const i64 window = 1000;  // in milliseconds
+
+  const LogLevel level;
+  const char* const format;
+  atomic<i64> window_start;
+  atomic<u32> in_window;
+  atomic<u64> suppressed;
+  i64 last_report;  // only used by the flusher
+
+  bool admit() {
+    i64 time = log_clock_ns() / 1000000;
+    i64 start = window_start.load(memory_order_relaxed);
+    if (time - start >= window &&
+        window_start.compare_exchange_strong(start, time, memory_order_relaxed)) {
+      in_window.store(0, memory_order_relaxed);
+    }
+    if (in_window.fetch_add(1, memory_order_relaxed) < burst) return true;
+    suppressed.fetch_add(1, memory_order_relaxed);
+    return false;
+  }
+
+ public:
+  LogSite(LogLevel level, const char* format)
+      : level(level),
+        format(format),
+        window_start(0),
+        in_window(0),
+        suppressed(0),
+        last_report(0) {
+    Logger::get().add_site(this);
+  }
+
+  ~LogSite() { Logger::get().remove_site(this); }
+
+  __attribute__((format(printf, 2, 3))) void log(const char* fmt, ...) {
+    Logger& logger = Logger::get();
+    if (!logger.enabled(level) || !admit()) return;
+    va_list args;
+    va_start(args, fmt);
+    logger.push(level, fmt, args);
+    va_end(args);
+  }
+};
+
+inline void Logger::report_suppressed(LogSite& site, string& out) {
+  u64 count = site.suppressed.exchange(0, memory_order_relaxed);
+  if (count == 0) return;
+  out += log_level_prefix(site.level);
+  out += "suppressed " + to_string(count) + " messages like \"" + site.format + "\"\n";
+}
+
+inline void Logger::report_suppressed(i64 time, string& out) {
+  for (auto site : sites) {
+    if (time - site->last_report < report_interval && running) continue;
+    site->last_report = time;
+    report_suppressed(*site, out);
+  }
+}
+
+#define LOG(level, format, ...)              \
+  do {                                       \
+    static LogSite log_site_(level, format); \
+    log_site_.log(format, ##__VA_ARGS__);    \
+  } while (0)
+
+#define LOG_DEBUG(...) LOG(LogLevel::DEBUG, __VA_ARGS__)
+#define LOG_INFO(...) LOG(LogLevel::INFO, __VA_ARGS__)
+#define LOG_WARN(...) LOG(LogLevel::WARN, __VA_ARGS__)
+#define LOG_ERROR(...) LOG(LogLevel::ERROR, __VA_ARGS__)
+
+#endif
@@ -1,5 +1,5 @@
-#ifndef PROXY_TYPES_H
-#define PROXY_TYPES_H
+#ifndef TYPES_HH
+#define TYPES_HH
 
 #include <cstdint>
 
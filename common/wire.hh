@@ -0,0 +1,473 @@
+#ifndef WIRE_HH
+#define WIRE_HH
+
+// The UDP protocol spoken between radio-proxy and radio-client. A message is a 4-byte header, the
+// message type and the payload length as big-endian u16s, followed by the payload.
+//
+// Decoding neither allocates nor copies: a MessageView points into the received datagram and is
+// valid for as long as the buffer the datagram was received into.
+
+#include <algorithm>
+#include <cstddef>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <vector>
+#include "types.hh"
+
+using namespace std;
+
+// UDP message types
+constexpr u16 DISCOVER = 1;
+constexpr u16 IAM = 2;
+constexpr u16 KEEPALIVE = 3;
+constexpr u16 AUDIO = 4;
+constexpr u16 METADATA = 6;
+constexpr u16 SEEK = 7;     // carries a u64 time in milliseconds, 0 means going back to live
+constexpr u16 BATCH = 8;    // several audio slices and metadata in one datagram, see BatchWriter
+constexpr u16 CAPS = 9;     // carries u32 capability flags of a client, see CAP_BATCH
+constexpr u16 SELECT = 10;  // carries the u32 id of the station variant a client wants
+constexpr u16 PROBE = 11;   // carries a u32 token that the proxy echoes in LOAD
+constexpr u16 LOAD = 12;    // how busy a proxy is, see ProxyLoad
+
+constexpr size_t HEADER_SIZE = 4;
+constexpr size_t MAX_PAYLOAD_SIZE = 65535;
+
+inline u16 load_be16(const u8* p) { return static_cast<u16>((p[0] << 8) | p[1]); }
+
+inline u32 load_be32(const u8* p) {
+  return (static_cast<u32>(p[0]) << 24) | (static_cast<u32>(p[1]) << 16) |
+         (static_cast<u32>(p[2]) << 8) | p[3];
+}
+
+inline u64 load_be64(const u8* p) {
+  u64 value = 0;
+  for (int i = 0; i < 8; i++) value = (value << 8) | p[i];
+  return value;
+}
+
+inline void store_be16(u8* p, u16 value) {
+  p[0] = static_cast<u8>(value >> 8);
+  p[1] = static_cast<u8>(value);
+}
+
+inline void store_be32(u8* p, u32 value) {
+  for (int i = 3; i >= 0; i--) {
+    p[i] = static_cast<u8>(value);
+    value >>= 8;
+  }
+}
+
+inline void store_be64(u8* p, u64 value) {
+  for (int i = 7; i >= 0; i--) {
+    p[i] = static_cast<u8>(value);
+    value >>= 8;
+  }
+}
+
+// The payload sizes that a message type allows.
+template <u16 Type>
+struct MessageLayout;
+
+template <>
+struct MessageLayout<DISCOVER> {
+  static constexpr size_t min_payload = 0;
+  static constexpr size_t max_payload = 0;
+};
+
+template <>
+struct MessageLayout<IAM> {
+  static constexpr size_t min_payload = 0;
+  static constexpr size_t max_payload = MAX_PAYLOAD_SIZE;
+};
+
+template <>
+struct MessageLayout<KEEPALIVE> {
+  static constexpr size_t min_payload = 0;
+  static constexpr size_t max_payload = 0;
+};
+
+template <>
+struct MessageLayout<AUDIO> {
+  static constexpr size_t min_payload = 0;
+  static constexpr size_t max_payload = MAX_PAYLOAD_SIZE;
+};
+
+template <>
+struct MessageLayout<METADATA> {
+  static constexpr size_t min_payload = 0;
+  static constexpr size_t max_payload = MAX_PAYLOAD_SIZE;
+};
+
+template <>
+struct MessageLayout<SEEK> {
+  static constexpr size_t min_payload = sizeof(u64);
+  static constexpr size_t max_payload = sizeof(u64);
+};
+
+template <>
+struct MessageLayout<BATCH> {
+  static constexpr size_t min_payload = sizeof(u32);
+  static constexpr size_t max_payload = MAX_PAYLOAD_SIZE;
+};
+
+template <>
+struct MessageLayout<CAPS> {
+  static constexpr size_t min_payload = sizeof(u32);
+  static constexpr size_t max_payload = sizeof(u32);
+};
+
+template <>
+struct MessageLayout<SELECT> {
+  static constexpr size_t min_payload = sizeof(u32);
+  static constexpr size_t max_payload = sizeof(u32);
+};
+
+template <>
+struct MessageLayout<PROBE> {
+  static constexpr size_t min_payload = sizeof(u32);
+  static constexpr size_t max_payload = sizeof(u32);
+};
+
+template <>
+struct MessageLayout<LOAD> {
+  static constexpr size_t min_payload = 2 * sizeof(u32) + sizeof(u64);
+  static constexpr size_t max_payload = 2 * sizeof(u32) + sizeof(u64);
+};
+
+// Size of a whole message of a type with a fixed-size payload, e.g. for buffers on the stack.
+template <u16 Type>
+constexpr size_t fixed_message_size() {
+  static_assert(MessageLayout<Type>::min_payload == MessageLayout<Type>::max_payload,
+                "the message type has a variable size");
+  return HEADER_SIZE + MessageLayout<Type>::max_payload;
+}
+
+template <u16 Type>
+constexpr bool payload_fits(size_t len) {
+  return len >= MessageLayout<Type>::min_payload && len <= MessageLayout<Type>::max_payload;
+}
+
+// Checks a payload size against the layout of a type that is only known at run time. Returns false
+// for unknown types.
+constexpr bool payload_fits(u16 type, size_t len) {
+  switch (type) {
+    case DISCOVER:
+      return payload_fits<DISCOVER>(len);
+    case IAM:
+      return payload_fits<IAM>(len);
+    case KEEPALIVE:
+      return payload_fits<KEEPALIVE>(len);
+    case AUDIO:
+      return payload_fits<AUDIO>(len);
+    case METADATA:
+      return payload_fits<METADATA>(len);
+    case SEEK:
+      return payload_fits<SEEK>(len);
+    case BATCH:
+      return payload_fits<BATCH>(len);
+    case CAPS:
+      return payload_fits<CAPS>(len);
+    case SELECT:
+      return payload_fits<SELECT>(len);
+    case PROBE:
+      return payload_fits<PROBE>(len);
+    case LOAD:
+      return payload_fits<LOAD>(len);
+    default:
+      return false;
+  }
+}
+
+// A decoded message. Does not own the payload.
+struct MessageView {
+  u16 type;
+  const u8* payload;
+  size_t len;
+
+  string_view text() const { return string_view(reinterpret_cast<const char*>(payload), len); }
+};
+
+enum class DecodeStatus {
+  OK,
+  TRUNCATED,       // shorter than a header
+  BAD_LENGTH,      // the length in the header does not match the size of the datagram
+  UNKNOWN_TYPE,
+  BAD_PAYLOAD,     // the payload size does not fit the message type
+};
+
+inline const char* decode_status_str(DecodeStatus status) {
+  switch (status) {
+    case DecodeStatus::OK:
+      return "ok";
+    case DecodeStatus::TRUNCATED:
+      return "message shorter than its header";
+    case DecodeStatus::BAD_LENGTH:
+      return "invalid message length";
+    case DecodeStatus::UNKNOWN_TYPE:
+      return "unexpected message type";
+    case DecodeStatus::BAD_PAYLOAD:
+      return "invalid payload length for the message type";
+  }
+  return "unknown error";
+}
+
+// Decodes a datagram of `len` bytes. `view` is only set when the datagram is valid.
+inline DecodeStatus decode_message(const u8* buf, size_t len, MessageView& view) {
+  if (len < HEADER_SIZE) return DecodeStatus::TRUNCATED;
+  u16 type = load_be16(buf);
+  u16 payload_len = load_be16(buf + 2);
+  if (len != HEADER_SIZE + payload_len) return DecodeStatus::BAD_LENGTH;
+  switch (type) {
+    case DISCOVER:
+    case IAM:
+    case KEEPALIVE:
+    case AUDIO:
+    case METADATA:
+    case SEEK:
+    case BATCH:
+    case CAPS:
+    case SELECT:
+    case PROBE:
+    case LOAD:
+      break;
+    default:
+      return DecodeStatus::UNKNOWN_TYPE;
+  }
+  if (!payload_fits(type, payload_len)) return DecodeStatus::BAD_PAYLOAD;
+  view.type = type;
+  view.payload = buf + HEADER_SIZE;
+  view.len = payload_len;
+  return DecodeStatus::OK;
+}
+
+// Like decode_message, but throws if the datagram is invalid.
+inline MessageView decode_message_or_throw(const u8* buf, size_t len) {
+  MessageView view;
+  DecodeStatus status = decode_message(buf, len, view);
+  if (status != DecodeStatus::OK) throw runtime_error(decode_status_str(status));
+  return view;
+}
+
+// Writes the header of a message with `len` bytes of payload. The payload goes right after the
+// header. Returns the size of the whole message.
+template <u16 Type>
+inline size_t encode_header(u8* buf, size_t len) {
+  if (!payload_fits<Type>(len)) throw length_error("payload does not fit the message type");
+  store_be16(buf, Type);
+  store_be16(buf + 2, static_cast<u16>(len));
+  return HEADER_SIZE + len;
+}
+
+inline size_t encode_header(u8* buf, u16 type, size_t len) {
+  if (!payload_fits(type, len)) throw length_error("payload does not fit the message type");
+  store_be16(buf, type);
+  store_be16(buf + 2, static_cast<u16>(len));
+  return HEADER_SIZE + len;
+}
+
+inline u64 decode_seek(const MessageView& view) { return load_be64(view.payload); }
+
+inline size_t encode_seek(u8* buf, u64 timestamp) {
+  encode_header<SEEK>(buf, sizeof(u64));
+  store_be64(buf + HEADER_SIZE, timestamp);
+  return fixed_message_size<SEEK>();
+}
+
+// Capability flags sent by clients in CAPS messages. A client sends CAPS along with DISCOVER and
+// KEEPALIVE messages. A proxy that does not know CAPS rejects it as an unexpected message, but it
+// registered the client on the DISCOVER or KEEPALIVE before, so it keeps sending AUDIO and METADATA
+// messages, which the client plays as it did before BATCH. The client sends CAPS again with every
+// KEEPALIVE, so a proxy that is upgraded later switches the client to BATCH.
+constexpr u32 CAP_BATCH = 1;     // the client wants BATCH instead of AUDIO and METADATA messages
+constexpr u32 CAP_VARIANTS = 2;  // the client understands station variants, see VariantInfo
+
+inline size_t encode_caps(u8* buf, u32 flags) {
+  encode_header<CAPS>(buf, sizeof(u32));
+  store_be32(buf + HEADER_SIZE, flags);
+  return fixed_message_size<CAPS>();
+}
+
+inline u32 decode_caps(const MessageView& view) { return load_be32(view.payload); }
+
+// A station may be relayed at several bitrates, called variants. Every client starts with variant
+// 0 and may move to another one with SELECT. A proxy with variants answers CAPS with CAP_VARIANTS
+// by an IAM whose payload is the station name, a zero byte, a u8 number of variants and, for every
+// variant, its u8 id and u32 bitrate in bits per second. Other clients only get the plain name.
+struct VariantInfo {
+  u8 id;
+  u32 bitrate;  // 0 if unknown
+};
+
+constexpr size_t VARIANT_INFO_SIZE = 1 + sizeof(u32);
+constexpr size_t MAX_VARIANTS = 255;
+
+// Returns the IAM payload advertising `variants` of the station called `name`.
+inline string encode_iam_variants(const string& name, const vector<VariantInfo>& variants) {
+  if (variants.size() > MAX_VARIANTS) throw length_error("too many variants");
+  string payload = name;
+  payload += '\0';
+  payload += static_cast<char>(variants.size());
+  for (auto& variant : variants) {
+    u8 record[VARIANT_INFO_SIZE];
+    record[0] = variant.id;
+    store_be32(record + 1, variant.bitrate);
+    payload.append(reinterpret_cast<const char*>(record), VARIANT_INFO_SIZE);
+  }
+  if (payload.size() > MAX_PAYLOAD_SIZE)
+    throw length_error("payload does not fit the message type");
+  return payload;
+}
+
+// Splits an IAM payload into the station name and its variants, which are left empty for a plain
+// IAM. Returns false if the variant table is malformed.
+inline bool decode_iam(const MessageView& view, string_view& name, vector<VariantInfo>& variants) {
+  variants.clear();
+  string_view text = view.text();
+  size_t end = text.find('\0');
+  name = text.substr(0, end);
+  if (end == string_view::npos) return true;
+  const u8* table = view.payload + end + 1;
+  size_t table_len = view.len - end - 1;
+  if (table_len < 1 || table_len != 1 + table[0] * VARIANT_INFO_SIZE) return false;
+  for (size_t i = 0; i < table[0]; i++) {
+    const u8* record = table + 1 + i * VARIANT_INFO_SIZE;
+    variants.push_back({record[0], load_be32(record + 1)});
+  }
+  return true;
+}
+
+inline size_t encode_select(u8* buf, u32 variant) {
+  encode_header<SELECT>(buf, sizeof(u32));
+  store_be32(buf + HEADER_SIZE, variant);
+  return fixed_message_size<SELECT>();
+}
+
+inline u32 decode_select(const MessageView& view) { return load_be32(view.payload); }
+
+// A client sends PROBE with every DISCOVER and KEEPALIVE, and a proxy answers with LOAD: the token
+// of the probe, the u32 number of clients the proxy has and its u64 egress rate in bits per second.
+// Clients measure the round-trip time and loss to every proxy from the answers, to prefer the least
+// loaded and closest proxy of a station. A proxy that does not know PROBE rejects it as an
+// unexpected message and logs it, so the client never gets a LOAD from it. Such a proxy is still
+// listed and played, it is only never preferred over one that answers.
+struct ProxyLoad {
+  u32 token;
+  u32 clients;
+  u64 egress_rate;  // in bits per second
+};
+
+inline size_t encode_probe(u8* buf, u32 token) {
+  encode_header<PROBE>(buf, sizeof(u32));
+  store_be32(buf + HEADER_SIZE, token);
+  return fixed_message_size<PROBE>();
+}
+
+inline u32 decode_probe(const MessageView& view) { return load_be32(view.payload); }
+
+inline size_t encode_load(u8* buf, const ProxyLoad& load) {
+  encode_header<LOAD>(buf, MessageLayout<LOAD>::max_payload);
+  store_be32(buf + HEADER_SIZE, load.token);
+  store_be32(buf + HEADER_SIZE + 4, load.clients);
+  store_be64(buf + HEADER_SIZE + 8, load.egress_rate);
+  return fixed_message_size<LOAD>();
+}
+
+inline ProxyLoad decode_load(const MessageView& view) {
+  return {load_be32(view.payload), load_be32(view.payload + 4), load_be64(view.payload + 8)};
+}
+
+// BATCH payload: a u32 sequence number, which grows by one with every batch of the stream, followed
+// by records. A record is a u8 kind, a u16 length and that many bytes of data. Audio records are
+// consecutive slices of the stream. A metadata record carries metadata that changed. A station with
+// variants starts every batch with a variant record, the u8 id of the variant, and numbers the
+// batches of every variant separately.
+constexpr u8 BATCH_AUDIO = 1;
+constexpr u8 BATCH_METADATA = 2;
+constexpr u8 BATCH_VARIANT = 3;
+constexpr size_t BATCH_HEADER_SIZE = sizeof(u32);
+constexpr size_t BATCH_RECORD_HEADER_SIZE = 3;
+// The largest datagram that fits into a 1500-byte Ethernet MTU without IP fragmentation.
+constexpr size_t BATCH_DATAGRAM_SIZE = 1472;
+
+// Builds a BATCH message in a caller-provided buffer.
+class BatchWriter {
+  u8* buf;
+  size_t capacity;  // size of buf
+  size_t target;    // size the batch is filled up to, at most capacity
+  size_t len;
+
+ public:
+  BatchWriter(u8* buf, size_t capacity, size_t target = BATCH_DATAGRAM_SIZE)
+      : buf(buf), capacity(capacity), target(min(target, capacity)), len(0) {
+    if (capacity < HEADER_SIZE + BATCH_HEADER_SIZE) throw length_error("batch buffer too small");
+  }
+
+  void begin(u32 seq) {
+    store_be32(buf + HEADER_SIZE, seq);
+    len = HEADER_SIZE + BATCH_HEADER_SIZE;
+  }
+
+  bool empty() const { return len <= HEADER_SIZE + BATCH_HEADER_SIZE; }
+
+  // Number of data bytes that one more record can hold without going past the target size.
+  size_t space() const {
+    size_t used = len + BATCH_RECORD_HEADER_SIZE;
+    return used < target ? target - used : 0;
+  }
+
+  // Appends a record. It may go past the target size, e.g. for metadata longer than a datagram,
+  // but not past the capacity of the buffer.
+  void add(u8 kind, const u8* data, size_t data_len) {
+    if (data_len > 0xFFFF || len + BATCH_RECORD_HEADER_SIZE + data_len > capacity ||
+        len + BATCH_RECORD_HEADER_SIZE + data_len - HEADER_SIZE > MAX_PAYLOAD_SIZE)
+      throw length_error("record does not fit into the batch");
+    buf[len] = kind;
+    store_be16(buf + len + 1, static_cast<u16>(data_len));
+    if (data_len > 0) memcpy(buf + len + BATCH_RECORD_HEADER_SIZE, data, data_len);
+    len += BATCH_RECORD_HEADER_SIZE + data_len;
+  }
+
+  // Writes the message header. Returns the size of the whole message, which starts at buf.
+  size_t finish() { return encode_header<BATCH>(buf, len - HEADER_SIZE); }
+};
+
+// Iterates over the records of a decoded BATCH message without copying them.
+class BatchReader {
+  const u8* pos;
+  const u8* end;
+  bool malformed;
+
+ public:
+  u32 seq;
+
+  BatchReader(const MessageView& view)
+      : pos(view.payload + BATCH_HEADER_SIZE), end(view.payload + view.len), malformed(false) {
+    seq = load_be32(view.payload);
+  }
+
+  // Returns false after the last record or at a malformed record.
+  bool next(u8& kind, const u8*& data, size_t& len) {
+    if (pos == end) return false;
+    if (static_cast<size_t>(end - pos) < BATCH_RECORD_HEADER_SIZE) {
+      malformed = true;
+      return false;
+    }
+    size_t record_len = load_be16(pos + 1);
+    if (static_cast<size_t>(end - pos) - BATCH_RECORD_HEADER_SIZE < record_len) {
+      malformed = true;
+      return false;
+    }
+    kind = pos[0];
+    data = pos + BATCH_RECORD_HEADER_SIZE;
+    len = record_len;
+    pos += BATCH_RECORD_HEADER_SIZE + record_len;
+    return true;
+  }
+
+  // Whether the records read so far were well formed.
+  bool ok() const { return !malformed; }
+};
+
+#endif
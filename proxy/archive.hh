@@ -0,0 +1,393 @@
+#ifndef ARCHIVE_HH
+#define ARCHIVE_HH
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <vector>
+#include "../common/types.hh"
+
+using namespace std;
+
+// record types
+constexpr u32 ARCHIVE_AUDIO = 1;
+constexpr u32 ARCHIVE_METADATA = 2;
+
+constexpr u32 ARCHIVE_MAGIC = 0x52504152;  // "RPAR"
+constexpr u32 ARCHIVE_VERSION = 1;
+constexpr u64 ARCHIVE_DATA_OFFSET = 4096;  // records start after the segment header
+
+struct ArchiveSegmentHeader {
+  u32 magic;
+  u32 version;
+  u64 id;
+  i64 start_ts;  // time in milliseconds
+};
+
+// Records are stored back to back, each padded to 8 bytes. Segments are preallocated with zeros,
+// so a zero type marks the end of the written records.
+struct ArchiveRecordHeader {
+  u32 type;
+  u32 len;
+  i64 timestamp;  // time in milliseconds
+};
+
+// One entry per second of audio, stored in a separate .idx file next to the segment.
+struct ArchiveIndexEntry {
+  i64 timestamp;
+  u64 offset;
+};
+
+inline u64 archive_record_size(u32 len) { return (sizeof(ArchiveRecordHeader) + len + 7) / 8 * 8; }
+
+struct ArchiveSegment {
+  u64 id;
+  i64 start_ts;
+  string path;
+  int fd;
+  const u8* map;
+  u64 size;
+  atomic<u64> committed;  // records below this offset are on disk and safe to read
+  atomic<i64> end_ts;
+  atomic<bool> sealed;    // no more records will be appended
+  mutex index_lock;
+  vector<ArchiveIndexEntry> index;
+
+  ArchiveSegment(u64 id, i64 start_ts, const string& path, int fd, const u8* map, u64 size)
+      : id(id), start_ts(start_ts), path(path), fd(fd), map(map), size(size) {
+    committed = ARCHIVE_DATA_OFFSET;
+    end_ts = start_ts;
+    sealed = false;
+  }
+
+  ~ArchiveSegment() {
+    if (map != nullptr) munmap((void*)map, size);
+    if (fd >= 0) close(fd);
+  }
+};
+
+// Position of a time-shifted reader in the archive.
+struct ArchiveCursor {
+  u64 segment_id;
+  u64 offset;
+};
+
+// Keeps the last `retention` milliseconds of the stream in fixed-size segment files. There is a
+// single writer that appends in large sequential batches, and any number of readers that read
+// committed records through a read-only mapping of the segment. Segments that fall out of the
+// retention window are unlinked; readers that still use them keep their mapping alive.
+class Archive {
+  static const size_t flush_size = 256 * 1024;
+  static const i64 flush_interval = 1000;  // time in milliseconds
+  static const i64 index_interval = 1000;  // time in milliseconds
+
+  string dir;
+  u64 segment_size;
+  i64 retention;
+
+  mutex segments_lock;
+  deque<shared_ptr<ArchiveSegment>> segments;  // ordered by id, the last one is being written
+
+  // writer state, only touched by the writer
+  vector<u8> write_buf;
+  u64 write_offset;  // where write_buf starts in the current segment
+  i64 write_buf_ts;  // when the first record in write_buf was added
+  i64 write_last_ts;
+  i64 last_index_ts;
+  vector<ArchiveIndexEntry> pending_index;
+  int index_fd;
+
+  string segment_path(u64 id) {
+    char name[32];
+    snprintf(name, sizeof name, "segment-%010llu", (unsigned long long)id);
+    return dir + "/" + name;
+  }
+
+  static i64 now() {
+    return chrono::duration_cast<chrono::milliseconds>(
+               chrono::system_clock::now().time_since_epoch())
+        .count();
+  }
+
+  shared_ptr<ArchiveSegment> map_segment(u64 id, i64 start_ts, int fd) {
+    void* map = mmap(nullptr, segment_size, PROT_READ, MAP_SHARED, fd, 0);
+    if (map == MAP_FAILED) {
+      close(fd);
+      throw runtime_error("archive mmap failed");
+    }
+    return make_shared<ArchiveSegment>(id, start_ts, segment_path(id), fd, (const u8*)map,
+                                       segment_size);
+  }
+
+  // Loads a segment left by a previous run. Returns nullptr if the segment is unusable.
+  shared_ptr<ArchiveSegment> load_segment(u64 id) {
+    string path = segment_path(id) + ".seg";
+    int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return nullptr;
+    struct stat st;
+    ArchiveSegmentHeader header;
+    if (fstat(fd, &st) < 0 || static_cast<u64>(st.st_size) != segment_size ||
+        pread(fd, &header, sizeof header, 0) != sizeof header || header.magic != ARCHIVE_MAGIC ||
+        header.version != ARCHIVE_VERSION || header.id != id) {
+      close(fd);
+      return nullptr;
+    }
+    auto segment = map_segment(id, header.start_ts, fd);
+
+    int idx_fd = open((segment_path(id) + ".idx").c_str(), O_RDONLY | O_CLOEXEC);
+    if (idx_fd >= 0) {
+      ArchiveIndexEntry entry;
+      while (::read(idx_fd, &entry, sizeof entry) == sizeof entry) {
+        if (entry.offset < ARCHIVE_DATA_OFFSET || entry.offset >= segment_size) break;
+        segment->index.push_back(entry);
+      }
+      close(idx_fd);
+    }
+
+    // find the end of the written records, starting from the last indexed one
+    u64 offset = segment->index.empty() ? ARCHIVE_DATA_OFFSET : segment->index.back().offset;
+    i64 end_ts = segment->start_ts;
+    while (offset + sizeof(ArchiveRecordHeader) <= segment_size) {
+      auto record = (const ArchiveRecordHeader*)(segment->map + offset);
+      if (record->type == 0 || offset + archive_record_size(record->len) > segment_size) break;
+      end_ts = record->timestamp;
+      offset += archive_record_size(record->len);
+    }
+    segment->committed = offset;
+    segment->end_ts = end_ts;
+    segment->sealed = true;
+    return segment;
+  }
+
+  void load_segments() {
+    DIR* d = opendir(dir.c_str());
+    if (d == nullptr) throw runtime_error("failed to open archive directory " + dir);
+    vector<u64> ids;
+    while (dirent* entry = readdir(d)) {
+      unsigned long long id;
+      char suffix[8];
+      if (sscanf(entry->d_name, "segment-%10llu.%3s", &id, suffix) == 2 &&
+          strcmp(suffix, "seg") == 0) {
+        ids.push_back(id);
+      }
+    }
+    closedir(d);
+    sort(ids.begin(), ids.end());
+    for (auto id : ids) {
+      auto segment = load_segment(id);
+      if (segment != nullptr) {
+        segments.push_back(segment);
+      } else {
+        unlink((segment_path(id) + ".seg").c_str());
+        unlink((segment_path(id) + ".idx").c_str());
+      }
+    }
+  }
+
+  void start_segment(i64 start_ts) {
+    u64 id = segments.empty() ? 1 : segments.back()->id + 1;
+    string path = segment_path(id);
+    int fd = open((path + ".seg").c_str(), O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0) throw runtime_error("failed to create archive segment " + path);
+    if (posix_fallocate(fd, 0, segment_size) != 0) {
+      close(fd);
+      throw runtime_error("failed to preallocate archive segment " + path);
+    }
+    ArchiveSegmentHeader header = {ARCHIVE_MAGIC, ARCHIVE_VERSION, id, start_ts};
+    if (pwrite(fd, &header, sizeof header, 0) != sizeof header) {
+      close(fd);
+      throw runtime_error("failed to write archive segment header");
+    }
+
+    if (index_fd >= 0) close(index_fd);
+    index_fd = open((path + ".idx").c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (index_fd < 0) throw runtime_error("failed to create archive index " + path);
+
+    auto segment = map_segment(id, start_ts, fd);
+    lock_guard<mutex> lock_g(segments_lock);
+    if (!segments.empty()) segments.back()->sealed = true;
+    segments.push_back(segment);
+    write_offset = ARCHIVE_DATA_OFFSET;
+    last_index_ts = 0;
+  }
+
+  void drop_expired_segments(i64 current_time) {
+    lock_guard<mutex> lock_g(segments_lock);
+    while (segments.size() > 1 && current_time - segments.front()->end_ts > retention) {
+      unlink((segments.front()->path + ".seg").c_str());
+      unlink((segments.front()->path + ".idx").c_str());
+      segments.pop_front();
+    }
+  }
+
+  // Returns the segment `id`, or if it expired or failed to load, the first one after it. Returns
+  // nullptr if there is none. Ids have gaps where load_segments dropped a segment.
+  shared_ptr<ArchiveSegment> find_segment(u64 id) {
+    lock_guard<mutex> lock_g(segments_lock);
+    auto it = lower_bound(segments.begin(), segments.end(), id,
+                          [](const shared_ptr<ArchiveSegment>& s, u64 id) { return s->id < id; });
+    return it != segments.end() ? *it : nullptr;
+  }
+
+ public:
+  Archive(const string& dir, u32 retention_hours, u64 segment_size = 64 * 1024 * 1024)
+      : dir(dir), segment_size(segment_size), retention((i64)retention_hours * 3600 * 1000) {
+    write_offset = ARCHIVE_DATA_OFFSET;
+    write_buf_ts = 0;
+    write_last_ts = 0;
+    last_index_ts = 0;
+    index_fd = -1;
+    write_buf.reserve(flush_size * 2);
+  }
+
+  ~Archive() {
+    try {
+      close_writer();
+    } catch (...) {
+      // ignore errors since this is a destructor
+    }
+  }
+
+  // Loads the segments left by a previous run and starts a new segment for writing.
+  void open_writer() {
+    mkdir(dir.c_str(), 0755);
+    load_segments();
+    drop_expired_segments(now());
+    start_segment(now());
+  }
+
+  void close_writer() {
+    if (index_fd < 0) return;
+    flush();
+    close(index_fd);
+    index_fd = -1;
+    lock_guard<mutex> lock_g(segments_lock);
+    if (!segments.empty()) segments.back()->sealed = true;
+  }
+
+  // Buffers a record. Records are written to disk in batches by flush().
+  void append(u32 type, const u8* data, u32 len, i64 timestamp) {
+    u64 record_size = archive_record_size(len);
+    if (record_size > segment_size - ARCHIVE_DATA_OFFSET) throw runtime_error("record too large");
+    if (write_offset + write_buf.size() + record_size > segment_size) {
+      flush();
+      start_segment(timestamp);
+      drop_expired_segments(timestamp);
+    }
+
+    u64 offset = write_offset + write_buf.size();
+    if (type == ARCHIVE_AUDIO && timestamp - last_index_ts >= index_interval) {
+      pending_index.push_back({timestamp, offset});
+      last_index_ts = timestamp;
+    }
+    if (write_buf.empty()) write_buf_ts = timestamp;
+    write_last_ts = timestamp;
+
+    ArchiveRecordHeader header = {type, len, timestamp};
+    size_t start = write_buf.size();
+    write_buf.resize(start + record_size, 0);
+    memcpy(&write_buf[start], &header, sizeof header);
+    memcpy(&write_buf[start + sizeof header], data, len);
+
+    if (write_buf.size() >= flush_size || timestamp - write_buf_ts >= flush_interval) flush();
+  }
+
+  // Writes the buffered records and publishes them to readers.
+  void flush() {
+    if (write_buf.empty()) return;
+    auto segment = segments.back();
+    size_t written = 0;
+    while (written < write_buf.size()) {
+      ssize_t res = pwrite(segment->fd, write_buf.data() + written, write_buf.size() - written,
+                           write_offset + written);
+      if (res <= 0) throw runtime_error("archive write failed");
+      written += res;
+    }
+    if (!pending_index.empty()) {
+      size_t index_bytes = pending_index.size() * sizeof(ArchiveIndexEntry);
+      if (write(index_fd, pending_index.data(), index_bytes) != (ssize_t)index_bytes)
+        throw runtime_error("archive index write failed");
+      lock_guard<mutex> lock_g(segment->index_lock);
+      segment->index.insert(segment->index.end(), pending_index.begin(), pending_index.end());
+    }
+    pending_index.clear();
+
+    write_offset += write_buf.size();
+    write_buf.clear();
+    segment->end_ts = write_last_ts;
+    segment->committed.store(write_offset, memory_order_release);
+  }
+
+  // Positions `cursor` at the first record at or after `timestamp`. Returns false if there is
+  // nothing to replay from that moment, i.e. the reader should get the live stream.
+  bool seek(i64 timestamp, ArchiveCursor& cursor) {
+    shared_ptr<ArchiveSegment> segment;
+    {
+      lock_guard<mutex> lock_g(segments_lock);
+      if (segments.empty()) return false;
+      segment = segments.front();
+      for (auto& s : segments) {
+        if (s->start_ts > timestamp) break;
+        segment = s;
+      }
+    }
+
+    u64 offset = ARCHIVE_DATA_OFFSET;
+    {
+      lock_guard<mutex> lock_g(segment->index_lock);
+      auto& index = segment->index;
+      auto it = upper_bound(index.begin(), index.end(), timestamp,
+                            [](i64 ts, const ArchiveIndexEntry& e) { return ts < e.timestamp; });
+      if (it != index.begin()) offset = prev(it)->offset;
+    }
+
+    u64 committed = segment->committed.load(memory_order_acquire);
+    while (offset < committed) {
+      auto record = (const ArchiveRecordHeader*)(segment->map + offset);
+      if (record->timestamp >= timestamp) break;
+      offset += archive_record_size(record->len);
+    }
+    cursor = {segment->id, offset};
+    return offset < committed || segment->sealed;
+  }
+
+  // Passes records starting at `cursor` to `f(type, data, len)` until at least `audio_bytes` bytes
+  // of audio were passed. Returns false once the cursor reached the end of the archive.
+  template <typename F>
+  bool read(ArchiveCursor& cursor, size_t audio_bytes, F f) {
+    size_t audio_read = 0;
+    while (audio_read < audio_bytes) {
+      auto segment = find_segment(cursor.segment_id);
+      if (segment == nullptr) return false;
+      // the segment expired or is missing, continue with the next one there is
+      if (segment->id != cursor.segment_id) cursor = {segment->id, ARCHIVE_DATA_OFFSET};
+      bool sealed = segment->sealed.load(memory_order_acquire);
+      u64 committed = segment->committed.load(memory_order_acquire);
+      while (cursor.offset < committed && audio_read < audio_bytes) {
+        auto record = (const ArchiveRecordHeader*)(segment->map + cursor.offset);
+        f(record->type, segment->map + cursor.offset + sizeof(ArchiveRecordHeader), record->len);
+        if (record->type == ARCHIVE_AUDIO) audio_read += record->len;
+        cursor.offset += archive_record_size(record->len);
+      }
+      if (cursor.offset >= committed) {
+        if (!sealed) return false;
+        cursor = {cursor.segment_id + 1, ARCHIVE_DATA_OFFSET};
+      }
+    }
+    return true;
+  }
+};
+
+#endif
@@ -11,29 +11,33 @@
 #include <chrono>
 #include <cstring>
 #include <iostream>
+#include <memory>
 #include <mutex>
 #include <stdexcept>
 #include <string>
 #include <thread>
 #include <unordered_map>
+#include <vector>
+#include "../common/log.hh"
+#include "../common/types.hh"
+#include "../common/wire.hh"
+#include "archive.hh"
+#include "chunk.hh"
 #include "icy.hh"
-#include "types.hh"
+#include "packetizer.hh"
 
 using namespace std;
 
-// UDP message types
-constexpr u16 DISCOVER = 1;
-constexpr u16 IAM = 2;
-constexpr u16 KEEPALIVE = 3;
-constexpr u16 AUDIO = 4;
-constexpr u16 METADATA = 6;
-constexpr size_t HEADER_SIZE = 4;
-
 class Broadcaster {
  public:
   virtual void init(){};
   virtual void clean_up(){};
   virtual void broadcast(const ICYPart& part, const u8* data) = 0;
+  // Broadcasters that keep chunks around can override this to share the chunk instead of copying.
+  virtual void broadcast_chunk(const shared_ptr<const Chunk>& chunk) {
+    broadcast(chunk->part, chunk->data.data());
+  }
+  virtual ~Broadcaster() {}
 };
 
 class StdoutBroadcaster : public Broadcaster {
@@ -48,13 +52,96 @@ class StdoutBroadcaster : public Broadcaster {
   }
 };
 
+// Writes the stream to an Archive. Meant to run as a fanout sink, so disk writes happen on the
+// sink's thread and never delay the upstream or other sinks.
+class ArchiveBroadcaster : public Broadcaster {
+  shared_ptr<Archive> archive;
+
+ public:
+  ArchiveBroadcaster(shared_ptr<Archive> archive) : archive(archive) {}
+
+  void init() override { archive->open_writer(); }
+
+  void clean_up() override { archive->close_writer(); }
+
+  virtual void broadcast(const ICYPart& part, const u8* data) override {
+    broadcast_chunk(make_chunk(part, data));
+  }
+
+  virtual void broadcast_chunk(const shared_ptr<const Chunk>& chunk) override {
+    archive->append(ARCHIVE_AUDIO, chunk->data.data(), chunk->data.size(), chunk->timestamp);
+    if (chunk->part.meta_present && chunk->part.meta.size() > 0) {
+      archive->append(ARCHIVE_METADATA, (const u8*)chunk->part.meta.c_str(),
+                      chunk->part.meta.length(), chunk->timestamp);
+    }
+  }
+};
+
 struct ClientInfo {
   i64 last_contact;  // time in milliseconds
   sockaddr_in addr;
-  ClientInfo(i64 last_contact, const sockaddr_in& addr) : last_contact(last_contact), addr(addr){};
+  bool timeshifted;  // whether the client is served from the archive instead of live
+  ArchiveCursor cursor;
+  bool batched;         // whether the client negotiated BATCH messages
+  u64 first_live_part;  // number of the first part of its variant the client was sent live
+  u8 variant;           // station variant the client listens to
+  ClientInfo(i64 last_contact, const sockaddr_in& addr, u64 first_live_part)
+      : last_contact(last_contact),
+        addr(addr),
+        timeshifted(false),
+        cursor({0, 0}),
+        batched(false),
+        first_live_part(first_live_part),
+        variant(0){};
+};
+
+// One upstream of the station and what is being sent of it. Variant 0 is the stream the proxy was
+// started with, the others are the same station at other bitrates, see set_variants.
+struct StationVariant {
+  u32 bitrate;  // in bits per second as announced by the upstream, 0 if unknown
+  string last_meta;
+  u64 parts_broadcast;
+
+  // Set if AUDIO messages and batch records are aligned to codec frames, see set_frame_aligned.
+  unique_ptr<FramePacketizer> packetizer;
+  PacketizerStats reported_stats;
+
+  // Live audio and metadata for clients that negotiated BATCH messages are collected here and sent
+  // when the batch is full or its oldest data is batch_max_delay old.
+  unique_ptr<u8[]> batch_buf;
+  BatchWriter batch;
+  u32 batch_seq;
+  i64 batch_started;
+
+  StationVariant(u32 bitrate, size_t batch_buf_size)
+      : bitrate(bitrate),
+        last_meta(""),
+        parts_broadcast(0),
+        batch_buf(new u8[batch_buf_size]),
+        batch(batch_buf.get(), batch_buf_size),
+        batch_seq(0),
+        batch_started(0) {
+    batch.begin(batch_seq);
+  }
+};
+
+struct UDPVariantState {
+  string last_meta;
+  u64 parts_broadcast;
+  u32 batch_seq;
+  vector<u8> packetizer_pending;  // start of a frame not sent yet, see FramePacketizer
+};
+
+// What a new process needs to go on serving the clients of a UDPBroadcaster, see suspend.
+struct UDPState {
+  conn_t sock = -1;
+  vector<ClientInfo> clients;
+  vector<UDPVariantState> variants;
 };
 
 class UDPBroadcaster : public Broadcaster {
+  friend class ProxyBench;
+
   u16 port;
   string multiaddr;
   string radio_info;
@@ -77,7 +164,17 @@ class UDPBroadcaster : public Broadcaster {
   atomic<bool> udp_server_crashed;
   exception_ptr udp_server_exception;
 
-  string last_meta;
+  shared_ptr<Archive> archive;
+
+  static const i64 batch_max_delay = 100;  // time in milliseconds
+  vector<unique_ptr<StationVariant>> variants;
+  bool frame_aligned;
+
+  // Egress is measured over windows of egress_window and advertised in LOAD messages.
+  static const i64 egress_window = 1000;  // time in milliseconds
+  u64 egress_bytes;                       // sent in the current window
+  i64 egress_window_start;
+  u64 egress_rate;  // in bits per second, over the last window
 
   // Tries to read a message from sock into msg_buf. Saves the address of the sender in msg_sender.
   // Returns true if a message was read, false otherwise.
@@ -98,8 +195,7 @@ class UDPBroadcaster : public Broadcaster {
   pair<shared_ptr<u8[]>, size_t> prepare_msg(u16 msg_type, const u8* data, size_t len) {
     size_t msg_len = HEADER_SIZE + len;
     shared_ptr<u8[]> msg(new u8[msg_len]);
-    ((u16*)msg.get())[0] = htons(msg_type);
-    ((u16*)msg.get())[1] = htons(static_cast<u16>(len));
+    encode_header(msg.get(), msg_type, len);
     memcpy(msg.get() + HEADER_SIZE, data, len);
     return {msg, msg_len};
   }
@@ -113,6 +209,16 @@ class UDPBroadcaster : public Broadcaster {
       if (sent_partial <= 0) throw runtime_error("sendto failed");
       sent += static_cast<size_t>(sent_partial);
     }
+    egress_bytes += len;
+  }
+
+  void update_egress_rate() {
+    i64 current_time = now();
+    i64 elapsed = current_time - egress_window_start;
+    if (elapsed < egress_window) return;
+    egress_rate = egress_bytes * 8000 / elapsed;
+    egress_bytes = 0;
+    egress_window_start = current_time;
   }
 
   u64 hash_sockaddr_in(const sockaddr_in& addr) {
@@ -128,29 +234,88 @@ class UDPBroadcaster : public Broadcaster {
         .count();
   }
 
+  // The bitrate to advertise for a variant: the one its upstream announced, or else the one the
+  // packetizer measured.
+  u32 advertised_bitrate(const StationVariant& variant) {
+    if (variant.bitrate != 0 || variant.packetizer == nullptr) return variant.bitrate;
+    return variant.packetizer->get_stats().bitrate;
+  }
+
+  string variants_iam() {
+    vector<VariantInfo> infos;
+    for (size_t id = 0; id < variants.size(); id++)
+      infos.push_back({static_cast<u8>(id), advertised_bitrate(*variants[id])});
+    return encode_iam_variants(radio_info, infos);
+  }
+
   // Processes a message that is in msg_buf.
   void process_msg() {
-    if (msg_len != HEADER_SIZE) throw runtime_error("invalid message");
-    u16 msg_type = ntohs(((u16*)(&msg_buf))[0]);
-    u16 msg_content_len = ntohs(((u16*)(&msg_buf))[1]);
-    if (msg_content_len != 0) throw runtime_error("invalid message length");
+    MessageView msg = decode_message_or_throw(msg_buf, msg_len);
+    // only clients are registered, not other proxies or stray senders
+    if (msg.type != DISCOVER && msg.type != KEEPALIVE && msg.type != CAPS && msg.type != SELECT &&
+        msg.type != PROBE && msg.type != SEEK)
+      throw runtime_error("unexpected message type: " + to_string(msg.type));
+
+    u64 client_id = hash_sockaddr_in(msg_sender);
+    auto it = clients.find(client_id);
+    if (it != clients.end()) {
+      it->second->last_contact = now();
+    } else {
+      it = clients
+               .emplace(client_id,
+                        make_shared<ClientInfo>(now(), msg_sender, variants[0]->parts_broadcast))
+               .first;
+    }
 
-    if (msg_type == DISCOVER) {
+    if (msg.type == DISCOVER) {
       // Send back an IAM message
       auto [response, response_len] =
           prepare_msg(IAM, (u8*)radio_info.c_str(), radio_info.length());
       send_msg((sockaddr*)&msg_sender, response.get(), response_len);
       // Send a METADATA message
+      const string& last_meta = variants[it->second->variant]->last_meta;
       auto [meta_msg, meta_msg_len] =
           prepare_msg(METADATA, (u8*)last_meta.c_str(), last_meta.length());
       send_msg((sockaddr*)&msg_sender, meta_msg.get(), meta_msg_len);
-    } else if (msg_type == KEEPALIVE) {
+    } else if (msg.type == KEEPALIVE) {
       // do nothing
-    } else {
-      throw runtime_error("unexpected message type: " + to_string(msg_type));
+    } else if (msg.type == CAPS) {
+      auto client = it->second;
+      u32 caps = decode_caps(msg);
+      bool batched = (caps & CAP_BATCH) != 0;
+      // if the pending batch has parts that the client already got in AUDIO messages, it is sent
+      // before the client joins, so the client does not get them twice
+      StationVariant& variant = *variants[client->variant];
+      if (batched && !client->batched && client->first_live_part < variant.parts_broadcast &&
+          !variant.batch.empty())
+        flush_batch(client->variant);
+      client->batched = batched;
+      if ((caps & CAP_VARIANTS) != 0 && variants.size() > 1) {
+        string iam = variants_iam();
+        auto [response, response_len] = prepare_msg(IAM, (u8*)iam.c_str(), iam.length());
+        send_msg((sockaddr*)&msg_sender, response.get(), response_len);
+      }
+    } else if (msg.type == SELECT) {
+      u32 id = decode_select(msg);
+      if (id >= variants.size()) throw runtime_error("unknown variant: " + to_string(id));
+      auto client = it->second;
+      if (client->variant != id) {
+        // the client gets the pending batch of the old variant before it leaves, so that its
+        // stream goes on without a gap in the new variant's next batch
+        if (client->batched) flush_batch(client->variant);
+        client->variant = static_cast<u8>(id);
+        client->first_live_part = variants[id]->parts_broadcast;
+      }
+    } else if (msg.type == PROBE) {
+      u8 response[fixed_message_size<LOAD>()];
+      encode_load(response, {decode_probe(msg), static_cast<u32>(clients.size()), egress_rate});
+      send_msg((sockaddr*)&msg_sender, response, sizeof response);
+    } else if (msg.type == SEEK) {
+      u64 timestamp = decode_seek(msg);
+      auto client = it->second;
+      client->timeshifted =
+          timestamp != 0 && archive != nullptr && archive->seek(timestamp, client->cursor);
     }
-
-    clients[hash_sockaddr_in(msg_sender)] = make_shared<ClientInfo>(now(), msg_sender);
   }
 
   void remove_inactive_clients() {
@@ -166,6 +331,14 @@ class UDPBroadcaster : public Broadcaster {
     }
   }
 
+  void flush_expired_batches() {
+    for (size_t id = 0; id < variants.size(); id++) {
+      StationVariant& variant = *variants[id];
+      if (!variant.batch.empty() && now() - variant.batch_started >= batch_max_delay)
+        flush_batch(id);
+    }
+  }
+
   void start_udp_server() {
     try {
       while (udp_server_enabled) {
@@ -174,9 +347,10 @@ class UDPBroadcaster : public Broadcaster {
           lock_guard<mutex> lock_g(lock);
           if (msg_received) process_msg();
           remove_inactive_clients();
+          flush_expired_batches();
+          update_egress_rate();
         } catch (exception& e) {
-          cerr << "Could not process an incoming message. Skipping it. Reason:" << endl;
-          cerr << e.what() << endl;
+          LOG_WARN("Could not process an incoming message, skipping it: %s", e.what());
         }
       }
     } catch (...) {
@@ -187,8 +361,38 @@ class UDPBroadcaster : public Broadcaster {
     }
   }
 
-  void send_to_clients(u16 msg_type, const u8* data, size_t size) {
+  // Sends a message to a single client, split into datagrams like in send_to_clients.
+  void send_to_client(const ClientInfo& client, u16 msg_type, const u8* data, size_t size) {
     size_t chunk_size = 1024;
+    size_t offset = 0;
+    do {
+      size_t current_chunk_size = min(chunk_size, size - offset);
+      auto [msg, msg_len] = prepare_msg(msg_type, data + offset, current_chunk_size);
+      send_msg((sockaddr*)(&client.addr), msg.get(), msg_len);
+      offset += current_chunk_size;
+    } while (offset < size);
+  }
+
+  // Sends time-shifted clients as much archived audio as there is in the live part, so that they
+  // are paced at the live bitrate. Clients that catch up with the archive go back to live.
+  void send_to_timeshifted_clients(size_t size) {
+    for (auto& pair : clients) {
+      auto& client = *pair.second;
+      if (!client.timeshifted) continue;
+      bool more = archive->read(client.cursor, size, [&](u32 type, const u8* data, u32 len) {
+        if (type == ARCHIVE_AUDIO) {
+          send_to_client(client, AUDIO, data, len);
+        } else if (type == ARCHIVE_METADATA) {
+          send_to_client(client, METADATA, data, len);
+        }
+      });
+      if (!more) client.timeshifted = false;
+    }
+  }
+
+  // Sends a message to the live clients of a variant that did not negotiate batches.
+  void send_to_clients(size_t variant, u16 msg_type, const u8* data, size_t size,
+                       size_t chunk_size = 1024) {
     size_t remaining_size = size;
     size_t current_chunk_size;
     size_t offset;
@@ -201,27 +405,216 @@ class UDPBroadcaster : public Broadcaster {
 
       auto [msg, msg_len] = prepare_msg(msg_type, data + offset, current_chunk_size);
 
-      for (auto it : clients) {
-        send_msg((sockaddr*)(&it.second->addr), msg.get(), msg_len);
+      for (auto& it : clients) {
+        auto& client = *it.second;
+        if (client.timeshifted || client.batched || client.variant != variant) continue;
+        send_msg((sockaddr*)(&client.addr), msg.get(), msg_len);
       }
     } while (remaining_size > 0);
   }
 
+  bool has_batched_clients(size_t variant) {
+    for (auto& it : clients) {
+      auto& client = *it.second;
+      if (client.batched && !client.timeshifted && client.variant == variant) return true;
+    }
+    return false;
+  }
+
+  void flush_batch(size_t id) {
+    StationVariant& variant = *variants[id];
+    if (variant.batch.empty()) return;
+    size_t len = variant.batch.finish();
+    for (auto& it : clients) {
+      auto& client = *it.second;
+      if (!client.batched || client.timeshifted || client.variant != id) continue;
+      send_msg((sockaddr*)(&client.addr), variant.batch_buf.get(), len);
+    }
+    variant.batch.begin(++variant.batch_seq);
+  }
+
+  // Called before the first record of a batch. With several variants, every batch says which
+  // variant it belongs to, so that a client can tell when its switch to another one took effect.
+  void start_batch(size_t id) {
+    StationVariant& variant = *variants[id];
+    variant.batch_started = now();
+    if (variants.size() > 1) {
+      u8 tag = static_cast<u8>(id);
+      variant.batch.add(BATCH_VARIANT, &tag, 1);
+    }
+  }
+
+  // Adds audio to the batch, sending full batches on the way.
+  void batch_audio(size_t id, const u8* data, size_t size) {
+    BatchWriter& batch = variants[id]->batch;
+    while (size > 0) {
+      if (batch.space() == 0) flush_batch(id);
+      if (batch.empty()) start_batch(id);
+      size_t len = min(size, batch.space());
+      batch.add(BATCH_AUDIO, data, len);
+      data += len;
+      size -= len;
+    }
+  }
+
+  // Adds a record that must not be split, like metadata or a packet of whole frames. A record
+  // longer than a batch gets a batch of its own, even if it is bigger than BATCH_DATAGRAM_SIZE.
+  void batch_whole(size_t id, u8 kind, const u8* data, size_t size) {
+    BatchWriter& batch = variants[id]->batch;
+    if (batch.space() < size) flush_batch(id);
+    if (batch.empty()) start_batch(id);
+    batch.add(kind, data, size);
+  }
+
+  void send_audio(size_t id, const u8* data, size_t size, bool batching) {
+    StationVariant& variant = *variants[id];
+    if (variant.packetizer == nullptr) {
+      send_to_clients(id, AUDIO, data, size);
+      if (batching) batch_audio(id, data, size);
+      return;
+    }
+    variant.packetizer->push(data, size, [&](const u8* packet, size_t len) {
+      // a packet goes out in one datagram, even if a single frame makes it longer than 1024 bytes
+      send_to_clients(id, AUDIO, packet, len, len);
+      if (batching) batch_whole(id, BATCH_AUDIO, packet, len);
+    });
+    report_stream_format(id);
+  }
+
+  void report_stream_format(size_t id) {
+    StationVariant& variant = *variants[id];
+    PacketizerStats stats = variant.packetizer->get_stats();
+    if (stats.format == variant.reported_stats.format &&
+        stats.sample_rate == variant.reported_stats.sample_rate)
+      return;
+    cerr << "UDP: detected " << frame_format_str(stats.format) << " at " << stats.sample_rate
+         << " Hz, " << stats.bitrate / 1000 << " kbit/s";
+    if (variants.size() > 1) cerr << " in variant " << id;
+    cerr << endl;
+    variant.reported_stats = stats;
+  }
+
  public:
   // setting `multiaddr` to an empty string disables multicasting
   UDPBroadcaster(u16 port, const string& multiaddr, const string& radio_info, u32 timeout)
       : port(port), multiaddr(multiaddr), radio_info(radio_info), timeout(timeout) {
     sock = -1;
+    frame_aligned = false;
+    egress_bytes = 0;
+    egress_window_start = now();
+    egress_rate = 0;
+    variants.push_back(make_unique<StationVariant>(0, msg_buf_size));
     multicast_initialized = false;
     udp_server_enabled = false;
     udp_server_crashed = false;
-    last_meta = "";
 
     // 64000 is an arbitrary number that fits into a UDP datagram
     if (radio_info.length() > 64000) throw runtime_error("radio_info is too long");
   }
 
+  // Lets clients request time-shifted playback from `archive` with SEEK messages.
+  void set_archive(shared_ptr<Archive> archive) { this->archive = archive; }
+
+  // Makes datagrams start and end at MP3 or AAC frame boundaries, so that a lost datagram only
+  // loses whole frames. Streams in other formats are sent as they are.
+  void set_frame_aligned(bool frame_aligned) {
+    this->frame_aligned = frame_aligned;
+    for (auto& variant : variants)
+      variant->packetizer = frame_aligned ? make_unique<FramePacketizer>(1024) : nullptr;
+  }
+
+  // Declares the variants of the station by their bitrates in bits per second, variant 0 being the
+  // stream passed to broadcast. Parts of the other variants are passed to broadcast_variant.
+  // Variants are always frame aligned, so that clients can switch between them at frame
+  // boundaries. Must be called before init.
+  void set_variants(const vector<u32>& bitrates) {
+    if (bitrates.empty() || bitrates.size() > MAX_VARIANTS)
+      throw runtime_error("invalid number of variants");
+    variants[0]->bitrate = bitrates[0];
+    for (size_t id = 1; id < bitrates.size(); id++)
+      variants.push_back(make_unique<StationVariant>(bitrates[id], msg_buf_size));
+    set_frame_aligned(frame_aligned || variants.size() > 1);
+  }
+
+  size_t num_variants() { return variants.size(); }
+
+  // Returns what the packetizer of a variant learned about the stream, or empty stats if frame
+  // alignment is not enabled.
+  PacketizerStats get_packetizer_stats(size_t id = 0) {
+    lock_guard<mutex> lock_g(lock);
+    auto& packetizer = variants.at(id)->packetizer;
+    return packetizer != nullptr ? packetizer->get_stats() : PacketizerStats();
+  }
+
+  // Stops serving clients and returns the socket and the client table, so that another process can
+  // take over, see adopt. Pending batches are sent first. Audio must not be broadcast until resume
+  // is called, or release if the other process took over.
+  UDPState suspend() {
+    udp_server_enabled = false;
+    if (udp_server.joinable()) udp_server.join();
+    lock_guard<mutex> lock_g(lock);
+    if (udp_server_crashed) rethrow_exception(udp_server_exception);
+    UDPState state;
+    state.sock = sock;
+    for (auto& it : clients) state.clients.push_back(*it.second);
+    for (size_t id = 0; id < variants.size(); id++) {
+      flush_batch(id);
+      StationVariant& variant = *variants[id];
+      vector<u8> pending;
+      if (variant.packetizer != nullptr) pending = variant.packetizer->get_pending();
+      state.variants.push_back(
+          {variant.last_meta, variant.parts_broadcast, variant.batch_seq, pending});
+    }
+    return state;
+  }
+
+  // Serves clients again after suspend, if the other process did not take over.
+  void resume() {
+    udp_server_enabled = true;
+    udp_server = thread([this] { start_udp_server(); });
+  }
+
+  // Gives up the socket after another process took it over. The socket stays open in that process,
+  // so it keeps the multicast membership.
+  void release() { multicast_initialized = false; }
+
+  // Takes over the socket and clients of a UDPBroadcaster in another process. Must be called after
+  // set_variants and before init.
+  void adopt(const UDPState& state) {
+    sockaddr_in bound;
+    socklen_t bound_len = sizeof bound;
+    if (getsockname(state.sock, (sockaddr*)&bound, &bound_len) < 0)
+      throw runtime_error("getsockname failed");
+    if (ntohs(bound.sin_port) != port)
+      throw runtime_error("the running proxy uses UDP port " + to_string(ntohs(bound.sin_port)));
+    if (state.variants.size() != variants.size())
+      throw runtime_error("the running proxy relays " + to_string(state.variants.size()) +
+                          " variants");
+    sock = state.sock;
+    multicast_initialized = multiaddr != "";
+    for (size_t id = 0; id < variants.size(); id++) {
+      StationVariant& variant = *variants[id];
+      const UDPVariantState& saved = state.variants[id];
+      variant.last_meta = saved.last_meta;
+      variant.parts_broadcast = saved.parts_broadcast;
+      variant.batch_seq = saved.batch_seq;
+      variant.batch.begin(variant.batch_seq);
+      if (variant.packetizer != nullptr)
+        variant.packetizer->restore_pending(saved.packetizer_pending);
+    }
+    for (auto& client : state.clients) {
+      if (client.variant >= variants.size()) continue;
+      clients.emplace(hash_sockaddr_in(client.addr), make_shared<ClientInfo>(client));
+    }
+  }
+
+  // Binds the socket, unless it was taken over from another process, and starts serving clients.
   void init() override {
+    if (sock >= 0) {
+      resume();
+      return;
+    }
+
     struct timeval read_timeout;
     read_timeout.tv_sec = 0;
     read_timeout.tv_usec = (suseconds_t)100000;  // 100 ms
@@ -254,7 +647,20 @@ class UDPBroadcaster : public Broadcaster {
 
   void clean_up() override {
     udp_server_enabled = false;
-    udp_server.join();
+    if (udp_server.joinable()) udp_server.join();
+    if (sock < 0) return;
+
+    for (size_t id = 0; id < variants.size(); id++) {
+      auto& packetizer = variants[id]->packetizer;
+      if (packetizer == nullptr) continue;
+      PacketizerStats stats = packetizer->get_stats();
+      cerr << "UDP packetizer";
+      if (variants.size() > 1) cerr << " of variant " << id;
+      cerr << ": " << frame_format_str(stats.format) << ", " << stats.sample_rate << " Hz, "
+           << stats.bitrate / 1000 << " kbit/s, " << stats.frame_duration << " ms frames; "
+           << stats.frames << " frames in " << stats.packets << " packets, " << stats.resyncs
+           << " resyncs, " << stats.unframed_bytes << " unframed bytes" << endl;
+    }
 
     if (multicast_initialized &&
         setsockopt(sock, IPPROTO_IP, IP_DROP_MEMBERSHIP, (void*)&ip_mreq, sizeof ip_mreq) < 0) {
@@ -275,12 +681,24 @@ class UDPBroadcaster : public Broadcaster {
   }
 
   virtual void broadcast(const ICYPart& part, const u8* data) override {
+    broadcast_variant(0, part, data);
+  }
+
+  // Sends a part read from the upstream of a variant to the clients of that variant.
+  void broadcast_variant(size_t id, const ICYPart& part, const u8* data) {
     lock_guard<mutex> lock_g(lock);
-    send_to_clients(AUDIO, data, part.size);
+    StationVariant& variant = *variants.at(id);
+    bool batching = has_batched_clients(id);
+    send_audio(id, data, part.size, batching);
+    if (id == 0 && archive != nullptr) send_to_timeshifted_clients(part.size);
     if (part.meta_present && part.meta.size() > 0) {
-      send_to_clients(METADATA, (u8*)(part.meta.c_str()), part.meta.length());
-      last_meta = part.meta;
+      send_to_clients(id, METADATA, (u8*)(part.meta.c_str()), part.meta.length());
+      if (batching && part.meta != variant.last_meta)
+        batch_whole(id, BATCH_METADATA, (const u8*)part.meta.c_str(), part.meta.size());
+      variant.last_meta = part.meta;
     }
+    variant.parts_broadcast++;
+    if (!variant.batch.empty() && now() - variant.batch_started >= batch_max_delay) flush_batch(id);
     if (udp_server_crashed) rethrow_exception(udp_server_exception);
   }
 };
@@ -0,0 +1,31 @@
+#ifndef CHUNK_HH
+#define CHUNK_HH
+
+#include <chrono>
+#include <cstring>
+#include <memory>
+#include <vector>
+#include "../common/types.hh"
+#include "icy.hh"
+
+using namespace std;
+
+// An immutable copy of a part read from the upstream. Chunks are shared between consumers through
+// shared_ptr, so a chunk is copied once no matter how many listeners send it.
+struct Chunk {
+  ICYPart part;
+  vector<u8> data;
+  i64 timestamp;  // time in milliseconds
+
+  Chunk(const ICYPart& part, const u8* buf, i64 timestamp)
+      : part(part), data(buf, buf + part.size), timestamp(timestamp) {}
+};
+
+inline shared_ptr<const Chunk> make_chunk(const ICYPart& part, const u8* data) {
+  i64 timestamp = chrono::duration_cast<chrono::milliseconds>(
+                      chrono::system_clock::now().time_since_epoch())
+                      .count();
+  return make_shared<const Chunk>(part, data, timestamp);
+}
+
+#endif
@@ -3,13 +3,36 @@
 
 #include <exception>
 #include <stdexcept>
+#include <sstream>
 #include <string>
-#include "types.hh"
+#include <unordered_map>
+#include <vector>
+#include "../common/log.hh"
+#include "../common/types.hh"
 
 using namespace std;
 
 constexpr u32 MAX_PORT = 65535;
 
+// An upstream given as a single string, see parse_upstream.
+struct Upstream {
+  string host;
+  string resource;
+  u32 port;
+};
+
+// Parses "host:port/resource", or "file:///path" for a file source.
+inline Upstream parse_upstream(const string& url) {
+  if (url.rfind("file://", 0) == 0) return {"file://", url.substr(7), 0};
+  size_t colon = url.find(':');
+  size_t slash = url.find('/');
+  if (colon == string::npos || slash == string::npos || slash < colon)
+    throw runtime_error("invalid upstream: " + url);
+  u32 port = stoul(url.substr(colon + 1, slash - colon - 1));
+  if (port > MAX_PORT) throw runtime_error("port too high");
+  return {url.substr(0, colon), url.substr(slash), port};
+}
+
 struct CmdArgs {
   string host;
   string resource;
@@ -21,6 +44,44 @@ struct CmdArgs {
   string multi;
   u32 udp_timeout;
 
+  i32 tcp_port;
+  string shm_name;
+
+  bool use_stdout;
+  unordered_map<string, string> drop_policies;  // sink name -> policy name
+  u32 queue_size;
+
+  string archive_dir;
+  u32 archive_hours;
+
+  bool frame_aligned;
+  vector<Upstream> variants;  // the same station at other bitrates, only relayed over UDP
+
+  string mirror;        // standby upstream of the main one, empty if there is none
+  u32 stall_threshold;  // time in milliseconds without audio before failing over to the mirror
+
+  string handoff_path;  // Unix socket to take over a running proxy at, empty to disable handoffs
+
+  LogLevel log_level;
+
+  // Parses a list like "stdout=block,udp=drop-oldest".
+  void parse_drop_policies(const string& value) {
+    stringstream list(value);
+    string item;
+    while (getline(list, item, ',')) {
+      size_t eq = item.find('=');
+      if (eq == string::npos) throw runtime_error("invalid drop policy: " + item);
+      string sink = item.substr(0, eq);
+      string policy = item.substr(eq + 1);
+      if (sink != "stdout" && sink != "udp" && sink != "tcp" && sink != "shm" &&
+          sink != "archive")
+        throw runtime_error("unknown sink: " + sink);
+      if (policy != "drop-oldest" && policy != "drop-newest" && policy != "block")
+        throw runtime_error("unknown drop policy: " + policy);
+      drop_policies[sink] = policy;
+    }
+  }
+
   void parse(int argc, char** argv) {
     if (argc % 2 != 1) throw runtime_error("wrong number of parameters");
 
@@ -32,6 +93,19 @@ struct CmdArgs {
     bool udp_port_set = false;
     bool multi_set = false;
     bool udp_timeout_set = false;
+    bool tcp_port_set = false;
+    bool shm_name_set = false;
+    bool use_stdout_set = false;
+    bool drop_policies_set = false;
+    bool queue_size_set = false;
+    bool archive_dir_set = false;
+    bool archive_hours_set = false;
+    bool frame_aligned_set = false;
+    bool variants_set = false;
+    bool mirror_set = false;
+    bool stall_threshold_set = false;
+    bool handoff_path_set = false;
+    bool log_level_set = false;
 
     for (int i = 1; i < argc; i += 2) {
       string flag(argv[i]);
@@ -79,20 +153,109 @@ struct CmdArgs {
         udp_timeout_set = true;
         udp_timeout = stoul(value);
         if (udp_timeout == 0) throw runtime_error("udp timeout cannot be set to 0");
+      } else if (flag == "-L") {
+        if (tcp_port_set) throw runtime_error("duplicate tcp port flag");
+        tcp_port_set = true;
+        tcp_port = stoul(value);
+        if (static_cast<u32>(tcp_port) > MAX_PORT) throw runtime_error("tcp port too high");
+      } else if (flag == "-S") {
+        if (shm_name_set) throw runtime_error("duplicate shm name flag");
+        shm_name_set = true;
+        shm_name = value;
+      } else if (flag == "-O") {
+        if (use_stdout_set) throw runtime_error("duplicate stdout flag");
+        if (value == "yes") {
+          use_stdout = true;
+        } else if (value == "no") {
+          use_stdout = false;
+        } else {
+          throw runtime_error("unexpected value for -O: " + value);
+        }
+        use_stdout_set = true;
+      } else if (flag == "-D") {
+        if (drop_policies_set) throw runtime_error("duplicate drop policy flag");
+        drop_policies_set = true;
+        parse_drop_policies(value);
+      } else if (flag == "-Q") {
+        if (queue_size_set) throw runtime_error("duplicate queue size flag");
+        queue_size_set = true;
+        queue_size = stoul(value);
+        if (queue_size == 0) throw runtime_error("queue size cannot be set to 0");
+      } else if (flag == "-A") {
+        if (archive_dir_set) throw runtime_error("duplicate archive directory flag");
+        archive_dir_set = true;
+        archive_dir = value;
+      } else if (flag == "-a") {
+        if (archive_hours_set) throw runtime_error("duplicate archive retention flag");
+        archive_hours_set = true;
+        archive_hours = stoul(value);
+        if (archive_hours == 0) throw runtime_error("archive retention cannot be set to 0");
+      } else if (flag == "-F") {
+        if (frame_aligned_set) throw runtime_error("duplicate frame alignment flag");
+        if (value == "yes") {
+          frame_aligned = true;
+        } else if (value == "no") {
+          frame_aligned = false;
+        } else {
+          throw runtime_error("unexpected value for -F: " + value);
+        }
+        frame_aligned_set = true;
+      } else if (flag == "-V") {
+        if (variants_set) throw runtime_error("duplicate variants flag");
+        variants_set = true;
+        stringstream list(value);
+        string item;
+        while (getline(list, item, ',')) variants.push_back(parse_upstream(item));
+      } else if (flag == "-M") {
+        if (mirror_set) throw runtime_error("duplicate mirror flag");
+        mirror_set = true;
+        parse_upstream(value);
+        mirror = value;
+      } else if (flag == "-W") {
+        if (stall_threshold_set) throw runtime_error("duplicate stall threshold flag");
+        stall_threshold_set = true;
+        stall_threshold = stoul(value);
+        if (stall_threshold == 0) throw runtime_error("stall threshold cannot be set to 0");
+      } else if (flag == "-U") {
+        if (handoff_path_set) throw runtime_error("duplicate handoff socket flag");
+        handoff_path_set = true;
+        handoff_path = value;
+      } else if (flag == "-l") {
+        if (log_level_set) throw runtime_error("duplicate log level flag");
+        log_level_set = true;
+        log_level = parse_log_level(value);
       } else {
         throw runtime_error("unexpected flag: " + flag);
       }
     }
 
+    // a file source has no port, see ICYStream
+    if (host_set && host == "file://" && !port_set) {
+      port_set = true;
+      port = 0;
+    }
     if (!(host_set && resource_set && port_set)) {
       throw runtime_error("some required flags were not set");
     }
+    if (variants_set && !udp_port_set) throw runtime_error("variants are only sent over UDP");
 
     meta = meta_set ? meta : false;
     timeout = timeout_set ? timeout : 5;
     udp_port = udp_port_set ? udp_port : -1;
     multi = multi_set ? multi : "";
     udp_timeout = udp_timeout_set ? udp_timeout : 5;
+    tcp_port = tcp_port_set ? tcp_port : -1;
+    shm_name = shm_name_set ? shm_name : "";
+    // stdout is the default sink if no other sink was chosen
+    use_stdout = use_stdout_set ? use_stdout : !(udp_port_set || tcp_port_set || shm_name_set);
+    queue_size = queue_size_set ? queue_size : 64;
+    archive_dir = archive_dir_set ? archive_dir : "";
+    archive_hours = archive_hours_set ? archive_hours : 24;
+    frame_aligned = frame_aligned_set ? frame_aligned : false;
+    mirror = mirror_set ? mirror : "";
+    stall_threshold = stall_threshold_set ? stall_threshold : 500;
+    handoff_path = handoff_path_set ? handoff_path : "";
+    log_level = log_level_set ? log_level : LogLevel::INFO;
   }
 };
 
@@ -0,0 +1,297 @@
+#ifndef FANOUT_HH
+#define FANOUT_HH
+
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+#include "../common/log.hh"
+#include "../common/types.hh"
+#include "broadcaster.hh"
+#include "chunk.hh"
+#include "icy.hh"
+
+using namespace std;
+
+// What a sink does when its queue is full.
+enum class DropPolicy {
+  DROP_OLDEST,  // discard the oldest queued chunk to make room
+  DROP_NEWEST,  // discard the incoming chunk
+  BLOCK,        // wait until the sink catches up, which stalls the upstream and all other sinks
+};
+
+inline DropPolicy parse_drop_policy(const string& value) {
+  if (value == "drop-oldest") return DropPolicy::DROP_OLDEST;
+  if (value == "drop-newest") return DropPolicy::DROP_NEWEST;
+  if (value == "block") return DropPolicy::BLOCK;
+  throw runtime_error("unknown drop policy: " + value);
+}
+
+// The policy of a sink not given one with -D. What goes to stdout or the archive is a recording,
+// which must not lose audio, so those sinks block. The network sinks serve live listeners, who are
+// better off skipping ahead than holding up everyone else.
+inline DropPolicy default_drop_policy(const string& sink) {
+  if (sink == "stdout" || sink == "archive") return DropPolicy::BLOCK;
+  return DropPolicy::DROP_OLDEST;
+}
+
+struct SinkStats {
+  u64 delivered = 0;
+  u64 dropped = 0;
+  size_t depth = 0;
+  size_t max_depth = 0;
+  i64 last_lag = 0;  // time in milliseconds between reading a chunk and handing it to the sink
+  i64 max_lag = 0;
+};
+
+// A broadcaster running on its own thread behind a bounded queue of shared chunks.
+class Sink {
+  string name;
+  shared_ptr<Broadcaster> broadcaster;
+  DropPolicy policy;
+  size_t capacity;
+
+  deque<shared_ptr<const Chunk>> queue;
+  mutex lock;
+  condition_variable not_empty;
+  condition_variable not_full;
+  condition_variable idle;
+  bool stopping;
+  bool busy;  // whether the worker is broadcasting a chunk
+  SinkStats stats;
+  u64 reported_dropped;
+
+  thread worker;
+  bool started;  // between start and stop, so that the broadcaster is cleaned up once
+  bool crashed;
+  exception_ptr exception;
+
+  static i64 now() {
+    return chrono::duration_cast<chrono::milliseconds>(
+               chrono::system_clock::now().time_since_epoch())
+        .count();
+  }
+
+  void run() {
+    try {
+      while (true) {
+        shared_ptr<const Chunk> chunk;
+        {
+          unique_lock<mutex> lock_u(lock);
+          not_empty.wait(lock_u, [this] { return stopping || !queue.empty(); });
+          if (stopping) return;
+          chunk = move(queue.front());
+          queue.pop_front();
+          busy = true;
+          stats.depth = queue.size();
+          stats.last_lag = now() - chunk->timestamp;
+          stats.max_lag = max(stats.max_lag, stats.last_lag);
+        }
+        not_full.notify_one();
+        broadcaster->broadcast_chunk(chunk);
+        {
+          lock_guard<mutex> lock_g(lock);
+          stats.delivered++;
+          busy = false;
+        }
+        idle.notify_all();
+      }
+    } catch (...) {
+      lock_guard<mutex> lock_g(lock);
+      crashed = true;
+      exception = current_exception();
+      not_full.notify_all();
+      idle.notify_all();
+    }
+  }
+
+ public:
+  Sink(const string& name, shared_ptr<Broadcaster> broadcaster, DropPolicy policy, size_t capacity)
+      : name(name), broadcaster(broadcaster), policy(policy), capacity(max<size_t>(capacity, 1)) {
+    stopping = false;
+    busy = false;
+    started = false;
+    crashed = false;
+    reported_dropped = 0;
+  }
+
+  ~Sink() {
+    try {
+      stop();
+    } catch (...) {
+      // ignore errors since this is a destructor
+    }
+  }
+
+  const string& get_name() { return name; }
+
+  void start() {
+    broadcaster->init();
+    started = true;
+    worker = thread([this] { run(); });
+  }
+
+  // Does nothing if the sink is not running, e.g. when the destructor follows an explicit stop.
+  void stop() {
+    if (!started) return;
+    started = false;
+    {
+      lock_guard<mutex> lock_g(lock);
+      stopping = true;
+    }
+    not_empty.notify_all();
+    not_full.notify_all();
+    idle.notify_all();
+    if (worker.joinable()) worker.join();
+    broadcaster->clean_up();
+  }
+
+  // Waits until the sink has broadcast every queued chunk.
+  void drain() {
+    unique_lock<mutex> lock_u(lock);
+    idle.wait(lock_u, [this] { return stopping || crashed || (queue.empty() && !busy); });
+    if (crashed) rethrow_exception(exception);
+  }
+
+  void push(const shared_ptr<const Chunk>& chunk) {
+    unique_lock<mutex> lock_u(lock);
+    if (crashed) rethrow_exception(exception);
+    if (queue.size() >= capacity) {
+      if (policy == DropPolicy::BLOCK) {
+        not_full.wait(lock_u, [this] { return stopping || crashed || queue.size() < capacity; });
+        if (crashed) rethrow_exception(exception);
+        if (stopping) return;
+      } else if (policy == DropPolicy::DROP_OLDEST) {
+        queue.pop_front();
+        stats.dropped++;
+      } else {
+        stats.dropped++;
+        return;
+      }
+    }
+    queue.push_back(chunk);
+    stats.depth = queue.size();
+    stats.max_depth = max(stats.max_depth, stats.depth);
+    lock_u.unlock();
+    not_empty.notify_one();
+  }
+
+  SinkStats get_stats() {
+    lock_guard<mutex> lock_g(lock);
+    return stats;
+  }
+
+  // Returns the number of chunks dropped since the last call.
+  u64 take_new_drops() {
+    lock_guard<mutex> lock_g(lock);
+    u64 new_drops = stats.dropped - reported_dropped;
+    reported_dropped = stats.dropped;
+    return new_drops;
+  }
+};
+
+// Hands every part read from the upstream to several sinks. The part is copied once into a shared
+// chunk, and each sink consumes it at its own pace, so a slow sink only affects itself.
+class FanoutBroadcaster : public Broadcaster {
+  static const i64 report_interval = 10000;  // time in milliseconds
+
+  vector<unique_ptr<Sink>> sinks;
+  bool started;
+  i64 last_report;
+
+  static i64 now() {
+    return chrono::duration_cast<chrono::milliseconds>(
+               chrono::system_clock::now().time_since_epoch())
+        .count();
+  }
+
+  // Reports sinks that dropped chunks since the last report.
+  void report_drops() {
+    for (auto& sink : sinks) {
+      u64 new_drops = sink->take_new_drops();
+      if (new_drops == 0) continue;
+      SinkStats stats = sink->get_stats();
+      LOG_WARN("Sink %s is falling behind: dropped %llu chunks, lag %lld ms",
+               sink->get_name().c_str(), static_cast<unsigned long long>(new_drops),
+               static_cast<long long>(stats.last_lag));
+    }
+  }
+
+ public:
+  FanoutBroadcaster() : started(false), last_report(0) {}
+
+  ~FanoutBroadcaster() {
+    try {
+      clean_up();
+    } catch (...) {
+      // ignore errors since this is a destructor
+    }
+  }
+
+  void add_sink(const string& name, shared_ptr<Broadcaster> broadcaster, DropPolicy policy,
+                size_t capacity) {
+    if (started) throw runtime_error("sinks must be added before init");
+    sinks.push_back(make_unique<Sink>(name, broadcaster, policy, capacity));
+  }
+
+  size_t num_sinks() { return sinks.size(); }
+
+  void init() override {
+    for (auto& sink : sinks) sink->start();
+    started = true;
+    last_report = now();
+  }
+
+  void clean_up() override {
+    if (!started) return;
+    started = false;
+    exception_ptr first_exception;
+    for (auto& sink : sinks) {
+      try {
+        sink->stop();
+      } catch (...) {
+        if (!first_exception) first_exception = current_exception();
+      }
+    }
+    for (auto& sink : sinks) {
+      SinkStats stats = sink->get_stats();
+      LOG_INFO("Sink %s: delivered %llu, dropped %llu, max queue depth %zu, max lag %lld ms",
+               sink->get_name().c_str(), static_cast<unsigned long long>(stats.delivered),
+               static_cast<unsigned long long>(stats.dropped), stats.max_depth,
+               static_cast<long long>(stats.max_lag));
+    }
+    if (first_exception) rethrow_exception(first_exception);
+  }
+
+  // Waits until every sink has broadcast everything it was given.
+  void drain() {
+    for (auto& sink : sinks) sink->drain();
+  }
+
+  vector<pair<string, SinkStats>> get_stats() {
+    vector<pair<string, SinkStats>> result;
+    for (auto& sink : sinks) result.push_back({sink->get_name(), sink->get_stats()});
+    return result;
+  }
+
+  virtual void broadcast(const ICYPart& part, const u8* data) override {
+    broadcast_chunk(make_chunk(part, data));
+  }
+
+  virtual void broadcast_chunk(const shared_ptr<const Chunk>& chunk) override {
+    for (auto& sink : sinks) sink->push(chunk);
+    if (chunk->timestamp - last_report >= report_interval) {
+      report_drops();
+      last_report = chunk->timestamp;
+    }
+  }
+};
+
+#endif
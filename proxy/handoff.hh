@@ -0,0 +1,489 @@
+#ifndef HANDOFF_HH
+#define HANDOFF_HH
+
+// Hands a running proxy over to a new process, e.g. to deploy a new binary, without dropping its
+// listeners. The new process connects to the old one over a Unix socket and receives the UDP socket
+// and the upstream connections as file descriptors, with a snapshot of the client table, so UDP
+// clients keep getting audio and never have to discover the proxy again.
+//
+// 1. The new process connects and sends a request, see HandoffClient::connect_to.
+// 2. The old process stops reading the upstreams between two chunks, sends what is queued and
+//    sends the state, see HandoffServer::hand_over.
+// 3. The new process adopts the state and confirms. Without a confirmation the old process goes
+//    on as if nothing happened.
+// 4. The old process stops its other sinks, so that the new one can open them, and closes the
+//    connection. The new process then starts reading where the old one stopped.
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <cstring>
+#include <exception>
+#include <iostream>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+#include "../common/types.hh"
+#include "../common/wire.hh"
+#include "broadcaster.hh"
+#include "icy.hh"
+
+using namespace std;
+
+constexpr u32 HANDOFF_MAGIC = 0x52484F46;  // "RHOF"
+constexpr u16 HANDOFF_VERSION = 1;
+constexpr size_t HANDOFF_REQUEST_SIZE = sizeof(u32) + sizeof(u16);
+constexpr size_t HANDOFF_HEADER_SIZE = 3 * sizeof(u32);  // magic, state size, number of sockets
+constexpr u8 HANDOFF_ACK = 1;
+constexpr u32 HANDOFF_NO_FD = 0xFFFFFFFF;
+constexpr size_t HANDOFF_MAX_FDS = 253;  // the most one message can carry on Linux
+
+// Everything a new process takes over. upstreams[i] is the upstream of variant i. Its socket is -1
+// if the connection is not handed over, and the new process has to open its own.
+struct HandoffState {
+  vector<ICYState> upstreams;
+  bool has_udp = false;
+  UDPState udp;
+};
+
+// Serializes a HandoffState. Sockets are collected on the side, since they are sent as ancillary
+// data, and referred to by their index.
+class HandoffWriter {
+  vector<u8> buf;
+  vector<int> fds;
+
+ public:
+  void put_u8(u8 value) { buf.push_back(value); }
+
+  void put_u16(u16 value) {
+    buf.resize(buf.size() + sizeof value);
+    store_be16(buf.data() + buf.size() - sizeof value, value);
+  }
+
+  void put_u32(u32 value) {
+    buf.resize(buf.size() + sizeof value);
+    store_be32(buf.data() + buf.size() - sizeof value, value);
+  }
+
+  void put_u64(u64 value) {
+    buf.resize(buf.size() + sizeof value);
+    store_be64(buf.data() + buf.size() - sizeof value, value);
+  }
+
+  void put_bytes(const u8* data, size_t len) {
+    put_u32(len);
+    buf.insert(buf.end(), data, data + len);
+  }
+
+  void put_string(const string& value) { put_bytes((const u8*)value.data(), value.size()); }
+
+  void put_fd(int fd) {
+    if (fd < 0) {
+      put_u32(HANDOFF_NO_FD);
+      return;
+    }
+    put_u32(fds.size());
+    fds.push_back(fd);
+  }
+
+  const vector<u8>& get_data() { return buf; }
+
+  const vector<int>& get_fds() { return fds; }
+};
+
+class HandoffReader {
+  const vector<u8>& buf;
+  const vector<int>& fds;
+  size_t pos;
+
+  const u8* take(size_t len) {
+    if (buf.size() - pos < len) throw runtime_error("handoff state is truncated");
+    pos += len;
+    return buf.data() + pos - len;
+  }
+
+ public:
+  HandoffReader(const vector<u8>& buf, const vector<int>& fds) : buf(buf), fds(fds), pos(0) {}
+
+  u8 get_u8() { return *take(1); }
+
+  u16 get_u16() { return load_be16(take(sizeof(u16))); }
+
+  u32 get_u32() { return load_be32(take(sizeof(u32))); }
+
+  u64 get_u64() { return load_be64(take(sizeof(u64))); }
+
+  vector<u8> get_bytes() {
+    u32 len = get_u32();
+    const u8* data = take(len);
+    return vector<u8>(data, data + len);
+  }
+
+  string get_string() {
+    u32 len = get_u32();
+    return string((const char*)take(len), len);
+  }
+
+  int get_fd() {
+    u32 index = get_u32();
+    if (index == HANDOFF_NO_FD) return -1;
+    if (index >= fds.size()) throw runtime_error("handoff state refers to a missing socket");
+    return fds[index];
+  }
+};
+
+inline void write_icy_state(HandoffWriter& writer, const ICYState& state) {
+  writer.put_fd(state.sock);
+  writer.put_u8(state.request_meta);
+  writer.put_u64(state.meta_offset);
+  writer.put_u64(state.remaining_chunk_size);
+  writer.put_string(state.radio_info);
+  writer.put_u32(state.headers.size());
+  for (auto& header : state.headers) writer.put_string(header);
+  writer.put_u8(state.file_meta_sent);
+}
+
+inline ICYState read_icy_state(HandoffReader& reader) {
+  ICYState state;
+  state.sock = reader.get_fd();
+  state.request_meta = reader.get_u8() != 0;
+  state.meta_offset = reader.get_u64();
+  state.remaining_chunk_size = reader.get_u64();
+  state.radio_info = reader.get_string();
+  u32 num_headers = reader.get_u32();
+  for (u32 i = 0; i < num_headers; i++) state.headers.push_back(reader.get_string());
+  state.file_meta_sent = reader.get_u8() != 0;
+  return state;
+}
+
+inline void write_udp_state(HandoffWriter& writer, const UDPState& state) {
+  writer.put_fd(state.sock);
+  writer.put_u32(state.variants.size());
+  for (auto& variant : state.variants) {
+    writer.put_string(variant.last_meta);
+    writer.put_u64(variant.parts_broadcast);
+    writer.put_u32(variant.batch_seq);
+    writer.put_bytes(variant.packetizer_pending.data(), variant.packetizer_pending.size());
+  }
+  writer.put_u32(state.clients.size());
+  for (auto& client : state.clients) {
+    writer.put_u32(ntohl(client.addr.sin_addr.s_addr));
+    writer.put_u16(ntohs(client.addr.sin_port));
+    writer.put_u64(client.last_contact);
+    writer.put_u8(client.timeshifted | client.batched << 1);
+    writer.put_u64(client.cursor.segment_id);
+    writer.put_u64(client.cursor.offset);
+    writer.put_u64(client.first_live_part);
+    writer.put_u8(client.variant);
+  }
+}
+
+inline UDPState read_udp_state(HandoffReader& reader) {
+  UDPState state;
+  state.sock = reader.get_fd();
+  u32 num_variants = reader.get_u32();
+  for (u32 i = 0; i < num_variants; i++) {
+    UDPVariantState variant;
+    variant.last_meta = reader.get_string();
+    variant.parts_broadcast = reader.get_u64();
+    variant.batch_seq = reader.get_u32();
+    variant.packetizer_pending = reader.get_bytes();
+    state.variants.push_back(move(variant));
+  }
+  u32 num_clients = reader.get_u32();
+  for (u32 i = 0; i < num_clients; i++) {
+    sockaddr_in addr;
+    memset(&addr, 0, sizeof addr);
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(reader.get_u32());
+    addr.sin_port = htons(reader.get_u16());
+    i64 last_contact = reader.get_u64();
+    u8 flags = reader.get_u8();
+    ClientInfo client(last_contact, addr, 0);
+    client.timeshifted = (flags & 1) != 0;
+    client.batched = (flags & 2) != 0;
+    client.cursor.segment_id = reader.get_u64();
+    client.cursor.offset = reader.get_u64();
+    client.first_live_part = reader.get_u64();
+    client.variant = reader.get_u8();
+    state.clients.push_back(client);
+  }
+  return state;
+}
+
+inline void write_handoff_state(HandoffWriter& writer, const HandoffState& state) {
+  writer.put_u32(state.upstreams.size());
+  for (auto& upstream : state.upstreams) write_icy_state(writer, upstream);
+  writer.put_u8(state.has_udp);
+  if (state.has_udp) write_udp_state(writer, state.udp);
+}
+
+inline HandoffState read_handoff_state(HandoffReader& reader) {
+  HandoffState state;
+  u32 num_upstreams = reader.get_u32();
+  for (u32 i = 0; i < num_upstreams; i++) state.upstreams.push_back(read_icy_state(reader));
+  state.has_udp = reader.get_u8() != 0;
+  if (state.has_udp) state.udp = read_udp_state(reader);
+  return state;
+}
+
+inline sockaddr_un handoff_address(const string& path) {
+  sockaddr_un addr;
+  memset(&addr, 0, sizeof addr);
+  addr.sun_family = AF_UNIX;
+  if (path.size() >= sizeof addr.sun_path) throw runtime_error("handoff socket path is too long");
+  memcpy(addr.sun_path, path.c_str(), path.size());
+  return addr;
+}
+
+inline void set_handoff_timeout(int sock, u32 timeout) {
+  timeval tv;
+  tv.tv_sec = timeout;
+  tv.tv_usec = 0;
+  if (setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, (void*)&tv, sizeof tv) < 0 ||
+      setsockopt(sock, SOL_SOCKET, SO_SNDTIMEO, (void*)&tv, sizeof tv) < 0)
+    throw runtime_error("setsockopt failed");
+}
+
+inline void handoff_send_all(int sock, const u8* data, size_t len) {
+  while (len > 0) {
+    ssize_t sent = send(sock, data, len, MSG_NOSIGNAL);
+    if (sent <= 0) throw runtime_error("handoff send failed");
+    data += sent;
+    len -= sent;
+  }
+}
+
+inline void handoff_recv_all(int sock, u8* data, size_t len) {
+  while (len > 0) {
+    ssize_t received = recv(sock, data, len, 0);
+    if (received < 0) throw runtime_error("handoff receive failed");
+    if (received == 0) throw runtime_error("handoff connection closed");
+    data += received;
+    len -= received;
+  }
+}
+
+// Listens for a new process that wants to take over, see HandoffClient. A request is only noted
+// here. The proxy checks requested() between chunks, stops reading and calls hand_over.
+class HandoffServer {
+  string path;
+  u32 timeout;  // time in seconds
+  int listener;
+  int conn;
+  thread acceptor;
+  atomic<bool> running;
+  atomic<bool> pending;
+  i64 requested_at;  // time in milliseconds
+
+  static i64 now() {
+    return chrono::duration_cast<chrono::milliseconds>(
+               chrono::steady_clock::now().time_since_epoch())
+        .count();
+  }
+
+  void accept_requests() {
+    while (running) {
+      pollfd pfd = {listener, POLLIN, 0};
+      if (pending || poll(&pfd, 1, 100) <= 0) {
+        if (pending) this_thread::sleep_for(chrono::milliseconds(100));
+        continue;
+      }
+      int sock = accept4(listener, nullptr, nullptr, SOCK_CLOEXEC);
+      if (sock < 0) continue;
+      try {
+        set_handoff_timeout(sock, timeout);
+        u8 request[HANDOFF_REQUEST_SIZE];
+        handoff_recv_all(sock, request, sizeof request);
+        if (load_be32(request) != HANDOFF_MAGIC || load_be16(request + 4) != HANDOFF_VERSION)
+          throw runtime_error("unsupported handoff request");
+        conn = sock;
+        requested_at = now();
+        pending = true;
+        cerr << "A new process asked to take over" << endl;
+      } catch (exception& e) {
+        cerr << "Ignoring a handoff request: " << e.what() << endl;
+        close(sock);
+      }
+    }
+  }
+
+  void stop(bool unlink_path) {
+    if (!running) return;
+    running = false;
+    acceptor.join();
+    close(listener);
+    if (unlink_path) unlink(path.c_str());
+    if (conn >= 0) close(conn);
+    conn = -1;
+  }
+
+ public:
+  // Listens at `path`, replacing a socket left there by a process that did not exit cleanly.
+  HandoffServer(const string& path, u32 timeout) : path(path), timeout(timeout), conn(-1) {
+    sockaddr_un addr = handoff_address(path);
+    listener = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (listener < 0) throw runtime_error("socket failed");
+    unlink(path.c_str());
+    if (bind(listener, (sockaddr*)&addr, sizeof addr) < 0 || listen(listener, 1) < 0) {
+      close(listener);
+      throw runtime_error("failed to listen for handoffs at " + path);
+    }
+    pending = false;
+    requested_at = 0;
+    running = true;
+    acceptor = thread([this] { accept_requests(); });
+  }
+
+  ~HandoffServer() { stop(true); }
+
+  bool requested() { return pending; }
+
+  // Sends the state to the process that asked for it and waits for it to confirm. Returns false if
+  // it did not, in which case this process keeps everything and can go on.
+  bool hand_over(const HandoffState& state) {
+    try {
+      HandoffWriter writer;
+      write_handoff_state(writer, state);
+      const vector<u8>& data = writer.get_data();
+      const vector<int>& fds = writer.get_fds();
+      if (fds.size() > HANDOFF_MAX_FDS) throw runtime_error("too many sockets to hand over");
+
+      u8 header[HANDOFF_HEADER_SIZE];
+      store_be32(header, HANDOFF_MAGIC);
+      store_be32(header + 4, data.size());
+      store_be32(header + 8, fds.size());
+      iovec iov = {header, sizeof header};
+      msghdr msg;
+      memset(&msg, 0, sizeof msg);
+      msg.msg_iov = &iov;
+      msg.msg_iovlen = 1;
+      // u64 keeps the control buffer aligned for cmsghdr
+      vector<u64> control((CMSG_SPACE(sizeof(int) * fds.size()) + 7) / 8);
+      if (!fds.empty()) {
+        msg.msg_control = control.data();
+        msg.msg_controllen = CMSG_SPACE(sizeof(int) * fds.size());
+        cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN(sizeof(int) * fds.size());
+        memcpy(CMSG_DATA(cmsg), fds.data(), sizeof(int) * fds.size());
+      }
+      ssize_t sent = sendmsg(conn, &msg, MSG_NOSIGNAL);
+      if (sent <= 0) throw runtime_error("handoff sendmsg failed");
+      handoff_send_all(conn, header + sent, sizeof header - sent);
+      handoff_send_all(conn, data.data(), data.size());
+
+      u8 ack;
+      handoff_recv_all(conn, &ack, 1);
+      if (ack != HANDOFF_ACK) throw runtime_error("unexpected confirmation");
+      cerr << "Handed over " << state.udp.clients.size() << " UDP clients and "
+           << fds.size() << " sockets after " << now() - requested_at << " ms" << endl;
+      return true;
+    } catch (exception& e) {
+      cerr << "Handoff failed, going on. Reason: " << e.what() << endl;
+      close(conn);
+      conn = -1;
+      pending = false;
+      return false;
+    }
+  }
+
+  // Lets the new process go on after a successful hand_over, once this process has released
+  // everything it needs. The new process listens at the path from then on.
+  void finish() { stop(true); }
+};
+
+// Takes over a running proxy, see HandoffServer.
+class HandoffClient {
+  int sock;
+  u32 timeout;  // time in seconds
+
+ public:
+  HandoffClient(u32 timeout) : sock(-1), timeout(timeout) {}
+
+  ~HandoffClient() {
+    if (sock >= 0) close(sock);
+  }
+
+  // Asks the proxy listening at `path` to hand over. Returns false if no proxy is listening there.
+  bool connect_to(const string& path) {
+    sockaddr_un addr = handoff_address(path);
+    sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (sock < 0) throw runtime_error("socket failed");
+    if (connect(sock, (sockaddr*)&addr, sizeof addr) < 0) {
+      int error = errno;
+      close(sock);
+      sock = -1;
+      if (error == ENOENT || error == ECONNREFUSED) return false;
+      throw runtime_error("failed to connect to " + path + ": " + strerror(error));
+    }
+    set_handoff_timeout(sock, timeout);
+    u8 request[HANDOFF_REQUEST_SIZE];
+    store_be32(request, HANDOFF_MAGIC);
+    store_be16(request + 4, HANDOFF_VERSION);
+    handoff_send_all(sock, request, sizeof request);
+    return true;
+  }
+
+  // Waits for the state of the running proxy. The sockets in it belong to this process now.
+  HandoffState receive() {
+    u8 header[HANDOFF_HEADER_SIZE];
+    iovec iov = {header, sizeof header};
+    msghdr msg;
+    memset(&msg, 0, sizeof msg);
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    vector<u64> control((CMSG_SPACE(sizeof(int) * HANDOFF_MAX_FDS) + 7) / 8);
+    msg.msg_control = control.data();
+    msg.msg_controllen = CMSG_SPACE(sizeof(int) * HANDOFF_MAX_FDS);
+    ssize_t received = recvmsg(sock, &msg, MSG_CMSG_CLOEXEC);
+    if (received < 0) throw runtime_error("the running proxy did not hand over in time");
+    if (received == 0) throw runtime_error("the running proxy refused to hand over");
+    if ((msg.msg_flags & MSG_CTRUNC) != 0) throw runtime_error("handoff sockets were truncated");
+
+    vector<int> fds;
+    for (cmsghdr* cmsg = CMSG_FIRSTHDR(&msg); cmsg != nullptr; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+      if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS) continue;
+      size_t count = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+      size_t at = fds.size();
+      fds.resize(at + count);
+      memcpy(fds.data() + at, CMSG_DATA(cmsg), count * sizeof(int));
+    }
+    handoff_recv_all(sock, header + received, sizeof header - received);
+    if (load_be32(header) != HANDOFF_MAGIC) throw runtime_error("invalid handoff header");
+    if (load_be32(header + 8) != fds.size()) throw runtime_error("handoff sockets are missing");
+
+    vector<u8> data(load_be32(header + 4));
+    handoff_recv_all(sock, data.data(), data.size());
+    HandoffReader reader(data, fds);
+    return read_handoff_state(reader);
+  }
+
+  // Tells the running proxy that this process took over.
+  void confirm() {
+    u8 ack = HANDOFF_ACK;
+    handoff_send_all(sock, &ack, 1);
+  }
+
+  // Waits until the old process released its other sinks and closed the connection.
+  void wait_released() {
+    u8 byte;
+    ssize_t received;
+    while ((received = recv(sock, &byte, 1, 0)) > 0) {
+    }
+    if (received < 0) throw runtime_error("the running proxy did not stop in time");
+    close(sock);
+    sock = -1;
+  }
+};
+
+#endif
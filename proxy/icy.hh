@@ -1,12 +1,14 @@
 #ifndef ICY_HH
 #define ICY_HH
 
+#include <fcntl.h>
 #include <netdb.h>
 #include <sys/socket.h>
 #include <sys/time.h>
 #include <sys/types.h>
 #include <unistd.h>
 #include <algorithm>
+#include <chrono>
 #include <cstring>
 #include <exception>
 #include <iostream>
@@ -14,7 +16,9 @@
 #include <regex>
 #include <sstream>
 #include <string>
-#include "types.hh"
+#include <thread>
+#include <vector>
+#include "../common/types.hh"
 
 using namespace std;
 
@@ -27,7 +31,20 @@ struct ICYPart {
       : size(size), meta_present(meta_present), meta(meta) {}
 };
 
+// Where a stream is, for a new process that goes on reading its connection, see ICYStream::adopt.
+struct ICYState {
+  conn_t sock = -1;
+  bool request_meta = false;
+  size_t meta_offset = 0;
+  size_t remaining_chunk_size = 0;
+  string radio_info;
+  vector<string> headers;
+  bool file_meta_sent = false;
+};
+
 class ICYStream {
+  friend class ProxyBench;
+
  private:
   string host;
   string resource;
@@ -41,6 +58,56 @@ class ICYStream {
   size_t remaining_chunk_size;
   char meta_buf[4096];
   string radio_info;
+  vector<string> headers;
+
+  // Set if the stream is read from a local file, see is_file_source.
+  bool file_source;
+  u64 file_rate;  // bytes per second, 0 reads as fast as possible
+  u64 file_bytes_read;
+  chrono::steady_clock::time_point file_start;
+  bool file_meta_sent;
+
+  // A host of "file://" makes the resource a path to a file that is replayed in a loop instead of
+  // a remote stream. The path may end with "?kbps=N" to pace reading at N kbit/s.
+  static bool is_file_source(const string& host) { return host == "file://"; }
+
+  // Returns the path of a file source and sets the rate it is read at.
+  string parse_file_resource() {
+    static std::regex rg_rate("^(.*)\\?kbps=([0-9]+)$");
+    smatch match_groups;
+    file_rate = 0;
+    if (!regex_match(resource, match_groups, rg_rate)) return resource;
+    file_rate = stoull(match_groups[2]) * 1000 / 8;
+    return match_groups[1];
+  }
+
+  void open_file() {
+    string path = parse_file_resource();
+    sock = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (sock < 0) throw runtime_error("failed to open " + path);
+    file_bytes_read = 0;
+    file_start = chrono::steady_clock::now();
+    file_meta_sent = false;
+    headers.clear();
+    radio_info = path.substr(path.find_last_of('/') + 1);
+  }
+
+  // Reads from the file, starting over at its end.
+  ssize_t read_file(u8* buf, size_t len) {
+    if (file_rate > 0) len = min<size_t>(len, max<u64>(file_rate / 50, 1));  // 20 ms at a time
+    ssize_t num_read = read(sock, buf, len);
+    if (num_read == 0) {
+      if (lseek(sock, 0, SEEK_SET) < 0) throw runtime_error("lseek failed");
+      num_read = read(sock, buf, len);
+      if (num_read == 0) throw runtime_error("file is empty");
+    }
+    if (num_read > 0 && file_rate > 0) {
+      file_bytes_read += num_read;
+      auto due = file_start + chrono::microseconds(file_bytes_read * 1000000 / file_rate);
+      this_thread::sleep_until(due);
+    }
+    return num_read;
+  }
 
   string build_request() {
     stringstream req;
@@ -138,14 +205,17 @@ class ICYStream {
 
     smatch match_groups;
     bool meta_found = false;
+    headers.clear();
     while (header != "\r\n") {
       header = read_header();
       if (request_meta && regex_match(header, match_groups, rg_meta)) {
         meta_offset = (size_t)stoul(match_groups[1]);
         meta_found = true;
+        continue;
       } else if (regex_match(header, match_groups, rg_name)) {
         radio_info = string(match_groups[1]);
       }
+      if (header != "\r\n") headers.push_back(header);
     }
 
     if (request_meta && !meta_found) request_meta = false;
@@ -175,12 +245,20 @@ class ICYStream {
     remaining_chunk_size = 0;
     meta_offset = 16384;  // default
     radio_info = host + ":" + to_string(port) + resource;
+    file_source = is_file_source(host);
+    file_rate = 0;
+    file_bytes_read = 0;
+    file_meta_sent = false;
   }
 
   ~ICYStream() { close_stream(); }
 
   void open_stream() {
     close_connection();
+    if (file_source) {
+      open_file();
+      return;
+    }
     setup_connection();
     string request = build_request();
     send(request);
@@ -189,12 +267,78 @@ class ICYStream {
 
   void close_stream() { close_connection(); }
 
+  // Returns what another process needs to go on reading the connection after this one stops. Only
+  // valid between calls to read_chunk.
+  ICYState get_state() {
+    ICYState state;
+    state.sock = sock;
+    state.request_meta = request_meta;
+    state.meta_offset = meta_offset;
+    state.remaining_chunk_size = remaining_chunk_size;
+    state.radio_info = radio_info;
+    state.headers = headers;
+    state.file_meta_sent = file_meta_sent;
+    return state;
+  }
+
+  // Goes on reading a connection that was opened by another process, instead of open_stream. A file
+  // source is paced from now on.
+  void adopt(const ICYState& state) {
+    close_connection();
+    sock = state.sock;
+    request_meta = state.request_meta;
+    meta_offset = state.meta_offset;
+    remaining_chunk_size = state.remaining_chunk_size;
+    radio_info = state.radio_info;
+    headers = state.headers;
+    file_meta_sent = state.file_meta_sent;
+    if (file_source) {
+      parse_file_resource();
+      file_bytes_read = 0;
+      file_start = chrono::steady_clock::now();
+    }
+  }
+
+  // Makes a read blocked on the connection return, e.g. from another thread that is shutting down.
+  void interrupt() {
+    if (sock >= 0 && !file_source) shutdown(sock, SHUT_RDWR);
+  }
+
   size_t get_chunk_size() { return meta_offset; }
 
   string get_radio_info() { return radio_info; }
 
+  // Returns the response headers sent by the server, excluding the status line and icy-metaint.
+  // Every header ends with "\r\n".
+  const vector<string>& get_headers() { return headers; }
+
+  bool meta_enabled() { return request_meta; }
+
+  // Returns the bitrate in bits per second announced in the icy-br header, or the rate a file is
+  // read at. Returns 0 if it is not known.
+  u32 get_bitrate() {
+    static std::regex rg_bitrate("^icy-br:\\s*([0-9]+)\r\n$",
+                                 regex_constants::ECMAScript | regex_constants::icase);
+    if (file_source) return static_cast<u32>(file_rate * 8);
+    smatch match_groups;
+    for (auto& header : headers) {
+      if (regex_match(header, match_groups, rg_bitrate)) return stoul(match_groups[1]) * 1000;
+    }
+    return 0;
+  }
+
   ICYPart read_chunk(u8* buf) {
     size_t chunk_size = remaining_chunk_size > 0 ? remaining_chunk_size : meta_offset;
+    if (file_source) {
+      // the file has no metadata of its own, so the name is sent once in place of a title
+      ssize_t num_read = read_file(buf, chunk_size);
+      if (num_read < 0) throw runtime_error("read failed");
+      remaining_chunk_size = chunk_size - num_read;
+      bool has_meta = request_meta && remaining_chunk_size == 0;
+      string meta = has_meta && !file_meta_sent ? "StreamTitle='" + radio_info + "';" : "";
+      file_meta_sent = file_meta_sent || has_meta;
+      return ICYPart(num_read, has_meta, meta);
+    }
     ssize_t num_read = read(sock, buf, chunk_size);
     if (num_read < 0) throw runtime_error("read failed");
     if (num_read == 0) throw runtime_error("connection closed");
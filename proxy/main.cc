@@ -1,3 +1,5 @@
+#include <unistd.h>
+#include <chrono>
 #include <csignal>
 #include <ctime>
 #include <exception>
@@ -6,9 +8,15 @@
 #include <memory>
 #include <string>
 #include <thread>
+#include <vector>
 #include "broadcaster.hh"
 #include "cmd.hh"
+#include "fanout.hh"
+#include "handoff.hh"
 #include "icy.hh"
+#include "redundant.hh"
+#include "shm.hh"
+#include "tcp.hh"
 
 using namespace std;
 
@@ -37,32 +45,186 @@ int main(int argc, char** argv) {
     } catch (exception& e) {
       cerr << "Failed to parse command line arguments. Reason: " << e.what() << endl << endl;
       cerr << "Usage: " << argv[0] << " -h host -r resource -p port [-m yes|no] [-t timeout]"
-           << " [-P port] [-B multi] [-T timeout]" << endl;
+           << " [-P port] [-B multi] [-T timeout] [-L port]"
+           << " [-S name] [-O yes|no] [-D sink=policy,...] [-Q size]"
+           << " [-A dir] [-a hours] [-F yes|no] [-V host:port/resource,...]"
+           << " [-M host:port/resource] [-W ms] [-U path] [-l level]" << endl;
+      cerr << "Sinks are stdout, archive, udp, tcp and shm, and policies drop-oldest, drop-newest"
+           << " and block. By default stdout and archive block, the others drop the oldest."
+           << endl;
       keep_running = 0;
       return 1;
     }
+    Logger::get().set_level(cmd.log_level);
 
-    ICYStream stream = ICYStream(cmd.host, cmd.resource, cmd.port, cmd.timeout, cmd.meta);
-    stream.open_stream();
+    unique_ptr<ICYStream> standby;
+    if (cmd.mirror != "") {
+      Upstream mirror = parse_upstream(cmd.mirror);
+      standby = make_unique<ICYStream>(mirror.host, mirror.resource, mirror.port, cmd.timeout,
+                                       cmd.meta);
+    }
+    RedundantStream stream(
+        make_unique<ICYStream>(cmd.host, cmd.resource, cmd.port, cmd.timeout, cmd.meta),
+        move(standby), cmd.stall_threshold, cmd.timeout);
+    // connections to a primary and a standby are not handed over, so they are opened before the
+    // running proxy is asked to stop
+    if (cmd.mirror != "") stream.open_stream();
+
+    // everything the running proxy has is taken over, or opened if it does not hand it over
+    HandoffClient takeover(cmd.timeout);
+    auto takeover_start = chrono::steady_clock::now();
+    bool taking_over = cmd.handoff_path != "" && takeover.connect_to(cmd.handoff_path);
+    HandoffState handed;
+    if (taking_over) {
+      handed = takeover.receive();
+      if (handed.upstreams.size() != cmd.variants.size() + 1)
+        throw runtime_error("the running proxy relays a different number of variants");
+      if (handed.has_udp && cmd.udp_port == -1)
+        throw runtime_error("the running proxy has UDP clients, but no UDP port was given");
+    }
+    auto handed_upstream = [&](size_t id) {
+      return taking_over && handed.upstreams[id].sock >= 0;
+    };
+    if (cmd.mirror != "" && handed_upstream(0)) close(handed.upstreams[0].sock);
+    if (cmd.mirror == "" && handed_upstream(0)) {
+      stream.adopt(handed.upstreams[0]);
+    } else if (cmd.mirror == "") {
+      stream.open_stream();
+    }
+
+    vector<unique_ptr<ICYStream>> variant_streams;
+    vector<u32> bitrates = {stream.get_bitrate()};
+    for (auto& upstream : cmd.variants) {
+      variant_streams.push_back(make_unique<ICYStream>(upstream.host, upstream.resource,
+                                                       upstream.port, cmd.timeout, cmd.meta));
+      size_t id = variant_streams.size();
+      if (handed_upstream(id)) {
+        variant_streams.back()->adopt(handed.upstreams[id]);
+      } else {
+        variant_streams.back()->open_stream();
+      }
+      bitrates.push_back(variant_streams.back()->get_bitrate());
+    }
 
-    shared_ptr<Broadcaster> broadcaster;
+    auto broadcaster = make_shared<FanoutBroadcaster>();
+    auto add_sink = [&](const string& name, shared_ptr<Broadcaster> sink) {
+      auto it = cmd.drop_policies.find(name);
+      DropPolicy policy = it != cmd.drop_policies.end() ? parse_drop_policy(it->second)
+                                                        : default_drop_policy(name);
+      broadcaster->add_sink(name, sink, policy, cmd.queue_size);
+    };
+    shared_ptr<Archive> archive;
+    if (cmd.archive_dir != "") {
+      archive = make_shared<Archive>(cmd.archive_dir, cmd.archive_hours);
+      add_sink("archive", make_shared<ArchiveBroadcaster>(archive));
+    }
+    if (cmd.use_stdout) add_sink("stdout", make_shared<StdoutBroadcaster>());
+    shared_ptr<UDPBroadcaster> udp;
     if (cmd.udp_port != -1) {
-      broadcaster = make_shared<UDPBroadcaster>(cmd.udp_port, cmd.multi, stream.get_radio_info(),
-                                                cmd.udp_timeout);
-    } else {
-      broadcaster = make_shared<StdoutBroadcaster>();
+      udp = make_shared<UDPBroadcaster>(cmd.udp_port, cmd.multi, stream.get_radio_info(),
+                                        cmd.udp_timeout);
+      udp->set_archive(archive);
+      udp->set_frame_aligned(cmd.frame_aligned);
+      udp->set_variants(bitrates);
+      if (taking_over && handed.has_udp) udp->adopt(handed.udp);
+      add_sink("udp", udp);
+    }
+    if (cmd.tcp_port != -1) {
+      add_sink("tcp", make_shared<TCPBroadcaster>(cmd.tcp_port, stream.get_radio_info(),
+                                                  stream.get_headers(), stream.get_chunk_size()));
+    }
+    if (cmd.shm_name != "") {
+      add_sink("shm", make_shared<ShmBroadcaster>(cmd.shm_name, stream.get_radio_info()));
+    }
+    if (taking_over) {
+      // the other sinks can only be opened once the running proxy closed them
+      takeover.confirm();
+      takeover.wait_released();
     }
     broadcaster->init();
+    unique_ptr<HandoffServer> handoff;
+    if (cmd.handoff_path != "") handoff = make_unique<HandoffServer>(cmd.handoff_path, cmd.timeout);
+    if (taking_over) {
+      cerr << "Took over " << handed.udp.clients.size() << " UDP clients from the running proxy in "
+           << chrono::duration_cast<chrono::milliseconds>(chrono::steady_clock::now() -
+                                                          takeover_start)
+                  .count()
+           << " ms" << endl;
+    }
+
+    // the other variants of the station only go to UDP clients, each read on its own thread
+    atomic<bool> reading_variants(false);
+    auto read_variant = [&](size_t id) {
+      ICYStream& variant_stream = *variant_streams[id - 1];
+      unique_ptr<u8[]> variant_buf(new u8[variant_stream.get_chunk_size()]);
+      try {
+        while (keep_running && reading_variants) {
+          ICYPart part = variant_stream.read_chunk(variant_buf.get());
+          udp->broadcast_variant(id, part, variant_buf.get());
+        }
+      } catch (...) {
+        // the whole station stops, as it does when the main upstream fails
+        if (!keep_running) return;
+        keep_running = 0;
+        throw;
+      }
+    };
+    vector<future<void>> variant_readers;
+    auto start_variant_readers = [&]() {
+      reading_variants = true;
+      for (size_t id = 1; id <= variant_streams.size(); id++)
+        variant_readers.push_back(async(launch::async, read_variant, id));
+    };
+    // Stops the readers after the chunk they are reading, so every upstream is between chunks.
+    auto stop_variant_readers = [&]() {
+      reading_variants = false;
+      for (auto& reader : variant_readers) reader.get();
+      variant_readers.clear();
+    };
+    // Stops the readers at once when the station fails, so that none keeps the proxy running.
+    auto abort_variant_readers = [&]() {
+      keep_running = 0;
+      reading_variants = false;
+      for (auto& variant_stream : variant_streams) variant_stream->interrupt();
+      for (auto& reader : variant_readers) reader.wait();
+      variant_readers.clear();
+    };
+    start_variant_readers();
+
+    // Stops reading between two chunks, sends what is queued and hands everything over to the new
+    // process. Returns false if the new process did not take over, after going on.
+    auto hand_over = [&]() {
+      stop_variant_readers();
+      broadcaster->drain();
+      HandoffState state;
+      state.upstreams.push_back(stream.get_state());
+      for (auto& variant_stream : variant_streams)
+        state.upstreams.push_back(variant_stream->get_state());
+      if (udp != nullptr) {
+        state.has_udp = true;
+        state.udp = udp->suspend();
+      }
+      if (handoff->hand_over(state)) return true;
+      if (udp != nullptr) udp->resume();
+      start_variant_readers();
+      return false;
+    };
 
     size_t buf_size = stream.get_chunk_size();
     shared_ptr<u8[]> buf(new u8[buf_size]);
 
-    while (keep_running) {
+    bool handed_over = false;
+    while (keep_running && !handed_over) {
       try {
+        if (handoff != nullptr && handoff->requested()) {
+          handed_over = hand_over();
+          continue;
+        }
         ICYPart part = stream.read_chunk(buf.get());
         broadcaster->broadcast(part, buf.get());
       } catch (exception& e) {
         if (keep_running) {
+          abort_variant_readers();
           throw;
         } else {
           // if the program should end anyway, ignore the exception
@@ -71,8 +233,14 @@ int main(int argc, char** argv) {
       }
     }
 
+    stop_variant_readers();
+    if (handed_over && udp != nullptr) udp->release();
     broadcaster->clean_up();
     stream.close_stream();
+    if (handed_over) {
+      handoff->finish();
+      keep_running = 0;
+    }
     return 0;
   } catch (exception& e) {
     cerr << "An error occurred:" << endl;
@@ -0,0 +1,150 @@
+#ifndef PACKETIZER_HH
+#define PACKETIZER_HH
+
+// Splits an MP3 or AAC (ADTS) stream into packets that start and end at codec frame boundaries, so
+// that a lost datagram costs whole frames only and a client can decode from any packet it gets.
+
+#include <algorithm>
+#include <cstring>
+#include <string>
+#include <vector>
+#include "../common/frames.hh"
+#include "../common/types.hh"
+
+using namespace std;
+
+struct PacketizerStats {
+  FrameFormat format = FrameFormat::UNKNOWN;
+  u32 sample_rate = 0;   // in Hz
+  u32 bitrate = 0;       // in bits per second, averaged over recent frames
+  double frame_duration = 0;  // in milliseconds
+  u64 frames = 0;
+  u64 packets = 0;
+  u64 resyncs = 0;         // number of times the packetizer lost and found frame sync
+  u64 unframed_bytes = 0;  // bytes outside of any frame, e.g. tags or garbage
+};
+
+// Turns stream data into packets of whole frames of at most `max_packet` bytes, unless a single
+// frame is longer. Data that does not parse as frames is passed on in packets of its own, so that
+// nothing is lost when the stream is not MP3 or AAC.
+class FramePacketizer {
+  size_t max_packet;
+  vector<u8> pending;  // data not emitted yet, starting with the next frame when in sync
+  bool in_sync;
+  FrameFormat sync_format;
+  u32 sync_sample_rate;
+  PacketizerStats stats;
+
+  void on_frame(const FrameInfo& frame) {
+    stats.frames++;
+    stats.format = frame.format;
+    stats.sample_rate = frame.sample_rate;
+    stats.frame_duration = 1000.0 * frame.samples / frame.sample_rate;
+    if (stats.bitrate == 0) stats.bitrate = frame.bitrate;
+    stats.bitrate += (static_cast<i64>(frame.bitrate) - static_cast<i64>(stats.bitrate)) / 32;
+  }
+
+  template <class F>
+  void emit_unframed(const u8* data, size_t len, F& emit) {
+    stats.unframed_bytes += len;
+    for (size_t offset = 0; offset < len; offset += max_packet) {
+      emit(data + offset, min(max_packet, len - offset));
+      stats.packets++;
+    }
+  }
+
+  // Returns true if a frame starts at `pos` and is followed by another frame of the same stream, or
+  // by the end of the data. Sets `need_more` if that cannot be decided yet.
+  bool confirm_sync(size_t pos, bool& need_more) {
+    need_more = false;
+    FrameInfo frame, next;
+    if (pending.size() - pos < MAX_FRAME_HEADER_SIZE) {
+      need_more = true;
+      return false;
+    }
+    if (!parse_frame_header(pending.data() + pos, frame)) return false;
+    size_t next_pos = pos + frame.length;
+    if (pending.size() < next_pos + MAX_FRAME_HEADER_SIZE) {
+      need_more = true;
+      return false;
+    }
+    return parse_frame_header(pending.data() + next_pos, next) && next.format == frame.format &&
+           next.sample_rate == frame.sample_rate;
+  }
+
+ public:
+  FramePacketizer(size_t max_packet)
+      : max_packet(max_packet),
+        in_sync(false),
+        sync_format(FrameFormat::UNKNOWN),
+        sync_sample_rate(0) {}
+
+  // Appends stream data and calls emit(data, len) for every packet that is complete. The last
+  // frame is held back until it is complete.
+  template <class F>
+  void push(const u8* data, size_t len, F emit) {
+    pending.insert(pending.end(), data, data + len);
+    size_t pos = 0;           // first byte not emitted
+    size_t packet_start = 0;  // first byte of the packet of frames being collected
+    while (true) {
+      if (in_sync) {
+        FrameInfo frame;
+        if (pending.size() - pos < MAX_FRAME_HEADER_SIZE) break;
+        if (!parse_frame_header(pending.data() + pos, frame) || frame.format != sync_format ||
+            frame.sample_rate != sync_sample_rate) {
+          in_sync = false;
+          stats.resyncs++;
+          continue;
+        }
+        if (pending.size() - pos < frame.length) break;
+        if (pos > packet_start && pos - packet_start + frame.length > max_packet) {
+          emit(pending.data() + packet_start, pos - packet_start);
+          stats.packets++;
+          packet_start = pos;
+        }
+        pos += frame.length;
+        on_frame(frame);
+        continue;
+      }
+
+      // out of sync: everything up to the next confirmed frame is unframed
+      if (pos > packet_start) {
+        emit(pending.data() + packet_start, pos - packet_start);
+        stats.packets++;
+      }
+      size_t candidate = pos;
+      bool need_more = false;
+      while (true) {
+        candidate = find_sync(pending.data(), pending.size(), candidate);
+        if (candidate == pending.size() || confirm_sync(candidate, need_more) || need_more) break;
+        candidate++;
+      }
+      emit_unframed(pending.data() + pos, candidate - pos, emit);
+      pos = packet_start = candidate;
+      if (candidate == pending.size() || need_more) break;
+      FrameInfo frame;
+      parse_frame_header(pending.data() + pos, frame);
+      in_sync = true;
+      sync_format = frame.format;
+      sync_sample_rate = frame.sample_rate;
+    }
+    if (pos > packet_start) {
+      emit(pending.data() + packet_start, pos - packet_start);
+      stats.packets++;
+    }
+    pending.erase(pending.begin(), pending.begin() + pos);
+  }
+
+  PacketizerStats get_stats() { return stats; }
+
+  // Returns the data held back for the next push, i.e. the start of an incomplete frame.
+  const vector<u8>& get_pending() { return pending; }
+
+  // Continues after the data another packetizer held back, see get_pending.
+  void restore_pending(const vector<u8>& data) {
+    pending = data;
+    in_sync = false;
+  }
+};
+
+#endif
@@ -0,0 +1,386 @@
+#ifndef REDUNDANT_HH
+#define REDUNDANT_HH
+
+// Reads a station from a primary upstream and a standby mirror at the same time, and fails over to
+// the other one when the upstream in use stalls. The two are aligned by matching their audio, so
+// the failover continues at the exact byte where the stalled upstream stopped, with nothing skipped
+// or repeated.
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstring>
+#include <ctime>
+#include <deque>
+#include <exception>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+#include "../common/types.hh"
+#include "icy.hh"
+#include "packetizer.hh"
+
+using namespace std;
+
+struct RedundancyStats {
+  u64 switchovers = 0;
+  u64 unaligned_switchovers = 0;  // switchovers that had to skip audio
+  // time in milliseconds from the last audio of the stalled upstream to the first of the other one
+  i64 last_switchover_latency = 0;
+  i64 max_switchover_latency = 0;
+  u64 align_runs = 0;
+  u64 align_failures = 0;
+  i64 align_cpu_ns = 0;  // CPU time spent matching the upstreams
+};
+
+class RedundantStream {
+  friend class ProxyBench;
+
+  // The audio read from one upstream, by position since it connected. Only the last `window` bytes
+  // are kept, plus whatever has not been returned by read_chunk yet.
+  struct Mirror {
+    string name;
+    unique_ptr<ICYStream> stream;
+    vector<u8> data;
+    u64 start;                      // position of data[0]
+    deque<pair<u64, string>> meta;  // metadata and the position of the audio it follows
+    i64 last_read;                  // time of the last audio, in milliseconds
+    bool connected;
+
+    u64 end() const { return start + data.size(); }
+
+    void reset() {
+      data.clear();
+      start = 0;
+      meta.clear();
+      last_read = 0;
+    }
+  };
+
+  static const size_t window = 1 << 20;
+  static const size_t anchor_size = 512;
+  static const i64 align_interval = 1000;   // time in milliseconds
+  static const i64 reconnect_delay = 1000;  // time in milliseconds
+
+  Mirror mirrors[2];
+  bool redundant;
+  size_t chunk_size;    // of the primary, the most read_chunk returns at once
+  i64 stall_threshold;  // time in milliseconds
+  u32 timeout;          // time in seconds
+
+  mutex lock;
+  condition_variable data_ready;
+  atomic<bool> running;
+  thread readers[2];
+
+  size_t active;
+  u64 out_pos;  // position in the active mirror of the next byte to return
+  bool aligned;
+  i64 offset;  // position in mirrors[1] minus the position of the same audio in mirrors[0]
+  i64 last_align;
+  RedundancyStats stats;
+
+  static i64 now() {
+    return chrono::duration_cast<chrono::milliseconds>(
+               chrono::system_clock::now().time_since_epoch())
+        .count();
+  }
+
+  static i64 cpu_time_ns() {
+    timespec ts;
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+    return static_cast<i64>(ts.tv_sec) * 1000000000 + ts.tv_nsec;
+  }
+
+  // Translates a position in mirror `from` into the position of the same audio in mirror `to`.
+  i64 translate(u64 pos, size_t from, size_t to) {
+    if (from == to) return pos;
+    return from == 0 ? static_cast<i64>(pos) + offset : static_cast<i64>(pos) - offset;
+  }
+
+  enum class Match { NONE, UNIQUE, AMBIGUOUS };
+
+  // Looks for the latest audio of mirror `from` in mirror `to` and sets `found_offset` if it is
+  // there once. The anchor starts at a frame header if there is one, so that the match does not
+  // depend on where the reads split the stream. Repeated audio, like encoded silence, is ambiguous.
+  Match match(size_t from, size_t to, i64& found_offset) {
+    Mirror& a = mirrors[from];
+    Mirror& b = mirrors[to];
+    if (a.data.size() < 2 * anchor_size || b.data.size() < anchor_size) return Match::NONE;
+    size_t anchor = a.data.size() - 2 * anchor_size;
+    size_t sync = find_sync(a.data.data(), a.data.size() - anchor_size, anchor);
+    FrameInfo frame;
+    if (sync + MAX_FRAME_HEADER_SIZE <= a.data.size() &&
+        parse_frame_header(a.data.data() + sync, frame))
+      anchor = sync;
+    const u8* b_end = b.data.data() + b.data.size();
+    const u8* found = static_cast<const u8*>(
+        memmem(b.data.data(), b.data.size(), a.data.data() + anchor, anchor_size));
+    if (found == nullptr) return Match::NONE;
+    if (memmem(found + 1, b_end - found - 1, a.data.data() + anchor, anchor_size) != nullptr)
+      return Match::AMBIGUOUS;
+    i64 pos_a = a.start + anchor;
+    i64 pos_b = b.start + (found - b.data.data());
+    found_offset = from == 0 ? pos_b - pos_a : pos_a - pos_b;
+    return Match::UNIQUE;
+  }
+
+  // Finds the offset between the mirrors. The anchor is taken from the end of either mirror, since
+  // the one that is ahead has no match for the latest audio of the other yet. While a mirror is
+  // disconnected or its latest audio is ambiguous, the offset found before still holds.
+  void align() {
+    if (!mirrors[0].connected || !mirrors[1].connected) return;
+    i64 cpu_start = cpu_time_ns();
+    i64 old_offset = offset;
+    bool was_aligned = aligned;
+    i64 found_offset = 0;
+    Match result = match(0, 1, found_offset);
+    if (result == Match::NONE) result = match(1, 0, found_offset);
+    if (result == Match::UNIQUE) offset = found_offset;
+    if (result != Match::AMBIGUOUS) aligned = result == Match::UNIQUE;
+    stats.align_runs++;
+    if (result != Match::UNIQUE) stats.align_failures++;
+    stats.align_cpu_ns += cpu_time_ns() - cpu_start;
+    if (aligned && (!was_aligned || offset != old_offset)) {
+      cerr << "Upstreams aligned, " << mirrors[1].name << " is "
+           << (offset >= 0 ? offset : -offset) << " bytes " << (offset >= 0 ? "ahead" : "behind")
+           << endl;
+    }
+  }
+
+  // Returns where playback continues in mirror `to`, or -1 if it cannot continue there yet.
+  // Sets `skip` if the audio following the current position is gone from `to`, in which case the
+  // latest frame that `to` has is used instead.
+  i64 continuation(size_t to, bool& skip) {
+    Mirror& b = mirrors[to];
+    skip = false;
+    if (aligned) {
+      i64 pos = translate(out_pos, active, to);
+      if (pos >= static_cast<i64>(b.start) && pos < static_cast<i64>(b.end())) return pos;
+      if (pos >= static_cast<i64>(b.end())) return -1;  // the mirror is behind, wait for it
+    }
+    if (b.data.empty()) return -1;
+    skip = true;
+    size_t tail = b.data.size() > 8192 ? b.data.size() - 8192 : 0;
+    size_t sync = find_sync(b.data.data(), b.data.size(), tail);
+    FrameInfo frame;
+    if (sync + MAX_FRAME_HEADER_SIZE > b.data.size() ||
+        !parse_frame_header(b.data.data() + sync, frame))
+      sync = tail;
+    return b.start + sync;
+  }
+
+  void switch_to(size_t to, u64 pos, bool skip) {
+    i64 latency = now() - mirrors[active].last_read;
+    cerr << "Upstream " << mirrors[active].name
+         << (mirrors[active].connected ? " stalled" : " failed") << ", switching to "
+         << mirrors[to].name
+         << (skip ? " without alignment, audio skips" : "") << " after " << latency << " ms"
+         << endl;
+    active = to;
+    out_pos = pos;
+    stats.switchovers++;
+    if (skip) stats.unaligned_switchovers++;
+    stats.last_switchover_latency = latency;
+    stats.max_switchover_latency = max(stats.max_switchover_latency, latency);
+  }
+
+  // Returns the next audio of the active mirror, up to the next metadata.
+  ICYPart take(u8* buf) {
+    Mirror& a = mirrors[active];
+    // metadata up to the current position belongs to audio that was returned from the other mirror
+    while (!a.meta.empty() && a.meta.front().first <= out_pos) a.meta.pop_front();
+    size_t len = min<u64>(a.end() - out_pos, chunk_size);
+    bool meta_present = false;
+    string meta;
+    if (!a.meta.empty() && a.meta.front().first <= out_pos + len) {
+      len = a.meta.front().first - out_pos;
+      meta_present = true;
+      meta = move(a.meta.front().second);
+      a.meta.pop_front();
+    }
+    memcpy(buf, a.data.data() + (out_pos - a.start), len);
+    out_pos += len;
+    return ICYPart(len, meta_present, meta);
+  }
+
+  // Drops audio that is older than the window and that read_chunk does not need anymore.
+  void trim(size_t id) {
+    Mirror& m = mirrors[id];
+    if (m.data.size() < 2 * window) return;
+    i64 keep_from = m.end() - window;
+    if (id == active) {
+      keep_from = min<i64>(keep_from, out_pos);
+    } else if (aligned) {
+      keep_from = min(keep_from, translate(out_pos, active, id));
+    }
+    if (keep_from <= static_cast<i64>(m.start)) return;
+    m.data.erase(m.data.begin(), m.data.begin() + (keep_from - m.start));
+    m.start = keep_from;
+  }
+
+  void connect(size_t id) {
+    Mirror& m = mirrors[id];
+    m.stream->open_stream();
+    lock_guard<mutex> lock_g(lock);
+    m.reset();
+    m.connected = true;
+    m.last_read = now();
+    aligned = false;
+    // positions start over with the new connection
+    if (id == active) out_pos = 0;
+  }
+
+  void read_mirror(size_t id) {
+    Mirror& m = mirrors[id];
+    vector<u8> buf;
+    while (running) {
+      try {
+        if (!m.connected) {
+          connect(id);
+          cerr << "Upstream " << m.name << " connected" << endl;
+        }
+        buf.resize(m.stream->get_chunk_size());
+        ICYPart part = m.stream->read_chunk(buf.data());
+        {
+          lock_guard<mutex> lock_g(lock);
+          m.data.insert(m.data.end(), buf.data(), buf.data() + part.size);
+          if (part.meta_present) m.meta.push_back({m.end(), part.meta});
+          if (part.size > 0) m.last_read = now();
+          trim(id);
+        }
+        data_ready.notify_all();
+      } catch (exception& e) {
+        if (!running) break;
+        {
+          lock_guard<mutex> lock_g(lock);
+          if (m.connected) cerr << "Upstream " << m.name << " failed: " << e.what() << endl;
+          m.connected = false;
+        }
+        data_ready.notify_all();
+        m.stream->close_stream();
+        for (i64 waited = 0; running && waited < reconnect_delay; waited += 100)
+          this_thread::sleep_for(chrono::milliseconds(100));
+      }
+    }
+  }
+
+ public:
+  // Without a standby, reads go straight to the primary. `stall_threshold` is the time in
+  // milliseconds without audio after which the other upstream takes over.
+  RedundantStream(unique_ptr<ICYStream> primary, unique_ptr<ICYStream> standby,
+                  i64 stall_threshold, u32 timeout)
+      : redundant(standby != nullptr),
+        chunk_size(0),
+        stall_threshold(stall_threshold),
+        timeout(timeout) {
+    mirrors[0].name = "primary";
+    mirrors[0].stream = move(primary);
+    mirrors[1].name = "standby";
+    mirrors[1].stream = move(standby);
+    for (auto& m : mirrors) {
+      m.reset();
+      m.connected = false;
+    }
+    running = false;
+    active = 0;
+    out_pos = 0;
+    aligned = false;
+    offset = 0;
+    last_align = 0;
+  }
+
+  ~RedundantStream() { close_stream(); }
+
+  // Connects to the primary, which has to succeed, and starts reading both upstreams. A standby
+  // that fails to connect is retried in the background.
+  void open_stream() {
+    if (!redundant) {
+      mirrors[0].stream->open_stream();
+      return;
+    }
+    connect(0);
+    chunk_size = mirrors[0].stream->get_chunk_size();
+    running = true;
+    for (size_t id = 0; id < 2; id++) readers[id] = thread([this, id] { read_mirror(id); });
+  }
+
+  void close_stream() {
+    if (running) {
+      running = false;
+      for (auto& m : mirrors) m.stream->interrupt();
+      for (auto& reader : readers) reader.join();
+      cerr << "Upstream redundancy: " << stats.switchovers << " switchovers ("
+           << stats.unaligned_switchovers << " unaligned), max switchover latency "
+           << stats.max_switchover_latency << " ms; alignment took "
+           << stats.align_cpu_ns / 1000 << " us of CPU in " << stats.align_runs << " runs ("
+           << stats.align_failures << " failed)" << endl;
+    }
+    for (auto& m : mirrors) {
+      if (m.stream != nullptr) m.stream->close_stream();
+    }
+  }
+
+  size_t get_chunk_size() { return redundant ? chunk_size : mirrors[0].stream->get_chunk_size(); }
+
+  string get_radio_info() { return mirrors[0].stream->get_radio_info(); }
+
+  const vector<string>& get_headers() { return mirrors[0].stream->get_headers(); }
+
+  u32 get_bitrate() { return mirrors[0].stream->get_bitrate(); }
+
+  // Returns the state of the upstream connection for another process, see ICYStream::get_state.
+  // With a standby, both upstreams are read ahead on their own threads, so the connections cannot
+  // be handed over and the state has no socket.
+  ICYState get_state() { return redundant ? ICYState() : mirrors[0].stream->get_state(); }
+
+  // Goes on reading a connection that another process handed over, instead of open_stream.
+  void adopt(const ICYState& state) {
+    if (redundant) throw runtime_error("cannot adopt a connection with a standby upstream");
+    mirrors[0].stream->adopt(state);
+  }
+
+  RedundancyStats get_stats() {
+    lock_guard<mutex> lock_g(lock);
+    return stats;
+  }
+
+  // Returns the next part of the station like ICYStream::read_chunk, from whichever upstream is in
+  // use. Throws if neither upstream had audio for the timeout.
+  ICYPart read_chunk(u8* buf) {
+    if (!redundant) return mirrors[0].stream->read_chunk(buf);
+    unique_lock<mutex> lock_u(lock);
+    while (true) {
+      i64 current_time = now();
+      if (current_time - last_align >= align_interval) {
+        align();
+        last_align = current_time;
+      }
+      Mirror& a = mirrors[active];
+      if (a.end() > out_pos) return take(buf);
+
+      size_t other = 1 - active;
+      Mirror& b = mirrors[other];
+      bool b_alive = b.connected && current_time - b.last_read < stall_threshold;
+      bool a_stalled = !a.connected || current_time - a.last_read >= stall_threshold;
+      if (a_stalled && b_alive) {
+        bool skip;
+        i64 pos = continuation(other, skip);
+        if (pos >= 0) {
+          switch_to(other, pos, skip);
+          continue;
+        }
+      }
+      if (current_time - max(a.last_read, b.last_read) >= timeout * 1000)
+        throw runtime_error("no audio from either upstream");
+      data_ready.wait_for(lock_u, chrono::milliseconds(10));
+    }
+  }
+};
+
+#endif
@@ -0,0 +1,129 @@
+#ifndef SHM_HH
+#define SHM_HH
+
+#include <fcntl.h>
+#include <linux/futex.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+#include "../common/types.hh"
+#include "broadcaster.hh"
+#include "icy.hh"
+#include "shmring.hh"
+
+using namespace std;
+
+// Publishes the stream into a single-writer ring in /dev/shm. Any number of local readers can map
+// the ring read-only (see ShmReader in shmring.hh) and consume records in place. The writer never
+// waits for readers; a reader that falls a whole ring behind loses the overwritten records.
+class ShmBroadcaster : public Broadcaster {
+  string name;
+  string radio_info;
+  u32 slot_count;
+  u32 slot_size;
+
+  int fd;
+  ShmRingHeader* header;
+  size_t size;
+
+  void publish(u32 type, const u8* data, size_t len) {
+    i64 timestamp = chrono::duration_cast<chrono::milliseconds>(
+                        chrono::system_clock::now().time_since_epoch())
+                        .count();
+    // perform at least one iteration to publish empty records
+    size_t offset = 0;
+    do {
+      size_t part_len = min<size_t>(len - offset, slot_size);
+      u64 seq = header->write_seq.load(memory_order_relaxed);
+      ShmSlot* slot = shm_ring_slot(header, seq);
+
+      slot->seq.store(SHM_SLOT_BUSY, memory_order_relaxed);
+      atomic_thread_fence(memory_order_release);
+      slot->type = type;
+      slot->len = static_cast<u32>(part_len);
+      slot->timestamp = timestamp;
+      memcpy(slot->data, data + offset, part_len);
+      slot->seq.store(seq, memory_order_release);
+      header->write_seq.store(seq + 1, memory_order_release);
+
+      offset += part_len;
+    } while (offset < len);
+
+    header->futex.fetch_add(1, memory_order_release);
+    syscall(SYS_futex, &header->futex, FUTEX_WAKE, INT32_MAX, nullptr, nullptr, 0);
+  }
+
+ public:
+  ShmBroadcaster(const string& name, const string& radio_info, u32 slot_count = 256,
+                 u32 slot_size = 16384)
+      : name(name), radio_info(radio_info), slot_count(slot_count), slot_size(slot_size) {
+    fd = -1;
+    header = nullptr;
+    size = 0;
+    if (name.empty() || name.find('/') != string::npos) throw runtime_error("invalid ring name");
+  }
+
+  void init() override {
+    u64 slot_stride = (sizeof(ShmSlot) + slot_size + 63) / 64 * 64;
+    size = shm_ring_size(slot_count, slot_stride);
+
+    string path = shm_ring_path(name);
+    unlink(path.c_str());  // readers of a previous run keep their own mapping
+    fd = open(path.c_str(), O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, 0644);
+    if (fd < 0) throw runtime_error("failed to create ring " + path);
+    if (ftruncate(fd, size) < 0) throw runtime_error("ftruncate failed");
+    void* addr = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (addr == MAP_FAILED) throw runtime_error("mmap failed");
+    header = static_cast<ShmRingHeader*>(addr);
+
+    header->version = SHM_RING_VERSION;
+    header->slot_count = slot_count;
+    header->slot_size = slot_size;
+    header->slot_stride = slot_stride;
+    header->write_seq.store(0, memory_order_relaxed);
+    header->futex.store(0, memory_order_relaxed);
+    header->closed = 0;
+    strncpy(header->radio_info, radio_info.c_str(), sizeof(header->radio_info) - 1);
+    for (u32 i = 0; i < slot_count; i++) {
+      shm_ring_slot(header, i)->seq.store(SHM_SLOT_BUSY, memory_order_relaxed);
+    }
+    // readers check the magic number last
+    __atomic_store_n(&header->magic, SHM_RING_MAGIC, __ATOMIC_RELEASE);
+  }
+
+  void clean_up() override {
+    if (header != nullptr) {
+      __atomic_store_n(&header->closed, 1, __ATOMIC_RELEASE);
+      header->futex.fetch_add(1, memory_order_release);
+      syscall(SYS_futex, &header->futex, FUTEX_WAKE, INT32_MAX, nullptr, nullptr, 0);
+      munmap(header, size);
+      unlink(shm_ring_path(name).c_str());
+    }
+    if (fd >= 0) close(fd);
+    header = nullptr;
+    fd = -1;
+  }
+
+  ~ShmBroadcaster() {
+    try {
+      clean_up();
+    } catch (...) {
+      // ignore errors since this is a destructor
+    }
+  }
+
+  virtual void broadcast(const ICYPart& part, const u8* data) override {
+    publish(SHM_AUDIO, data, part.size);
+    if (part.meta_present && part.meta.size() > 0) {
+      publish(SHM_METADATA, (const u8*)part.meta.c_str(), part.meta.length());
+    }
+  }
+};
+
+#endif
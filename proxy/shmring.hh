@@ -0,0 +1,178 @@
+#ifndef SHMRING_HH
+#define SHMRING_HH
+
+// Layout of the shared-memory ring published by ShmBroadcaster and a reader for it. This header
+// does not depend on the rest of the proxy, so local consumers can include it on its own.
+
+#include <fcntl.h>
+#include <linux/futex.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/types.h>
+#include <unistd.h>
+#include <atomic>
+#include <cerrno>
+#include <cstring>
+#include <ctime>
+#include <stdexcept>
+#include <string>
+#include "../common/types.hh"
+
+using namespace std;
+
+constexpr u32 SHM_RING_MAGIC = 0x52505348;  // "RPSH"
+constexpr u32 SHM_RING_VERSION = 1;
+
+// record types
+constexpr u32 SHM_AUDIO = 1;
+constexpr u32 SHM_METADATA = 2;
+
+struct ShmRingHeader {
+  u32 magic;
+  u32 version;
+  u32 slot_count;
+  u32 slot_size;  // capacity of a slot's data in bytes
+  u64 slot_stride;
+  atomic<u64> write_seq;  // sequence number of the next record
+  atomic<u32> futex;      // bumped after every record, readers wait on it
+  u32 closed;             // set by the writer when it stops
+  char radio_info[256];
+};
+
+struct ShmSlot {
+  atomic<u64> seq;  // sequence number of the record in the slot, SHM_SLOT_BUSY while writing
+  u32 type;
+  u32 len;
+  i64 timestamp;  // time in milliseconds
+  u8 data[];
+};
+
+constexpr u64 SHM_SLOT_BUSY = ~0ULL;
+
+static_assert(atomic<u64>::is_always_lock_free, "the ring needs lock-free 64-bit atomics");
+static_assert(atomic<u32>::is_always_lock_free, "the ring needs lock-free 32-bit atomics");
+
+inline string shm_ring_path(const string& name) { return "/dev/shm/radio-proxy-" + name; }
+
+inline size_t shm_ring_size(u32 slot_count, u64 slot_stride) {
+  return sizeof(ShmRingHeader) + slot_count * slot_stride;
+}
+
+inline ShmSlot* shm_ring_slot(ShmRingHeader* header, u64 seq) {
+  u8* base = reinterpret_cast<u8*>(header) + sizeof(ShmRingHeader);
+  return reinterpret_cast<ShmSlot*>(base + (seq % header->slot_count) * header->slot_stride);
+}
+
+// A record as seen by a reader. `data` points into the shared mapping, so it has to be checked
+// with ShmReader::still_valid after use, since the writer never waits for readers.
+struct ShmRecord {
+  u64 seq;
+  u32 type;
+  u32 len;
+  i64 timestamp;
+  const u8* data;
+};
+
+class ShmReader {
+  string name;
+  int fd;
+  ShmRingHeader* header;
+  size_t size;
+  u64 read_seq;
+  u64 lost;
+
+ public:
+  ShmReader(const string& name)
+      : name(name), fd(-1), header(nullptr), size(0), read_seq(0), lost(0) {}
+
+  ~ShmReader() { close_ring(); }
+
+  // Maps the ring read-only and starts reading at the newest record.
+  void open_ring() {
+    close_ring();
+    fd = open(shm_ring_path(name).c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) throw runtime_error("failed to open ring " + shm_ring_path(name));
+    struct stat st;
+    if (fstat(fd, &st) < 0 || static_cast<size_t>(st.st_size) < sizeof(ShmRingHeader))
+      throw runtime_error("ring is too small");
+    size = st.st_size;
+    void* addr = mmap(nullptr, size, PROT_READ, MAP_SHARED, fd, 0);
+    if (addr == MAP_FAILED) throw runtime_error("mmap failed");
+    header = static_cast<ShmRingHeader*>(addr);
+    if (header->magic != SHM_RING_MAGIC || header->version != SHM_RING_VERSION)
+      throw runtime_error("not a radio-proxy ring");
+    if (shm_ring_size(header->slot_count, header->slot_stride) > size)
+      throw runtime_error("ring is truncated");
+    read_seq = header->write_seq.load(memory_order_acquire);
+  }
+
+  void close_ring() {
+    if (header != nullptr) munmap(header, size);
+    if (fd >= 0) close(fd);
+    header = nullptr;
+    fd = -1;
+  }
+
+  string get_radio_info() {
+    return string(header->radio_info, strnlen(header->radio_info, sizeof(header->radio_info)));
+  }
+
+  bool writer_closed() { return __atomic_load_n(&header->closed, __ATOMIC_ACQUIRE) != 0; }
+
+  // Number of records that were overwritten before this reader got to them.
+  u64 get_lost() { return lost; }
+
+  // Waits up to `timeout_ms` for the next record. Returns false on timeout.
+  bool next(ShmRecord& record, int timeout_ms) {
+    while (true) {
+      u32 futex_val = header->futex.load(memory_order_acquire);
+      u64 write_seq = header->write_seq.load(memory_order_acquire);
+      if (write_seq - read_seq > header->slot_count) {
+        // the writer lapped us, skip to the oldest record that may still be intact
+        u64 skip_to = write_seq - header->slot_count + 1;
+        lost += skip_to - read_seq;
+        read_seq = skip_to;
+      }
+      if (read_seq < write_seq) {
+        ShmSlot* slot = shm_ring_slot(header, read_seq);
+        if (slot->seq.load(memory_order_acquire) != read_seq) {
+          lost++;
+          read_seq++;
+          continue;
+        }
+        record.seq = read_seq;
+        record.type = slot->type;
+        record.len = slot->len;
+        record.timestamp = slot->timestamp;
+        record.data = slot->data;
+        read_seq++;
+        if (record.len > header->slot_size || !still_valid(record)) {
+          lost++;
+          continue;
+        }
+        return true;
+      }
+      if (timeout_ms <= 0 || writer_closed()) return false;
+
+      timespec timeout;
+      timeout.tv_sec = timeout_ms / 1000;
+      timeout.tv_nsec = (timeout_ms % 1000) * 1000000L;
+      long status =
+          syscall(SYS_futex, &header->futex, FUTEX_WAIT, futex_val, &timeout, nullptr, 0);
+      if (status < 0 && errno == ETIMEDOUT) return false;
+      if (status < 0 && errno != EAGAIN && errno != EINTR) {
+        throw runtime_error("futex wait failed");
+      }
+    }
+  }
+
+  // Returns false if the writer has reused the record's slot, i.e. the data that was read from
+  // the record may be torn.
+  bool still_valid(const ShmRecord& record) {
+    atomic_thread_fence(memory_order_acquire);
+    return shm_ring_slot(header, record.seq)->seq.load(memory_order_relaxed) == record.seq;
+  }
+};
+
+#endif
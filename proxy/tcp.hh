@@ -0,0 +1,482 @@
+#ifndef TCP_HH
+#define TCP_HH
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <deque>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <regex>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+#include "../common/types.hh"
+#include "broadcaster.hh"
+#include "chunk.hh"
+#include "icy.hh"
+
+using namespace std;
+
+// A fixed-size window over the most recent chunks. Chunks are addressed by a sequence number that
+// grows forever, so a listener that falls out of the window can tell how far behind it is.
+class ChunkRing {
+ public:
+  struct Entry {
+    shared_ptr<const Chunk> chunk;
+    shared_ptr<const string> meta;  // metadata in effect at the end of the chunk
+  };
+
+ private:
+  vector<Entry> entries;
+  u64 next_seq;
+
+ public:
+  ChunkRing(size_t capacity) : entries(capacity), next_seq(0) {}
+
+  void push(shared_ptr<const Chunk> chunk, shared_ptr<const string> meta) {
+    entries[next_seq % entries.size()] = {move(chunk), move(meta)};
+    next_seq++;
+  }
+
+  // Sequence number of the oldest chunk still in the ring.
+  u64 first_seq() { return next_seq > entries.size() ? next_seq - entries.size() : 0; }
+
+  // Sequence number the next pushed chunk will get.
+  u64 end_seq() { return next_seq; }
+
+  // Returns nullptr if the chunk is not in the ring (yet or anymore).
+  const Entry* at(u64 seq) {
+    if (seq < first_seq() || seq >= next_seq) return nullptr;
+    return &entries[seq % entries.size()];
+  }
+};
+
+struct TCPListener {
+  conn_t sock;
+  bool request_done;  // whether the HTTP request was read and the response queued
+  string request;
+  bool want_write;  // waiting for EPOLLOUT
+
+  size_t metaint;  // 0 if the listener did not ask for metadata
+  size_t until_meta;
+  u64 seq;
+  size_t offset;
+  u32 skips;  // since the listener last caught up
+
+  string pending;  // response headers or a metadata block, sent before more audio
+  size_t pending_offset;
+  shared_ptr<const string> last_meta;
+
+  TCPListener(conn_t sock)
+      : sock(sock),
+        request_done(false),
+        want_write(false),
+        metaint(0),
+        until_meta(0),
+        seq(0),
+        offset(0),
+        skips(0),
+        pending_offset(0) {}
+};
+
+// Serves the stream to HTTP/ICY listeners over TCP, like a minimal Icecast relay. All listeners
+// are handled by a single epoll loop. A listener that falls behind the chunk ring is moved to the
+// live edge and disconnected if that keeps happening, so nothing is ever buffered per listener.
+class TCPBroadcaster : public Broadcaster {
+  friend class ProxyBench;
+
+  static const size_t ring_capacity = 64;
+  static const u32 max_skips = 8;  // in a row, without catching up with the live edge in between
+  static const size_t max_request_size = 8192;
+  static const size_t max_iov = 32;
+
+  u16 port;
+  size_t max_listeners;
+  size_t default_metaint;
+  string radio_info;
+  vector<string> upstream_headers;
+
+  conn_t sock;
+  int epoll_fd;
+  int event_fd;
+
+  ChunkRing ring;
+  shared_ptr<const string> current_meta;
+  unordered_map<conn_t, TCPListener> listeners;
+
+  mutex inbox_lock;
+  deque<shared_ptr<const Chunk>> inbox;  // at most ring_capacity, older chunks would not fit the
+                                         // ring anyway
+
+  thread tcp_server;
+  atomic<bool> tcp_server_enabled;
+  atomic<bool> tcp_server_crashed;
+  exception_ptr tcp_server_exception;
+
+  void epoll_add(int fd, u32 events) {
+    epoll_event ev;
+    ev.events = events;
+    ev.data.fd = fd;
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &ev) < 0) throw runtime_error("epoll_ctl failed");
+  }
+
+  void set_want_write(TCPListener& l, bool want_write) {
+    if (l.want_write == want_write) return;
+    epoll_event ev;
+    ev.events = EPOLLIN | EPOLLRDHUP | (want_write ? static_cast<u32>(EPOLLOUT) : 0);
+    ev.data.fd = l.sock;
+    epoll_ctl(epoll_fd, EPOLL_CTL_MOD, l.sock, &ev);
+    l.want_write = want_write;
+  }
+
+  void remove_listener(conn_t fd) {
+    epoll_ctl(epoll_fd, EPOLL_CTL_DEL, fd, nullptr);
+    close(fd);
+    listeners.erase(fd);
+  }
+
+  void accept_listeners() {
+    while (true) {
+      conn_t fd = accept4(sock, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+      if (fd < 0) {
+        if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) return;
+        if (errno == EMFILE || errno == ENFILE || errno == ECONNABORTED) return;
+        throw runtime_error("accept failed");
+      }
+      if (listeners.size() >= max_listeners) {
+        close(fd);
+        continue;
+      }
+      int optval = 1;
+      setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, (void*)&optval, sizeof optval);
+      listeners.emplace(fd, TCPListener(fd));
+      epoll_add(fd, EPOLLIN | EPOLLRDHUP);
+    }
+  }
+
+  string build_response(const TCPListener& l) {
+    static regex rg_metaint("^icy-metaint:.*\r\n$",
+                            regex_constants::ECMAScript | regex_constants::icase);
+    string response = "HTTP/1.0 200 OK\r\n";
+    for (auto& header : upstream_headers) {
+      if (!regex_match(header, rg_metaint)) response += header;
+    }
+    if (upstream_headers.empty()) response += "icy-name:" + radio_info + "\r\n";
+    if (l.metaint > 0) response += "icy-metaint:" + to_string(l.metaint) + "\r\n";
+    response += "\r\n";
+    return response;
+  }
+
+  // Parses the request once it has been fully read and queues the response. Returns false if the
+  // request is not supported.
+  bool handle_request(TCPListener& l) {
+    static regex rg_meta("\r\nicy-metadata:[ \t]*1[ \t]*\r\n",
+                         regex_constants::ECMAScript | regex_constants::icase);
+    static regex rg_metaint("\r\nicy-metaint:[ \t]*([0-9]+)[ \t]*\r\n",
+                            regex_constants::ECMAScript | regex_constants::icase);
+
+    if (l.request.compare(0, 4, "GET ") != 0) return false;
+    smatch match_groups;
+    if (regex_search(l.request, rg_meta)) {
+      l.metaint = default_metaint;
+      if (regex_search(l.request, match_groups, rg_metaint)) {
+        string requested = match_groups[1];
+        l.metaint = requested.size() > 7 ? 1 << 20 : stoul(requested);
+        l.metaint = min<size_t>(max<size_t>(l.metaint, 256), 1 << 20);
+      }
+    }
+    l.until_meta = l.metaint;
+    l.request_done = true;
+    l.request.clear();
+    l.pending = build_response(l);
+    l.pending_offset = 0;
+    // start from the newest chunk so that the player gets audio right away
+    l.seq = ring.end_seq() > 0 ? ring.end_seq() - 1 : 0;
+    l.offset = 0;
+    return true;
+  }
+
+  // Returns false if the listener should be disconnected.
+  bool read_from_listener(TCPListener& l) {
+    char buf[2048];
+    while (true) {
+      ssize_t read_len = read(l.sock, buf, sizeof buf);
+      if (read_len == 0) return false;
+      if (read_len < 0) return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR;
+      if (l.request_done) continue;  // ignore anything sent after the request
+      l.request.append(buf, read_len);
+      if (l.request.find("\r\n\r\n") != string::npos) {
+        return handle_request(l) && send_to_listener(l);
+      }
+      if (l.request.size() > max_request_size) return false;
+    }
+  }
+
+  // Builds the metadata block that follows every `metaint` bytes of audio.
+  void queue_meta(TCPListener& l, const shared_ptr<const string>& meta) {
+    l.pending_offset = 0;
+    if (!meta || meta == l.last_meta || (l.last_meta && *meta == *l.last_meta)) {
+      l.pending.assign(1, '\0');
+      return;
+    }
+    size_t len = min<size_t>(meta->size(), 255 * 16);
+    size_t blocks = (len + 15) / 16;
+    l.pending.assign(1 + blocks * 16, '\0');
+    l.pending[0] = static_cast<char>(blocks);
+    memcpy(&l.pending[1], meta->data(), len);
+    l.last_meta = meta;
+  }
+
+  // Writes as much as the socket takes. Returns false if the listener should be disconnected.
+  bool send_to_listener(TCPListener& l) {
+    if (!l.request_done) return true;
+    while (true) {
+      if (l.seq < ring.first_seq()) {
+        if (++l.skips > max_skips) return false;
+        l.seq = ring.end_seq() > 0 ? ring.end_seq() - 1 : 0;
+        l.offset = 0;
+      }
+
+      iovec iov[max_iov];
+      size_t iov_len = 0;
+      size_t total = 0;
+      if (l.pending_offset < l.pending.size()) {
+        iov[iov_len++] = {&l.pending[l.pending_offset], l.pending.size() - l.pending_offset};
+        total += l.pending.size() - l.pending_offset;
+      }
+      // the metadata block depends on where the audio ends, so stop at the next boundary
+      u64 seq = l.seq;
+      size_t offset = l.offset;
+      size_t until_meta = l.until_meta;
+      while (iov_len < max_iov) {
+        auto entry = ring.at(seq);
+        if (entry == nullptr) break;
+        size_t len = entry->chunk->data.size() - offset;
+        if (l.metaint > 0) len = min(len, until_meta);
+        if (len > 0) {
+          iov[iov_len++] = {(void*)(entry->chunk->data.data() + offset), len};
+          total += len;
+        }
+        if (l.metaint > 0) {
+          until_meta -= len;
+          if (until_meta == 0) break;
+        }
+        seq++;
+        offset = 0;
+      }
+      if (iov_len == 0) {
+        l.skips = 0;  // caught up
+        set_want_write(l, false);
+        return true;
+      }
+
+      msghdr msg;
+      memset(&msg, 0, sizeof msg);
+      msg.msg_iov = iov;
+      msg.msg_iovlen = iov_len;
+      ssize_t sent = sendmsg(l.sock, &msg, MSG_NOSIGNAL);
+      if (sent < 0) {
+        if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) {
+          set_want_write(l, true);
+          return true;
+        }
+        return false;
+      }
+
+      size_t remaining = static_cast<size_t>(sent);
+      size_t pending_left = l.pending.size() - l.pending_offset;
+      size_t from_pending = min(remaining, pending_left);
+      l.pending_offset += from_pending;
+      remaining -= from_pending;
+      while (remaining > 0 || (l.metaint > 0 && l.until_meta == 0)) {
+        auto entry = ring.at(l.seq);
+        if (l.metaint > 0 && l.until_meta == 0) {
+          queue_meta(l, entry != nullptr ? entry->meta : current_meta);
+          l.until_meta = l.metaint;
+          break;
+        }
+        size_t len = entry->chunk->data.size() - l.offset;
+        if (l.metaint > 0) len = min(len, l.until_meta);
+        size_t advance = min(len, remaining);
+        l.offset += advance;
+        remaining -= advance;
+        if (l.metaint > 0) l.until_meta -= advance;
+        if (l.offset == entry->chunk->data.size()) {
+          if (l.metaint > 0 && l.until_meta == 0) {
+            queue_meta(l, entry->meta);
+            l.until_meta = l.metaint;
+          }
+          l.seq++;
+          l.offset = 0;
+        }
+      }
+      if (static_cast<size_t>(sent) < total) {
+        set_want_write(l, true);
+        return true;
+      }
+    }
+  }
+
+  void drain_inbox() {
+    u64 counter;
+    while (read(event_fd, &counter, sizeof counter) > 0) {
+    }
+    deque<shared_ptr<const Chunk>> chunks;
+    {
+      lock_guard<mutex> lock_g(inbox_lock);
+      chunks.swap(inbox);
+    }
+    for (auto& chunk : chunks) {
+      if (chunk->part.meta_present && chunk->part.meta.size() > 0) {
+        current_meta = make_shared<const string>(chunk->part.meta);
+      }
+      ring.push(chunk, current_meta);
+    }
+  }
+
+  void start_tcp_server() {
+    try {
+      epoll_event events[256];
+      vector<conn_t> disconnected;
+      while (tcp_server_enabled) {
+        int num_events = epoll_wait(epoll_fd, events, 256, 100);
+        if (num_events < 0) {
+          if (errno == EINTR) continue;
+          throw runtime_error("epoll_wait failed");
+        }
+        bool new_chunks = false;
+        for (int i = 0; i < num_events; i++) {
+          int fd = events[i].data.fd;
+          u32 flags = events[i].events;
+          if (fd == sock) {
+            accept_listeners();
+            continue;
+          }
+          if (fd == event_fd) {
+            new_chunks = true;
+            continue;
+          }
+          auto it = listeners.find(fd);
+          if (it == listeners.end()) continue;
+          bool keep = !(flags & (EPOLLERR | EPOLLHUP));
+          if (keep && (flags & (EPOLLIN | EPOLLRDHUP))) keep = read_from_listener(it->second);
+          if (keep && (flags & EPOLLOUT)) keep = send_to_listener(it->second);
+          if (!keep) remove_listener(fd);
+        }
+        if (new_chunks) {
+          drain_inbox();
+          disconnected.clear();
+          for (auto& [fd, listener] : listeners) {
+            if (listener.want_write) continue;
+            if (!send_to_listener(listener)) disconnected.push_back(fd);
+          }
+          for (auto fd : disconnected) remove_listener(fd);
+        }
+      }
+    } catch (...) {
+      tcp_server_crashed = true;
+      tcp_server_enabled = false;
+      tcp_server_exception = current_exception();
+    }
+  }
+
+ public:
+  // `default_metaint` is used for listeners that ask for metadata without choosing an interval
+  // through their own icy-metaint request header.
+  TCPBroadcaster(u16 port, const string& radio_info, const vector<string>& upstream_headers,
+                 size_t default_metaint, size_t max_listeners = 10000)
+      : port(port),
+        max_listeners(max_listeners),
+        default_metaint(default_metaint),
+        radio_info(radio_info),
+        upstream_headers(upstream_headers),
+        ring(ring_capacity) {
+    sock = -1;
+    epoll_fd = -1;
+    event_fd = -1;
+    tcp_server_enabled = false;
+    tcp_server_crashed = false;
+  }
+
+  void init() override {
+    // every listener needs a descriptor, so allow as many as the hard limit permits
+    rlimit limit;
+    if (getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur < limit.rlim_max) {
+      limit.rlim_cur = limit.rlim_max;
+      setrlimit(RLIMIT_NOFILE, &limit);
+    }
+
+    sock = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (sock < 0) throw runtime_error("socket failed");
+    int optval = 1;
+    if (setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, (void*)&optval, sizeof optval) < 0)
+      throw runtime_error("setsockopt reuseaddr failed");
+
+    sockaddr_in address;
+    memset(&address, 0, sizeof address);
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = htonl(INADDR_ANY);
+    address.sin_port = htons(port);
+    if (bind(sock, (sockaddr*)&address, sizeof address) < 0) throw runtime_error("tcp bind failed");
+    if (listen(sock, SOMAXCONN) < 0) throw runtime_error("listen failed");
+
+    epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (epoll_fd < 0) throw runtime_error("epoll_create1 failed");
+    event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (event_fd < 0) throw runtime_error("eventfd failed");
+    epoll_add(sock, EPOLLIN);
+    epoll_add(event_fd, EPOLLIN);
+
+    tcp_server_enabled = true;
+    tcp_server = thread([this] { start_tcp_server(); });
+  }
+
+  void clean_up() override {
+    tcp_server_enabled = false;
+    if (tcp_server.joinable()) tcp_server.join();
+    for (auto& pair : listeners) close(pair.first);
+    listeners.clear();
+    if (event_fd >= 0) close(event_fd);
+    if (epoll_fd >= 0) close(epoll_fd);
+    if (sock >= 0) close(sock);
+    event_fd = epoll_fd = sock = -1;
+  }
+
+  ~TCPBroadcaster() {
+    try {
+      clean_up();
+    } catch (...) {
+      // ignore errors since this is a destructor
+    }
+  }
+
+  virtual void broadcast(const ICYPart& part, const u8* data) override {
+    broadcast_chunk(make_chunk(part, data));
+  }
+
+  virtual void broadcast_chunk(const shared_ptr<const Chunk>& chunk) override {
+    if (tcp_server_crashed) rethrow_exception(tcp_server_exception);
+    {
+      lock_guard<mutex> lock_g(inbox_lock);
+      if (inbox.size() >= ring_capacity) inbox.pop_front();  // the server thread fell behind
+      inbox.push_back(chunk);
+    }
+    u64 one = 1;
+    if (write(event_fd, &one, sizeof one) < 0 && errno != EAGAIN)
+      throw runtime_error("eventfd write failed");
+  }
+};
+
+#endif
@@ -0,0 +1,308 @@
+// A stand-in for an internet radio, used to test radio-proxy without network access. Serves a file
+// or generated MP3 frames over ICY at a fixed bitrate, with optional metadata and injected faults.
+//
+// The position in the stream follows the wall clock, so two servers started with the same
+// arguments serve the same bytes at the same time and can act as mirrors of one station.
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <chrono>
+#include <csignal>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <iterator>
+#include <memory>
+#include <regex>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+#include "../../common/types.hh"
+
+using namespace std;
+
+constexpr u32 MAX_PORT = 65535;
+constexpr u32 SAMPLE_RATE = 44100;
+constexpr u32 SAMPLES_PER_FRAME = 1152;
+
+struct ServerArgs {
+  u16 port;
+  string file;
+  u32 kbps;
+  u32 metaint;
+  u32 title_interval;  // seconds between title changes
+  string name;
+  u32 stall_every;  // seconds, 0 disables stalls
+  u32 stall_ms;
+  u32 disconnect_after;  // seconds, 0 disables disconnects
+  u32 slow_start_ms;
+
+  void parse(int argc, char** argv) {
+    if (argc % 2 != 1) throw runtime_error("wrong number of parameters");
+    bool port_set = false;
+    file = "";
+    kbps = 128;
+    metaint = 8192;
+    title_interval = 10;
+    name = "radio-icy-server";
+    stall_every = 0;
+    stall_ms = 0;
+    disconnect_after = 0;
+    slow_start_ms = 0;
+
+    for (int i = 1; i < argc; i += 2) {
+      string flag(argv[i]);
+      string value(argv[i + 1]);
+      if (flag == "-p") {
+        port_set = true;
+        u32 p = stoul(value);
+        if (p > MAX_PORT) throw runtime_error("port too high");
+        port = p;
+      } else if (flag == "-f") {
+        file = value;
+      } else if (flag == "-b") {
+        kbps = stoul(value);
+        if (kbps == 0) throw runtime_error("bitrate cannot be set to 0");
+      } else if (flag == "-m") {
+        metaint = stoul(value);
+      } else if (flag == "-i") {
+        title_interval = stoul(value);
+        if (title_interval == 0) throw runtime_error("title interval cannot be set to 0");
+      } else if (flag == "-n") {
+        name = value;
+      } else if (flag == "-E") {
+        stall_every = stoul(value);
+      } else if (flag == "-S") {
+        stall_ms = stoul(value);
+      } else if (flag == "-D") {
+        disconnect_after = stoul(value);
+      } else if (flag == "-W") {
+        slow_start_ms = stoul(value);
+      } else {
+        throw runtime_error("unexpected flag: " + flag);
+      }
+    }
+    if (!port_set) throw runtime_error("port was not set");
+  }
+};
+
+i64 now_ms() {
+  return chrono::duration_cast<chrono::milliseconds>(chrono::system_clock::now().time_since_epoch())
+      .count();
+}
+
+// Produces the audio bytes of the station. Without a file, it generates MPEG-1 Layer III frame
+// headers followed by a payload that starts with the frame number (7 bits per byte, so the payload
+// never looks like a frame sync) and is otherwise filler.
+class AudioSource {
+  const vector<u8>* file_data;
+  u32 kbps;
+  u8 bitrate_index;
+
+  u64 file_offset;
+  u64 frame_no;
+  u32 padding_acc;
+  vector<u8> frame;
+  size_t frame_offset;
+
+  void generate_frame() {
+    u32 numerator = 144000 * kbps;
+    size_t frame_len = numerator / SAMPLE_RATE;
+    padding_acc += numerator % SAMPLE_RATE;
+    bool padding = padding_acc >= SAMPLE_RATE;
+    if (padding) {
+      padding_acc -= SAMPLE_RATE;
+      frame_len++;
+    }
+    frame.assign(frame_len, 0);
+    frame[0] = 0xFF;
+    frame[1] = 0xFB;  // MPEG-1, Layer III, no CRC
+    frame[2] = (bitrate_index << 4) | (padding ? 0x02 : 0x00);  // 44100 Hz
+    frame[3] = 0x44;                                             // joint stereo
+    for (int i = 0; i < 4; i++) frame[4 + i] = (frame_no >> (7 * (3 - i))) & 0x7F;
+    for (size_t i = 8; i < frame_len; i++) frame[i] = (frame_no + i) & 0x7F;
+    frame_no++;
+    frame_offset = 0;
+  }
+
+ public:
+  AudioSource(const vector<u8>& file_data, u32 kbps, i64 start_ms)
+      : file_data(&file_data), kbps(kbps), padding_acc(0), frame_offset(0) {
+    static const u32 bitrates[] = {0,   32,  40,  48,  56,  64,  80, 96,
+                                   112, 128, 160, 192, 224, 256, 320};
+    bitrate_index = 0;
+    for (u8 i = 1; i < 15; i++) {
+      if (bitrates[i] == kbps) bitrate_index = i;
+    }
+    if (file_data.empty() && bitrate_index == 0)
+      throw runtime_error("generated frames need an MPEG-1 Layer III bitrate");
+
+    u64 byte_rate = kbps * 1000 / 8;
+    file_offset = file_data.empty() ? 0 : (start_ms * byte_rate / 1000) % file_data.size();
+    frame_no = start_ms * SAMPLE_RATE / SAMPLES_PER_FRAME / 1000;
+  }
+
+  void next(u8* buf, size_t len) {
+    for (size_t i = 0; i < len;) {
+      if (!file_data->empty()) {
+        size_t n = min<size_t>(len - i, file_data->size() - file_offset);
+        memcpy(buf + i, file_data->data() + file_offset, n);
+        file_offset = (file_offset + n) % file_data->size();
+        i += n;
+      } else {
+        if (frame_offset == frame.size()) generate_frame();
+        size_t n = min(len - i, frame.size() - frame_offset);
+        memcpy(buf + i, frame.data() + frame_offset, n);
+        frame_offset += n;
+        i += n;
+      }
+    }
+  }
+};
+
+void send_all(conn_t sock, const u8* data, size_t len) {
+  size_t sent = 0;
+  while (sent < len) {
+    ssize_t res = send(sock, data + sent, len - sent, MSG_NOSIGNAL);
+    if (res <= 0) throw runtime_error("send failed");
+    sent += res;
+  }
+}
+
+string read_request(conn_t sock) {
+  string request;
+  char buf[1024];
+  while (request.find("\r\n\r\n") == string::npos) {
+    ssize_t res = read(sock, buf, sizeof buf);
+    if (res <= 0) throw runtime_error("failed to read the request");
+    request.append(buf, res);
+    if (request.size() > 16384) throw runtime_error("request too long");
+  }
+  return request;
+}
+
+void serve(conn_t sock, const ServerArgs& args, const vector<u8>& file_data) {
+  static regex rg_meta("\r\nicy-metadata:[ \t]*1[ \t]*\r\n",
+                       regex_constants::ECMAScript | regex_constants::icase);
+  string request = read_request(sock);
+  bool meta = args.metaint > 0 && regex_search(request, rg_meta);
+
+  this_thread::sleep_for(chrono::milliseconds(args.slow_start_ms));
+  string response = "ICY 200 OK\r\nicy-name:" + args.name + "\r\nicy-br:" + to_string(args.kbps) +
+                    "\r\ncontent-type:audio/mpeg\r\n";
+  if (meta) response += "icy-metaint:" + to_string(args.metaint) + "\r\n";
+  response += "\r\n";
+  send_all(sock, (const u8*)response.c_str(), response.size());
+
+  const u64 byte_rate = args.kbps * 1000 / 8;
+  const i64 tick_ms = 20;
+  i64 connected_at = now_ms();
+  i64 position_ms = connected_at;  // wall clock time of the next byte to send
+  u64 sent = 0;                    // since position_ms
+  i64 last_stall = connected_at;
+  u64 until_meta = args.metaint;
+  string last_title;
+  AudioSource source(file_data, args.kbps, position_ms);
+  vector<u8> buf;
+
+  while (true) {
+    i64 current_time = now_ms();
+    if (args.disconnect_after > 0 && current_time - connected_at >= args.disconnect_after * 1000)
+      return;
+    if (args.stall_every > 0 && current_time - last_stall >= args.stall_every * 1000) {
+      this_thread::sleep_for(chrono::milliseconds(args.stall_ms));
+      // like an encoder that lost its input, resume at the live position
+      current_time = last_stall = now_ms();
+      position_ms = current_time;
+      sent = 0;
+      source = AudioSource(file_data, args.kbps, position_ms);
+    }
+
+    u64 due = (current_time - position_ms) * byte_rate / 1000 - sent;
+    while (due > 0) {
+      size_t len = meta ? min<u64>(due, until_meta) : due;
+      buf.resize(len);
+      source.next(buf.data(), len);
+      send_all(sock, buf.data(), len);
+      sent += len;
+      due -= len;
+      if (!meta) continue;
+      until_meta -= len;
+      if (until_meta > 0) continue;
+
+      string title = "StreamTitle='" + args.name + " track " +
+                     to_string(current_time / 1000 / args.title_interval) + "';";
+      string block(1, '\0');
+      if (title != last_title) {
+        size_t blocks = (title.size() + 15) / 16;
+        block.assign(1 + blocks * 16, '\0');
+        block[0] = static_cast<char>(blocks);
+        memcpy(&block[1], title.data(), title.size());
+        last_title = title;
+      }
+      send_all(sock, (const u8*)block.data(), block.size());
+      until_meta = args.metaint;
+    }
+    this_thread::sleep_for(chrono::milliseconds(tick_ms));
+  }
+}
+
+int main(int argc, char** argv) {
+  ServerArgs args;
+  try {
+    args.parse(argc, argv);
+  } catch (exception& e) {
+    cerr << "Failed to parse command line arguments. Reason: " << e.what() << endl << endl;
+    cerr << "Usage: " << argv[0] << " -p port [-f file] [-b kbps] [-m metaint] [-i seconds]"
+         << " [-n name] [-E stall_every_s] [-S stall_ms] [-D disconnect_after_s] [-W slow_start_ms]"
+         << endl;
+    return 1;
+  }
+  signal(SIGPIPE, SIG_IGN);
+
+  try {
+    vector<u8> file_data;
+    if (args.file != "") {
+      ifstream in(args.file, ios::binary);
+      if (!in) throw runtime_error("failed to open " + args.file);
+      file_data.assign(istreambuf_iterator<char>(in), istreambuf_iterator<char>());
+      if (file_data.empty()) throw runtime_error("file is empty");
+    }
+    // check the arguments before accepting anyone
+    AudioSource(file_data, args.kbps, 0);
+
+    conn_t sock = socket(AF_INET, SOCK_STREAM, 0);
+    if (sock < 0) throw runtime_error("socket failed");
+    int optval = 1;
+    setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, (void*)&optval, sizeof optval);
+    sockaddr_in address;
+    memset(&address, 0, sizeof address);
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = htonl(INADDR_ANY);
+    address.sin_port = htons(args.port);
+    if (bind(sock, (sockaddr*)&address, sizeof address) < 0) throw runtime_error("bind failed");
+    if (listen(sock, SOMAXCONN) < 0) throw runtime_error("listen failed");
+
+    while (true) {
+      conn_t client = accept(sock, nullptr, nullptr);
+      if (client < 0) continue;
+      setsockopt(client, IPPROTO_TCP, TCP_NODELAY, (void*)&optval, sizeof optval);
+      thread([client, &args, &file_data] {
+        try {
+          serve(client, args, file_data);
+        } catch (exception& e) {
+          // the client went away
+        }
+        close(client);
+      }).detach();
+    }
+  } catch (exception& e) {
+    cerr << "An error occurred:" << endl;
+    cerr << e.what() << endl;
+    return 1;
+  }
+}
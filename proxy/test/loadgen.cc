@@ -0,0 +1,464 @@
+// Simulates many radio-client listeners of a radio-proxy and reports how well they are served.
+// Every listener has its own UDP socket (and so its own source port), sends a DISCOVER and then
+// KEEPALIVEs like radio-client does. A few threads serve all listeners with epoll and recvmmsg.
+//
+// The report is JSON. Loss is estimated from received audio bytes, since legacy AUDIO messages
+// have no sequence numbers: the best listener's byte rate is taken as the stream bitrate and every
+// listener is expected to receive that rate from its first audio datagram to the end of the run.
+// With -b yes, listeners negotiate BATCH messages, whose sequence numbers also give exact losses.
+
+#include <arpa/inet.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <cstring>
+#include <exception>
+#include <fstream>
+#include <iostream>
+#include <memory>
+#include <random>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+#include "../../common/types.hh"
+#include "../../common/wire.hh"
+
+using namespace std;
+
+constexpr u32 MAX_PORT = 65535;
+
+struct LoadgenArgs {
+  string host;
+  u16 port;
+  u32 listeners;
+  u32 threads;
+  u32 duration;      // seconds
+  u32 keepalive;     // milliseconds
+  u32 jitter;        // milliseconds of random spread added to every keepalive interval
+  u32 ramp;          // listeners started per second, 0 starts all at once
+  u32 gap;           // milliseconds without audio counted as a gap
+  string output;     // empty means stdout
+  bool per_listener;
+  bool batched;      // whether listeners negotiate BATCH messages
+
+  void parse(int argc, char** argv) {
+    if (argc % 2 != 1) throw runtime_error("wrong number of parameters");
+    bool host_set = false;
+    bool port_set = false;
+    bool per_listener_set = false;
+    listeners = 100;
+    threads = 4;
+    duration = 30;
+    keepalive = 3500;
+    jitter = 500;
+    ramp = 2000;
+    gap = 500;
+    output = "";
+    batched = false;
+
+    for (int i = 1; i < argc; i += 2) {
+      string flag(argv[i]);
+      string value(argv[i + 1]);
+      if (flag == "-H") {
+        host_set = true;
+        host = value;
+      } else if (flag == "-P") {
+        port_set = true;
+        u32 p = stoul(value);
+        if (p > MAX_PORT) throw runtime_error("port too high");
+        port = p;
+      } else if (flag == "-n") {
+        listeners = stoul(value);
+      } else if (flag == "-t") {
+        threads = stoul(value);
+      } else if (flag == "-d") {
+        duration = stoul(value);
+      } else if (flag == "-k") {
+        keepalive = stoul(value);
+      } else if (flag == "-j") {
+        jitter = stoul(value);
+      } else if (flag == "-r") {
+        ramp = stoul(value);
+      } else if (flag == "-g") {
+        gap = stoul(value);
+      } else if (flag == "-o") {
+        output = value;
+      } else if (flag == "-b") {
+        if (value != "yes" && value != "no") throw runtime_error("unexpected value for -b");
+        batched = value == "yes";
+      } else if (flag == "-l") {
+        if (value != "yes" && value != "no") throw runtime_error("unexpected value for -l");
+        per_listener_set = true;
+        per_listener = value == "yes";
+      } else {
+        throw runtime_error("unexpected flag: " + flag);
+      }
+    }
+    if (!(host_set && port_set)) throw runtime_error("some required flags were not set");
+    if (listeners == 0 || threads == 0 || duration == 0 || keepalive == 0)
+      throw runtime_error("-n, -t, -d and -k cannot be set to 0");
+    threads = min(threads, listeners);
+    per_listener = per_listener_set ? per_listener : listeners <= 1000;
+  }
+};
+
+i64 now_us() {
+  return chrono::duration_cast<chrono::microseconds>(
+             chrono::steady_clock::now().time_since_epoch())
+      .count();
+}
+
+struct Listener {
+  conn_t sock = -1;
+  u16 local_port = 0;
+  i64 discover_at = -1;  // times in microseconds
+  i64 first_audio_at = -1;
+  i64 last_audio_at = -1;
+  i64 next_keepalive = 0;
+  u64 audio_bytes = 0;
+  u64 audio_msgs = 0;
+  u64 meta_msgs = 0;
+  u64 iam_msgs = 0;
+  u64 datagrams = 0;
+  i64 last_batch_seq = -1;
+  u64 batches_lost = 0;  // told by gaps in BATCH sequence numbers
+  u64 gaps = 0;
+  i64 max_gap = 0;
+  double mean_interarrival = 0;  // microseconds
+  double jitter = 0;             // mean deviation of inter-arrival times, microseconds
+};
+
+class Worker {
+  const LoadgenArgs& args;
+  sockaddr_in proxy;
+  vector<Listener> listeners;
+  size_t started;
+  int epoll_fd;
+  mt19937 rng;
+
+  static const size_t batch = 32;
+  static const size_t slot_size = 65536;
+  vector<u8> bufs;
+  mmsghdr msgs[batch];
+  iovec iovs[batch];
+
+  void send_msg(Listener& l, u16 type) {
+    u8 buf[HEADER_SIZE];
+    encode_header(buf, type, 0);
+    sendto(l.sock, buf, HEADER_SIZE, 0, (sockaddr*)&proxy, sizeof proxy);
+    if (!args.batched) return;
+    u8 caps[fixed_message_size<CAPS>()];
+    encode_caps(caps, CAP_BATCH);
+    sendto(l.sock, caps, sizeof caps, 0, (sockaddr*)&proxy, sizeof proxy);
+  }
+
+  void on_batch(Listener& l, const MessageView& msg, i64 t) {
+    BatchReader reader(msg);
+    if (l.last_batch_seq >= 0 && reader.seq > l.last_batch_seq)
+      l.batches_lost += reader.seq - l.last_batch_seq - 1;
+    l.last_batch_seq = reader.seq;
+    u8 kind;
+    const u8* data;
+    size_t len;
+    size_t audio_len = 0;
+    while (reader.next(kind, data, len)) {
+      if (kind == BATCH_AUDIO) audio_len += len;
+      if (kind == BATCH_METADATA) l.meta_msgs++;
+    }
+    if (audio_len > 0) on_audio(l, audio_len, t);
+  }
+
+  void start_listener(size_t index) {
+    Listener& l = listeners[index];
+    l.sock = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (l.sock < 0) throw runtime_error("socket failed, raise the open file limit");
+    int optval = 1;
+    setsockopt(l.sock, SOL_SOCKET, SO_BROADCAST, (void*)&optval, sizeof optval);
+    sockaddr_in local;
+    memset(&local, 0, sizeof local);
+    local.sin_family = AF_INET;
+    local.sin_addr.s_addr = htonl(INADDR_ANY);
+    local.sin_port = 0;
+    if (bind(l.sock, (sockaddr*)&local, sizeof local) < 0) throw runtime_error("bind failed");
+    socklen_t len = sizeof local;
+    getsockname(l.sock, (sockaddr*)&local, &len);
+    l.local_port = ntohs(local.sin_port);
+
+    epoll_event ev;
+    ev.events = EPOLLIN;
+    ev.data.u64 = index;
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, l.sock, &ev) < 0) throw runtime_error("epoll_ctl failed");
+
+    l.discover_at = now_us();
+    send_msg(l, DISCOVER);
+    l.next_keepalive = l.discover_at + uniform_int_distribution<i64>(0, args.keepalive * 1000)(rng);
+  }
+
+  void on_audio(Listener& l, size_t len, i64 t) {
+    if (l.first_audio_at < 0) {
+      l.first_audio_at = t;
+    } else {
+      i64 interarrival = t - l.last_audio_at;
+      if (interarrival > (i64)args.gap * 1000) l.gaps++;
+      l.max_gap = max(l.max_gap, interarrival);
+      if (l.audio_msgs == 1) l.mean_interarrival = interarrival;
+      l.mean_interarrival += (interarrival - l.mean_interarrival) / 16;
+      l.jitter += (fabs(interarrival - l.mean_interarrival) - l.jitter) / 16;
+    }
+    l.last_audio_at = t;
+    l.audio_bytes += len;
+    l.audio_msgs++;
+  }
+
+  void receive(Listener& l) {
+    while (true) {
+      int n = recvmmsg(l.sock, msgs, batch, MSG_DONTWAIT, nullptr);
+      if (n <= 0) return;
+      i64 t = now_us();
+      for (int i = 0; i < n; i++) {
+        MessageView msg;
+        if (decode_message((const u8*)iovs[i].iov_base, msgs[i].msg_len, msg) != DecodeStatus::OK)
+          continue;
+        l.datagrams++;
+        if (msg.type == BATCH) {
+          on_batch(l, msg, t);
+        } else if (msg.type == AUDIO) {
+          on_audio(l, msg.len, t);
+        } else if (msg.type == METADATA) {
+          l.meta_msgs++;
+        } else if (msg.type == IAM) {
+          l.iam_msgs++;
+        }
+      }
+      if (n < (int)batch) return;
+    }
+  }
+
+ public:
+  atomic<bool>* keep_running;
+  exception_ptr error;  // why run() stopped early, if it did
+
+  Worker(const LoadgenArgs& args, const sockaddr_in& proxy, size_t count, u32 seed,
+         atomic<bool>* keep_running)
+      : args(args), proxy(proxy), listeners(count), started(0), rng(seed), keep_running(keep_running) {
+    epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (epoll_fd < 0) throw runtime_error("epoll_create1 failed");
+    bufs.resize(batch * slot_size);
+    for (size_t i = 0; i < batch; i++) {
+      iovs[i] = {bufs.data() + i * slot_size, slot_size};
+      memset(&msgs[i], 0, sizeof msgs[i]);
+      msgs[i].msg_hdr.msg_iov = &iovs[i];
+      msgs[i].msg_hdr.msg_iovlen = 1;
+    }
+  }
+
+  ~Worker() {
+    for (auto& l : listeners) {
+      if (l.sock >= 0) close(l.sock);
+    }
+    close(epoll_fd);
+  }
+
+  const vector<Listener>& get_listeners() { return listeners; }
+
+  // Runs until keep_running is cleared. An error is stored in `error` and stops all workers, so
+  // the report still covers what was measured until then.
+  void run(i64 start, double ramp_per_us) {
+    try {
+      serve(start, ramp_per_us);
+    } catch (...) {
+      error = current_exception();
+      *keep_running = false;
+    }
+  }
+
+ private:
+  void serve(i64 start, double ramp_per_us) {
+    epoll_event events[256];
+    while (*keep_running) {
+      i64 t = now_us();
+      size_t due = ramp_per_us > 0 ? min<size_t>(listeners.size(), (t - start) * ramp_per_us + 1)
+                                   : listeners.size();
+      while (started < due) start_listener(started++);
+
+      int n = epoll_wait(epoll_fd, events, 256, 10);
+      for (int i = 0; i < n; i++) receive(listeners[events[i].data.u64]);
+
+      t = now_us();
+      for (size_t i = 0; i < started; i++) {
+        Listener& l = listeners[i];
+        if (t < l.next_keepalive) continue;
+        send_msg(l, KEEPALIVE);
+        i64 spread = args.jitter > 0 ? uniform_int_distribution<i64>(0, args.jitter * 1000)(rng) : 0;
+        l.next_keepalive = t + args.keepalive * 1000 + spread;
+      }
+    }
+  }
+};
+
+double percentile(vector<double> values, double p) {
+  if (values.empty()) return 0;
+  sort(values.begin(), values.end());
+  size_t index = min(values.size() - 1, (size_t)(p / 100 * values.size()));
+  return values[index];
+}
+
+string json_stats(const vector<double>& values) {
+  stringstream out;
+  out << "{\"p50\": " << percentile(values, 50) << ", \"p90\": " << percentile(values, 90)
+      << ", \"p99\": " << percentile(values, 99) << ", \"max\": " << percentile(values, 100)
+      << "}";
+  return out.str();
+}
+
+int main(int argc, char** argv) {
+  LoadgenArgs args;
+  try {
+    args.parse(argc, argv);
+  } catch (exception& e) {
+    cerr << "Failed to parse command line arguments. Reason: " << e.what() << endl << endl;
+    cerr << "Usage: " << argv[0] << " -H host -P port [-n listeners] [-t threads] [-d seconds]"
+         << " [-k keepalive_ms] [-j jitter_ms] [-r listeners_per_s] [-g gap_ms] [-o file]"
+         << " [-b yes|no] [-l yes|no]" << endl;
+    return 1;
+  }
+
+  try {
+    rlimit limit;
+    if (getrlimit(RLIMIT_NOFILE, &limit) == 0) {
+      limit.rlim_cur = limit.rlim_max;
+      setrlimit(RLIMIT_NOFILE, &limit);
+      if (limit.rlim_cur < args.listeners + 64)
+        cerr << "Warning: the open file limit (" << limit.rlim_cur << ") is too low" << endl;
+    }
+
+    addrinfo hints, *result;
+    memset(&hints, 0, sizeof hints);
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_DGRAM;
+    if (getaddrinfo(args.host.c_str(), nullptr, &hints, &result) != 0)
+      throw runtime_error("getaddrinfo failed");
+    sockaddr_in proxy = *(sockaddr_in*)result->ai_addr;
+    proxy.sin_port = htons(args.port);
+    freeaddrinfo(result);
+
+    atomic<bool> keep_running(true);
+    vector<unique_ptr<Worker>> workers;
+    for (u32 i = 0; i < args.threads; i++) {
+      size_t count = args.listeners / args.threads + (i < args.listeners % args.threads ? 1 : 0);
+      workers.push_back(make_unique<Worker>(args, proxy, count, 1234 + i, &keep_running));
+    }
+
+    i64 start = now_us();
+    double ramp_per_us = args.ramp > 0 ? (double)args.ramp / args.threads / 1e6 : 0;
+    vector<thread> threads;
+    for (auto& worker : workers) {
+      Worker* w = worker.get();
+      threads.emplace_back([w, start, ramp_per_us] { w->run(start, ramp_per_us); });
+    }
+    i64 deadline = start + (i64)args.duration * 1000000;
+    while (keep_running && now_us() < deadline) this_thread::sleep_for(chrono::milliseconds(100));
+    keep_running = false;
+    for (auto& t : threads) t.join();
+    i64 end = now_us();
+
+    bool failed = false;
+    for (auto& worker : workers) {
+      if (!worker->error) continue;
+      try {
+        rethrow_exception(worker->error);
+      } catch (exception& e) {
+        cerr << "A worker stopped the run early: " << e.what() << endl;
+      }
+      failed = true;
+    }
+
+    // the best listener's rate is taken as the stream bitrate, see the comment at the top
+    double best_rate = 0;  // bytes per microsecond
+    for (auto& worker : workers) {
+      for (auto& l : worker->get_listeners()) {
+        if (l.first_audio_at < 0 || end - l.first_audio_at < 1000000) continue;
+        best_rate = max(best_rate, (double)l.audio_bytes / (end - l.first_audio_at));
+      }
+    }
+
+    vector<double> ttfa, loss, jitter, max_gap;
+    u64 responding = 0, total_bytes = 0, total_msgs = 0, total_gaps = 0, batches_lost = 0;
+    stringstream per_listener;
+    bool first = true;
+    for (auto& worker : workers) {
+      for (auto& l : worker->get_listeners()) {
+        if (l.discover_at < 0) continue;
+        double l_loss = 1;
+        if (l.first_audio_at >= 0) {
+          responding++;
+          ttfa.push_back((l.first_audio_at - l.discover_at) / 1000.0);
+          double expected = best_rate * (end - l.first_audio_at);
+          l_loss = expected > 0 ? max(0.0, 1 - l.audio_bytes / expected) : 0;
+          jitter.push_back(l.jitter / 1000.0);
+          max_gap.push_back(l.max_gap / 1000.0);
+        }
+        loss.push_back(l_loss);
+        total_bytes += l.audio_bytes;
+        total_msgs += l.datagrams;
+        batches_lost += l.batches_lost;
+        total_gaps += l.gaps;
+        if (!args.per_listener) continue;
+        per_listener << (first ? "" : ",") << "\n    {\"port\": " << l.local_port
+                     << ", \"ttfa_ms\": "
+                     << (l.first_audio_at >= 0 ? (l.first_audio_at - l.discover_at) / 1000.0 : -1)
+                     << ", \"audio_bytes\": " << l.audio_bytes << ", \"audio_msgs\": "
+                     << l.audio_msgs << ", \"meta_msgs\": " << l.meta_msgs
+                     << ", \"iam_msgs\": " << l.iam_msgs << ", \"datagrams\": " << l.datagrams
+                     << ", \"batches_lost\": " << l.batches_lost << ", \"loss\": " << l_loss
+                     << ", \"gaps\": " << l.gaps << ", \"max_gap_ms\": " << l.max_gap / 1000.0
+                     << ", \"jitter_ms\": " << l.jitter / 1000.0 << "}";
+        first = false;
+      }
+    }
+
+    double seconds = (end - start) / 1e6;
+    double mean_loss = 0;
+    for (auto x : loss) mean_loss += x;
+    mean_loss = loss.empty() ? 0 : mean_loss / loss.size();
+
+    stringstream report;
+    report << "{\n  \"config\": {\"host\": \"" << args.host << "\", \"port\": " << args.port
+           << ", \"listeners\": " << args.listeners << ", \"threads\": " << args.threads
+           << ", \"duration_s\": " << args.duration << ", \"keepalive_ms\": " << args.keepalive
+           << ", \"ramp_per_s\": " << args.ramp
+           << ", \"batched\": " << (args.batched ? "true" : "false") << "},\n"
+           << "  \"summary\": {\"responding\": " << responding
+           << ", \"stream_kbps\": " << best_rate * 1e6 * 8 / 1000
+           << ", \"rx_mbps\": " << total_bytes * 8 / seconds / 1e6
+           << ", \"rx_datagrams_per_s\": " << total_msgs / seconds
+           << ", \"loss_mean\": " << mean_loss << ", \"batches_lost\": " << batches_lost
+           << ", \"gaps\": " << total_gaps
+           << ",\n    \"ttfa_ms\": " << json_stats(ttfa) << ",\n    \"loss\": " << json_stats(loss)
+           << ",\n    \"jitter_ms\": " << json_stats(jitter)
+           << ",\n    \"max_gap_ms\": " << json_stats(max_gap) << "}";
+    if (args.per_listener) report << ",\n  \"listeners\": [" << per_listener.str() << "\n  ]";
+    report << "\n}\n";
+
+    if (args.output == "") {
+      cout << report.str();
+    } else {
+      ofstream out(args.output);
+      out << report.str();
+    }
+    return failed ? 1 : 0;
+  } catch (exception& e) {
+    cerr << "An error occurred:" << endl;
+    cerr << e.what() << endl;
+    return 1;
+  }
+}
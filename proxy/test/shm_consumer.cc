@@ -0,0 +1,57 @@
+// Example consumer of the shared-memory ring published by `radio-proxy -S name`. Writes the audio
+// to stdout and the metadata to stderr, like radio-proxy does without -P.
+
+#include <csignal>
+#include <cstdio>
+#include <iostream>
+#include <string>
+#include <vector>
+#include "../shmring.hh"
+
+using namespace std;
+
+volatile sig_atomic_t keep_running = 1;
+
+int main(int argc, char** argv) {
+  if (argc != 2) {
+    cerr << "Usage: " << argv[0] << " name" << endl;
+    return 1;
+  }
+  signal(SIGINT, [](int) { keep_running = 0; });
+  signal(SIGTERM, [](int) { keep_running = 0; });
+
+  try {
+    ShmReader reader(argv[1]);
+    reader.open_ring();
+    cerr << "Reading " << reader.get_radio_info() << endl;
+
+    ShmRecord record;
+    vector<u8> copy;
+    u64 torn = 0;
+    while (keep_running) {
+      if (!reader.next(record, 100)) {
+        if (reader.writer_closed()) break;
+        continue;
+      }
+      // the writer may reuse the slot meanwhile, so the record is copied and only used if it was
+      // not; a torn record is skipped, its slot already holds a newer one
+      copy.assign(record.data, record.data + record.len);
+      if (!reader.still_valid(record)) {
+        torn++;
+        continue;
+      }
+      if (record.type == SHM_AUDIO) {
+        fwrite(copy.data(), 1, copy.size(), stdout);
+      } else if (record.type == SHM_METADATA) {
+        cerr << string(copy.begin(), copy.end()) << endl;
+      }
+    }
+    fflush(stdout);
+    cerr << "Lost records: " << reader.get_lost() << ", torn records: " << torn << endl;
+    return 0;
+  } catch (exception& e) {
+    cerr << "An error occurred:" << endl;
+    cerr << e.what() << endl;
+    return 1;
+  }
+}